@@ -0,0 +1,295 @@
+#include <dlfcn.h>
+#include <sstream>
+#include <set>
+
+/**
+ * EVM2 to C ahead-of-time translator
+ *
+ * Whole program becomes single C function with the JITFunction signature:
+ *   void evm_program(void* memory, uint64_t* registers, size_t entry_point, const JITInterface_t* iface)
+ *
+ *   - EVM registers are locals, they are written back to registers[] only
+ *     before createThread (child thread copies them)
+ *   - jump/call targets are labels, entry_point is bit offset of the first
+ *     instruction to execute (0 for main thread, label for new threads)
+ *   - CALL/RET use local stack of return labels (GNU labels as values),
+ *     with shadow stack depth its overflow and underflow are faults as in
+ *     the JIT
+ *   - host interface is reached through iface argument
+ *   - instrumented blocks count into iface->block_counters like the JIT
+ *
+ * Arithmetic follows ARM64 JIT semantics (division by zero gives 0,
+ * modulo by zero gives dividend), so both engines produce same output.
+ * Translated source is compiled with system C compiler into a shared object
+ * and loaded with dlopen.
+ */
+class AOTCompilerC {
+    enum {
+        callDepth = 1 << 16
+    };
+
+    void* handle = nullptr;
+
+    static std::string reg(int r) {
+        return "r" + std::to_string(r);
+    }
+
+    static std::string load(const EVM2::Arg& op) {
+        switch (op.kind)
+        {
+            case EVM2::Arg::Kind::REG:
+                return reg(op.reg);
+            case EVM2::Arg::Kind::MEM:
+                return "ld" + std::to_string(op.sizeBytes*8) + "(m, " + reg(op.reg) + ")";
+            case EVM2::Arg::Kind::ADDR:
+                return std::to_string(op.addr) + "u";
+            default:
+                assert(0);
+        }
+        return {};
+    }
+
+    static std::string store(const EVM2::Arg& op, const std::string& value) {
+        switch (op.kind)
+        {
+            case EVM2::Arg::Kind::REG:
+                return reg(op.reg) + " = " + value + ";";
+            case EVM2::Arg::Kind::MEM:
+                return "st" + std::to_string(op.sizeBytes*8) + "(m, " + reg(op.reg) + ", " + value + ");";
+            default:
+                assert(0);
+        }
+        return {};
+    }
+
+    static std::string label(EVM2::Arg::addr_t addr) {
+        return "L" + std::to_string(addr);
+    }
+
+public:
+    AOTCompilerC() = default;
+
+    ~AOTCompilerC() {
+        if (handle)
+            dlclose(handle);
+    }
+
+    /**
+     * Write C source of the program, options other than instrumentBlocks
+     * and shadowStackDepth do not apply
+     */
+    static void translate(const EVM2::Disassembler& disasm, std::ostream& os, const CompileOptions& options = {}) {
+        const auto& instructions = disasm.getInstructions();
+        BlockLayout layout(instructions, nullptr);
+        // same capacity as the JIT shadow stack, its first slot is the underflow handler
+        size_t depth = options.shadowStackDepth ? std::bit_ceil(options.shadowStackDepth + 1) - 1 : callDepth;
+        std::set<EVM2::Arg::addr_t> labels;
+        std::set<EVM2::Arg::addr_t> entries;
+        std::set<EVM2::Arg::addr_t> offsets;
+
+        for (const EVM2::Instruction& i : instructions)
+        {
+            offsets.insert(i.bitOffset);
+            if (i.opcode == EVM2::Op::JUMP || i.opcode == EVM2::Op::JUMPEQ || i.opcode == EVM2::Op::CALL)
+                labels.insert(i.args[0].addr);
+            if (i.opcode == EVM2::Op::CREATETHREAD)
+                entries.insert(i.args[0].addr);
+        }
+        labels.insert(entries.begin(), entries.end());
+        for (EVM2::Arg::addr_t target : labels)
+            assert(offsets.contains(target));
+
+        os << "#include <stdint.h>\n"
+              "#include <stddef.h>\n"
+              "#include <string.h>\n"
+              "\n"
+              "typedef struct {\n"
+              "    void (*print_value)(uint64_t value);\n"
+              "    uint64_t (*read_value)(void);\n"
+              "    void (*terminate)(void);\n"
+              "    uint64_t (*thread_create)(uint64_t label);\n"
+              "    void (*thread_join)(uint64_t id);\n"
+              "    void (*thread_sleep)(uint64_t ms);\n"
+              "    void (*thread_lock)(uint64_t id);\n"
+              "    void (*thread_unlock)(uint64_t id);\n"
+              "    uint64_t (*file_read)(uint64_t ofs, uint64_t toRead, uint64_t addr);\n"
+              "    void (*file_write)(uint64_t ofs, uint64_t toWrite, uint64_t addr);\n"
+              "    uint64_t* (*shadow_stack)(uint64_t bytes);\n"
+              "    void (*shadow_stack_fault)(uint64_t underflow);\n"
+              "    uint64_t* block_counters;\n"
+              "} JITInterface_t;\n"
+              "\n";
+
+        for (int bits : {8, 16, 32, 64})
+        {
+            std::string t = "uint" + std::to_string(bits) + "_t";
+            os << "static inline uint64_t ld" << bits << "(uint8_t* m, uint64_t a) { "
+               << t << " v; memcpy(&v, m + (uint32_t)a, sizeof(v)); return v; }\n";
+            os << "static inline void st" << bits << "(uint8_t* m, uint64_t a, uint64_t v) { "
+               << t << " t = (" << t << ")v; memcpy(m + (uint32_t)a, &t, sizeof(t)); }\n";
+        }
+
+        os << "\n"
+              "static inline uint64_t sdiv(uint64_t a, uint64_t b) {\n"
+              "    if (b == 0) return 0;\n"
+              "    if ((int64_t)b == -1) return 0 - a;\n"
+              "    return (uint64_t)((int64_t)a / (int64_t)b);\n"
+              "}\n"
+              "static inline uint64_t umod(uint64_t a, uint64_t b) { return b ? a % b : a; }\n"
+              "static inline uint64_t signum(uint64_t a) { return (uint64_t)(((int64_t)a > 0) - ((int64_t)a < 0)); }\n"
+              "\n"
+              "void evm_program(void* memory, uint64_t* registers, size_t entry, const JITInterface_t* iface)\n"
+              "{\n"
+              "    uint8_t* m = (uint8_t*)memory;\n"
+              "    void* stack[" << depth << "];\n"
+              "    size_t sp = 0;\n"
+              "    uint64_t* counters = iface->block_counters;\n";
+        for (int r = 0; r < 16; r++)
+            os << "    uint64_t " << reg(r) << " = registers[" << r << "];\n";
+
+        os << "\n    switch (entry)\n    {\n";
+        for (EVM2::Arg::addr_t target : entries)
+            os << "        case " << target << ": goto " << label(target) << ";\n";
+        os << "        default: break;\n    }\n\n";
+
+        size_t returns = 0;
+        for (size_t k = 0; k < instructions.size(); k++)
+        {
+            const EVM2::Instruction& i = instructions[k];
+            if (labels.contains(i.bitOffset))
+                os << label(i.bitOffset) << ":\n";
+            if (options.instrumentBlocks && layout.block(layout.blockOf(k)).first == k)
+                os << "    counters[" << 2*k << "]++;\n";
+
+            const auto& a = i.args;
+            os << "    ";
+            switch (i.opcode)
+            {
+                case EVM2::Op::MOV:
+                    os << store(a[1], load(a[0]));
+                    break;
+                case EVM2::Op::LOADCONST:
+                    os << store(a[1], std::to_string((uint64_t)a[0].constValue) + "ull");
+                    break;
+                case EVM2::Op::ADD:
+                    os << store(a[2], load(a[0]) + " + " + load(a[1]));
+                    break;
+                case EVM2::Op::SUB:
+                    os << store(a[2], load(a[0]) + " - " + load(a[1]));
+                    break;
+                case EVM2::Op::MUL:
+                    os << store(a[2], load(a[0]) + " * " + load(a[1]));
+                    break;
+                case EVM2::Op::DIV:
+                    os << store(a[2], "sdiv(" + load(a[0]) + ", " + load(a[1]) + ")");
+                    break;
+                case EVM2::Op::MOD:
+                    os << store(a[2], "umod(" + load(a[0]) + ", " + load(a[1]) + ")");
+                    break;
+                case EVM2::Op::COMPARE:
+                    // difference is stored first, same as JIT (matters for narrow memory operand)
+                    os << store(a[2], load(a[0]) + " - " + load(a[1])) << " "
+                       << store(a[2], "signum(" + load(a[2]) + ")");
+                    break;
+                case EVM2::Op::JUMP:
+                    os << "goto " << label(a[0].addr) << ";";
+                    break;
+                case EVM2::Op::JUMPEQ:
+                    os << "if (" << load(a[1]) << " == " << load(a[2]) << ") goto " << label(a[0].addr) << ";";
+                    if (options.instrumentBlocks)
+                        os << " counters[" << 2*k + 1 << "]++;";
+                    break;
+                case EVM2::Op::READ:
+                    os << store(a[3], "iface->file_read(" + load(a[0]) + ", " + load(a[1]) + ", " + load(a[2]) + ")");
+                    break;
+                case EVM2::Op::WRITE:
+                    os << "iface->file_write(" << load(a[0]) << ", " << load(a[1]) << ", " << load(a[2]) << ");";
+                    break;
+                case EVM2::Op::CONSOLEREAD:
+                    os << store(a[0], "iface->read_value()");
+                    break;
+                case EVM2::Op::CONSOLEWRITE:
+                    os << "iface->print_value(" << load(a[0]) << ");";
+                    break;
+                case EVM2::Op::CREATETHREAD:
+                    for (int r = 0; r < 16; r++)
+                        os << "registers[" << r << "] = " << reg(r) << "; ";
+                    os << "\n    " << store(a[1], "iface->thread_create(" + load(a[0]) + ")");
+                    break;
+                case EVM2::Op::JOINTHREAD:
+                    os << "iface->thread_join(" << load(a[0]) << ");";
+                    break;
+                case EVM2::Op::HLT:
+                    os << "iface->terminate();";
+                    break;
+                case EVM2::Op::SLEEP:
+                    os << "iface->thread_sleep(" << load(a[0]) << ");";
+                    break;
+                case EVM2::Op::CALL:
+                    os << "if (sp == " << depth << ") " << (options.shadowStackDepth ? "iface->shadow_stack_fault(0); " : "iface->terminate(); ")
+                       << "stack[sp++] = &&R" << returns << "; goto " << label(a[0].addr) << "; "
+                       << "R" << returns << ":;";
+                    returns++;
+                    break;
+                case EVM2::Op::RET:
+                    os << (options.shadowStackDepth ? "if (sp == 0) iface->shadow_stack_fault(1); " : "if (sp == 0) return; ")
+                       << "goto *stack[--sp];";
+                    break;
+                case EVM2::Op::LOCK:
+                    os << "iface->thread_lock(" << load(a[0]) << ");";
+                    break;
+                case EVM2::Op::UNLOCK:
+                    os << "iface->thread_unlock(" << load(a[0]) << ");";
+                    break;
+                default:
+                    assert(0);
+            }
+            os << "\n";
+        }
+        os << "    return;\n}\n";
+    }
+
+    /**
+     * Translate, compile with host C compiler ($CC or cc) and load the program
+     */
+    JITFunction compile(const EVM2::Disassembler& disasm, const CompileOptions& options = {}) {
+        char dir[] = "/tmp/evm2aot.XXXXXX";
+        if (!mkdtemp(dir))
+            return nullptr;
+
+        std::string source = std::string(dir) + "/program.c";
+        std::string library = std::string(dir) + "/program.so";
+
+        {
+            std::ofstream f(source);
+            translate(disasm, f, options);
+        }
+
+        const char* cc = getenv("CC");
+        std::string command = std::string(cc ? cc : "cc") + " -O2 -shared -fPIC -o " + library + " " + source;
+        int status = system(command.c_str());
+
+        if (status == 0)
+            handle = dlopen(library.c_str(), RTLD_NOW | RTLD_LOCAL);
+
+        unlink(source.c_str());
+        unlink(library.c_str());
+        rmdir(dir);
+
+        if (!handle)
+            return nullptr;
+
+        void* func = dlsym(handle, "evm_program");
+        assert(func);
+
+        return (JITFunction)func;
+    }
+
+    /**
+     * Entry point of the main thread
+     */
+    size_t entry()
+    {
+        return 0;
+    }
+};
@@ -0,0 +1,450 @@
+#include <algorithm>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <string>
+#include <vector>
+
+/**
+ * Native EASM assembler, drop-in replacement of res/compiler.py
+ *
+ * Accepts the same syntax and writes byte-identical EVM2 files, messages and
+ * exit codes match too (parser error 2, assembler error 3):
+ *   - pass 1 reads lines, sections, labels, code and data, checks opcodes,
+ *     argument counts and registers
+ *   - pass 2 encodes instructions with opcodeTable and the bit layout of
+ *     Encoder, backward labels are resolved at once, forward ones patched
+ *     at the end
+ * Inputs compiler.py fails on with a Python exception (malformed numbers,
+ * negative constants or data, missing .dataSize, label past the last
+ * instruction) are reported as parser or assembler errors.
+ */
+class Assembler {
+public:
+    enum Result {
+        ok = 0,
+        ioError = 1,
+        parserError = 2,
+        assemblerError = 3
+    };
+
+private:
+    struct Line {
+        EVM2::Op opcode;
+        std::vector<EVM2::Arg> args;        // REG/MEM parsed, CONST/ADDR resolved in pass 2
+        std::vector<std::string> texts;     // argument text of constants and labels
+    };
+
+    std::vector<Line> code;
+    std::map<std::string, size_t> codeLabels;   // label -> instruction index
+    std::map<std::string, size_t> dataLabels;
+    std::vector<uint8_t> data;
+    bool hasDataSize = false;
+    uint64_t dataSize = 0;
+    std::string message;
+
+    enum class Mode { none, code, data } mode = Mode::none;
+
+    static const std::map<std::string, EVM2::Op>& opcodes() {
+        static const std::map<std::string, EVM2::Op> names = [] {
+            std::map<std::string, EVM2::Op> m;
+            for (const auto& [bits, op] : EVM2::opcodeTable)
+                m[EVM2::opToString(op)] = op;
+            return m;
+        }();
+        return names;
+    }
+
+    // argument kinds as in compiler.py: R register or memory, C constant, L label
+    static const char* signature(EVM2::Op op) {
+        switch (op)
+        {
+            case EVM2::Op::MOV: return "RR";
+            case EVM2::Op::LOADCONST: return "CR";
+            case EVM2::Op::ADD:
+            case EVM2::Op::SUB:
+            case EVM2::Op::DIV:
+            case EVM2::Op::MOD:
+            case EVM2::Op::MUL:
+            case EVM2::Op::COMPARE:
+            case EVM2::Op::WRITE: return "RRR";
+            case EVM2::Op::JUMP:
+            case EVM2::Op::CALL: return "L";
+            case EVM2::Op::JUMPEQ: return "LRR";
+            case EVM2::Op::READ: return "RRRR";
+            case EVM2::Op::CREATETHREAD: return "LR";
+            case EVM2::Op::CONSOLEREAD:
+            case EVM2::Op::CONSOLEWRITE:
+            case EVM2::Op::JOINTHREAD:
+            case EVM2::Op::SLEEP:
+            case EVM2::Op::LOCK:
+            case EVM2::Op::UNLOCK: return "R";
+            default: return "";
+        }
+    }
+
+    // whitespace of Python str.split()
+    static bool isSpace(char c) {
+        return c == ' ' || (c >= '\t' && c <= '\r') || (c >= '\x1c' && c <= '\x1f');
+    }
+
+    static bool isDigit(char c, unsigned base) {
+        unsigned v = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'z' ? c - 'a' + 10 : c >= 'A' && c <= 'Z' ? c - 'A' + 10 : 99;
+        return v < base;
+    }
+
+    /**
+     * Python int(text, base) for base 0 (prefixed), 10 and 16, fails on syntax
+     * and on magnitude over 64 bits
+     */
+    static bool parseInteger(const std::string& text, unsigned base, bool& negative, uint64_t& value) {
+        size_t i = 0;
+        negative = false;
+        if (i < text.size() && (text[i] == '+' || text[i] == '-'))
+            negative = text[i++] == '-';
+
+        bool prefixed = false;
+        if (text.size() - i >= 2 && text[i] == '0')
+        {
+            char p = (char)(text[i + 1] | 0x20);
+            unsigned prefixBase = p == 'x' ? 16 : p == 'o' ? 8 : p == 'b' ? 2 : 0;
+            if (prefixBase && (base == 0 || base == prefixBase))
+            {
+                base = prefixBase;
+                prefixed = true;
+                i += 2;
+            }
+        }
+        bool decimal = base == 0;
+        if (decimal)
+            base = 10;
+
+        // digits with single underscores between them, after prefix one may lead
+        size_t digits = 0;
+        bool nonZero = false, leadingZero = false;
+        value = 0;
+        for (bool underscore = false; i < text.size(); i++)
+        {
+            if (text[i] == '_' && !underscore && (digits || prefixed))
+            {
+                underscore = true;
+                continue;
+            }
+            if (!isDigit(text[i], base))
+                return false;
+            unsigned d = isDigit(text[i], 10) ? text[i] - '0' : (text[i] | 0x20) - 'a' + 10;
+            if (value > (UINT64_MAX - d) / base)
+                return false;
+            value = value * base + d;
+            leadingZero = leadingZero || (!digits && d == 0);
+            nonZero = nonZero || d;
+            digits++;
+            underscore = false;
+        }
+        if (!digits || text.back() == '_')
+            return false;
+        // "010" is not allowed without base
+        return !(decimal && !prefixed && leadingZero && nonZero);
+    }
+
+    bool parseError(const std::string& text) {
+        message = text;
+        return false;
+    }
+
+    bool parseSection(const std::vector<std::string>& tokens) {
+        if (tokens[0] == ".dataSize")
+        {
+            if (hasDataSize)
+                return parseError("Double data size spotted");
+            bool negative;
+            if (tokens.size() < 2 || !parseInteger(tokens[1], 10, negative, dataSize) || (negative && dataSize) || dataSize > UINT32_MAX)
+                return parseError("Bad data size");
+            hasDataSize = true;
+        }
+        else if (tokens[0] == ".code")
+            mode = Mode::code;
+        else if (tokens[0] == ".data")
+            mode = Mode::data;
+        else
+            return parseError("Bad token");
+        return true;
+    }
+
+    bool parseLabel(const std::string& token) {
+        if (mode == Mode::none)
+            return parseError("Bad label");
+        std::string label = token.substr(0, token.size() - 1);
+        auto& labels = mode == Mode::code ? codeLabels : dataLabels;
+        if (!labels.emplace(label, mode == Mode::code ? code.size() : data.size()).second)
+            return parseError("Duplicated label");
+        return true;
+    }
+
+    // r<id> or <size>[r<id>], prefix match like re.match in compiler.py
+    bool parseRegister(const std::string& text, EVM2::Arg& arg) {
+        static const std::pair<const char*, uint8_t> sizes[] = {{"byte", 1}, {"word", 2}, {"dword", 4}, {"qword", 8}};
+        size_t i = 0;
+        arg.kind = EVM2::Arg::Kind::REG;
+        if (!(text.size() >= 2 && text[0] == 'r' && isDigit(text[1], 10)))
+        {
+            for (const auto& [name, bytes] : sizes)
+            {
+                if (text.compare(0, strlen(name), name) == 0)
+                {
+                    arg.kind = EVM2::Arg::Kind::MEM;
+                    arg.sizeBytes = bytes;
+                    i = strlen(name);
+                    break;
+                }
+            }
+            if (arg.kind != EVM2::Arg::Kind::MEM)
+                return parseError("Bad register argument type [" + text + "]");
+            while (i < text.size() && isSpace(text[i]))
+                i++;
+            if (i < text.size() && text[i] == '[')
+                i++;
+            else
+                return parseError("Bad register argument type [" + text + "]");
+            while (i < text.size() && isSpace(text[i]))
+                i++;
+            if (!(i + 1 < text.size() && text[i] == 'r' && isDigit(text[i + 1], 10)))
+                return parseError("Bad register argument type [" + text + "]");
+        }
+
+        uint64_t id = 0;
+        for (i++; i < text.size() && isDigit(text[i], 10); i++)
+            id = std::min<uint64_t>(id * 10 + (text[i] - '0'), 1000);
+
+        if (arg.kind == EVM2::Arg::Kind::MEM)
+        {
+            while (i < text.size() && isSpace(text[i]))
+                i++;
+            if (i == text.size() || text[i] != ']')
+                return parseError("Bad register argument type [" + text + "]");
+        }
+        if (id > 16)
+            return parseError("Bad register argument type (too big)");
+        arg.reg = (uint8_t)id;
+        return true;
+    }
+
+    bool parseCode(const std::vector<std::string>& tokens) {
+        auto opcode = opcodes().find(tokens[0]);
+        if (opcode == opcodes().end())
+            return parseError("Bad opcode [" + tokens[0] + "]");
+
+        // arguments are separated by commas, spaces around them ignored
+        std::vector<std::string> arguments;
+        if (tokens.size() > 1)
+        {
+            std::string joined = tokens[1];
+            for (size_t t = 2; t < tokens.size(); t++)
+                joined += " " + tokens[t];
+            size_t start = 0;
+            for (;;)
+            {
+                size_t comma = joined.find(',', start);
+                std::string argument = joined.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+                while (!argument.empty() && isSpace(argument.back()))
+                    argument.pop_back();
+                size_t first = 0;
+                while (first < argument.size() && isSpace(argument[first]))
+                    first++;
+                arguments.push_back(argument.substr(first));
+                if (comma == std::string::npos)
+                    break;
+                start = comma + 1;
+            }
+        }
+
+        const char* kinds = signature(opcode->second);
+        if (arguments.size() != strlen(kinds))
+            return parseError("Bad opcode argument count");
+
+        Line line;
+        line.opcode = opcode->second;
+        for (size_t k = 0; k < arguments.size(); k++)
+        {
+            EVM2::Arg arg;
+            if (kinds[k] == 'R' && !parseRegister(arguments[k], arg))
+                return false;
+            if (kinds[k] == 'C')
+                arg.kind = EVM2::Arg::Kind::CONST;
+            if (kinds[k] == 'L')
+                arg.kind = EVM2::Arg::Kind::ADDR;
+            line.args.push_back(arg);
+            line.texts.push_back(arguments[k]);
+        }
+        code.push_back(std::move(line));
+        return true;
+    }
+
+    bool parseData(const std::vector<std::string>& tokens) {
+        for (const std::string& entry : tokens)
+        {
+            bool negative;
+            uint64_t value;
+            if (!parseInteger(entry, 16, negative, value) || (negative && value) || value > 255)
+                return parseError("Bad value in line");
+            data.push_back((uint8_t)value);
+        }
+        return true;
+    }
+
+    /**
+     * Pass 1, returns line number of the error or 0
+     */
+    size_t parse(const std::string& source) {
+        size_t lineNo = 0;
+        for (size_t start = 0; start < source.size();)
+        {
+            // universal newlines like Python text mode
+            size_t end = source.find_first_of("\r\n", start);
+            if (end == std::string::npos)
+                end = source.size();
+            std::string line = source.substr(start, end - start);
+            start = end + (source.compare(end, 2, "\r\n") == 0 ? 2 : 1);
+            lineNo++;
+
+            line = line.substr(0, line.find('#'));
+            std::vector<std::string> tokens;
+            for (size_t i = 0; i < line.size();)
+            {
+                while (i < line.size() && isSpace(line[i]))
+                    i++;
+                size_t tokenStart = i;
+                while (i < line.size() && !isSpace(line[i]))
+                    i++;
+                if (i > tokenStart)
+                    tokens.push_back(line.substr(tokenStart, i - tokenStart));
+            }
+            if (tokens.empty())
+                continue;
+
+            bool valid;
+            if (tokens[0][0] == '.')
+                valid = parseSection(tokens);
+            else if (tokens.size() == 1 && tokens[0].back() == ':')
+                valid = parseLabel(tokens[0]);
+            else if (mode == Mode::code)
+                valid = parseCode(tokens);
+            else if (mode == Mode::data)
+                valid = parseData(tokens);
+            else
+                valid = parseError("Bad token");
+            if (!valid)
+                return lineNo;
+        }
+        return 0;
+    }
+
+    /**
+     * Pass 2, code bits with labels resolved
+     */
+    bool assemble(EVM2::BitWriter& writer) {
+        std::vector<uint64_t> offsets;
+        std::vector<std::pair<uint64_t, size_t>> patches;   // bit position, instruction index
+        offsets.reserve(code.size());
+        for (Line& line : code)
+        {
+            offsets.push_back(writer.getPos());
+            for (char bit : EVM2::Encoder::opcodeBits(line.opcode))
+                writer.writeBit(bit == '1');
+
+            for (size_t k = 0; k < line.args.size(); k++)
+            {
+                EVM2::Arg& arg = line.args[k];
+                if (arg.kind == EVM2::Arg::Kind::CONST)
+                {
+                    bool negative;
+                    uint64_t value;
+                    if (!parseInteger(line.texts[k], 0, negative, value) || (negative && value))
+                    {
+                        message = "Bad constant " + line.texts[k];
+                        return false;
+                    }
+                    arg.constValue = (int64_t)value;
+                }
+                else if (arg.kind == EVM2::Arg::Kind::ADDR)
+                {
+                    auto label = codeLabels.find(line.texts[k]);
+                    if (label == codeLabels.end() || label->second >= code.size())
+                    {
+                        message = "Undefined code label " + line.texts[k];
+                        return false;
+                    }
+                    if (label->second < offsets.size())
+                        arg.addr = (uint32_t)offsets[label->second];
+                    else
+                        patches.push_back({writer.getPos(), label->second});
+                }
+                else if (arg.reg == 16)
+                {
+                    // r16 passes the range check of compiler.py, which writes it with 5 bits
+                    writer.writeBit(arg.kind == EVM2::Arg::Kind::MEM);
+                    if (arg.kind == EVM2::Arg::Kind::MEM)
+                        writer.writeBitsLEbits(arg.sizeBytes == 1 ? 0 : arg.sizeBytes == 2 ? 1 : arg.sizeBytes == 4 ? 2 : 3, 2);
+                    writer.writeBitsLEbits(16, 5);
+                    continue;
+                }
+                EVM2::Encoder::writeArg(writer, arg);
+            }
+        }
+        for (const auto& [position, instruction] : patches)
+            writer.patchBitsLEbits(position, offsets[instruction], 32);
+        return true;
+    }
+
+public:
+    /**
+     * Assemble EASM file into EVM2 file, messages of compiler.py go to out
+     */
+    Result build(const std::string& input, const std::string& output, FILE* out = stdout) {
+        std::ifstream file(input, std::ios::binary);
+        if (!file)
+        {
+            fprintf(out, "Cannot read %s\n", input.c_str());
+            return ioError;
+        }
+        std::string source((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+        *this = Assembler();
+        if (size_t lineNo = parse(source))
+        {
+            fprintf(out, "Parser error on line %zu: %s\n", lineNo, message.c_str());
+            return parserError;
+        }
+
+        EVM2::BitWriter writer;
+        bool valid = assemble(writer);
+        if (valid && !hasDataSize)
+        {
+            message = "Missing .dataSize";
+            valid = false;
+        }
+        if (!valid)
+        {
+            fprintf(out, "Assembler error: %s\n", message.c_str());
+            return assemblerError;
+        }
+
+        if (data.size() > dataSize)
+        {
+            fprintf(out, "Warning: bad .dataSize, was %" PRIu64 " but used %zu, expanding\n", dataSize, data.size());
+            dataSize = data.size();
+        }
+
+        if (!EVM2::Encoder::writeFile(output, writer.getBytes(), (uint32_t)dataSize, data))
+        {
+            fprintf(out, "Cannot write %s\n", output.c_str());
+            return ioError;
+        }
+        fprintf(out, "All ok\n");
+        return ok;
+    }
+};
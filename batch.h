@@ -0,0 +1,170 @@
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/**
+ * Jobs of the batch mode and their report
+ *
+ * Manifest has one job per line, fields separated by whitespace:
+ *   program [payload [stdin [expected]]]
+ * "-" skips a field, "#" starts a comment, relative paths are relative
+ * to the manifest. Expected output is compared with everything the job
+ * writes to stdout and stderr followed by the exit message, the same as
+ * test.sh redirecting both into .out file. Without it, job passes when
+ * the program exits normally.
+ *
+ * Jobs of the same program share one decoded and compiled copy from
+ * ProgramCache. Jobs writing their payload should not share it with
+ * other jobs running at the same time.
+ */
+class BatchJobs {
+public:
+    enum class Status {
+        pending,
+        passed,
+        failed,             // output differs from expected
+        memoryFault,
+        timeout,
+        crashed,            // killed by signal or unknown exit code
+        error               // program, stdin or output file unusable
+    };
+
+    struct Job {
+        size_t line = 0;
+        std::string program;
+        std::string payload;
+        std::string input;
+        std::string expected;
+        uint64_t hash = 0;
+        Status status = Status::pending;
+        std::string output;         // captured console output, kept when the job fails
+        double ms = 0;
+    };
+
+    std::vector<Job> jobs;
+
+private:
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+
+    static std::string resolve(const std::string& dir, const std::string& path) {
+        if (path == "-")
+            return {};
+        if (path.empty() || path[0] == '/' || dir.empty())
+            return path;
+        return dir + "/" + path;
+    }
+
+public:
+    static bool readFile(const std::string& filename, std::string& content) {
+        std::ifstream file(filename, std::ios::binary);
+        if (!file)
+            return false;
+        content.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        return true;
+    }
+
+    static const char* name(Status status) {
+        switch (status)
+        {
+            case Status::pending: return "PENDING";
+            case Status::passed: return "PASS";
+            case Status::failed: return "FAIL";
+            case Status::memoryFault: return "SEGV";
+            case Status::timeout: return "TIMEOUT";
+            case Status::crashed: return "CRASH";
+            case Status::error: return "ERROR";
+        }
+        return "?";
+    }
+
+    /**
+     * Read manifest, program hashes are filled later by the runner
+     */
+    bool read(const std::string& manifest) {
+        std::ifstream file(manifest);
+        if (!file)
+            return false;
+        size_t slash = manifest.rfind('/');
+        std::string dir = slash == std::string::npos ? "" : manifest.substr(0, slash);
+
+        std::string text;
+        for (size_t lineNo = 1; std::getline(file, text); lineNo++)
+        {
+            std::istringstream fields(text.substr(0, text.find('#')));
+            std::vector<std::string> values;
+            for (std::string value; fields >> value;)
+                values.push_back(value);
+            if (values.empty())
+                continue;
+            if (values.size() > 4)
+            {
+                fprintf(stderr, "%s:%zu: too many fields\n", manifest.c_str(), lineNo);
+                return false;
+            }
+            values.resize(4, "-");
+
+            Job job;
+            job.line = lineNo;
+            job.program = resolve(dir, values[0]);
+            job.payload = resolve(dir, values[1]);
+            job.input = resolve(dir, values[2]);
+            job.expected = resolve(dir, values[3]);
+            jobs.push_back(job);
+        }
+        return true;
+    }
+
+    /**
+     * Status of finished job from its exit message and captured output
+     */
+    static Status finish(const Job& job, const char* exitMessage, int exitCode) {
+        if (!exitMessage)
+            return Status::crashed;
+        if (!job.expected.empty())
+        {
+            std::string expected, actual;
+            if (!readFile(job.expected, expected) || !readFile(job.output, actual))
+                return Status::error;
+            return expected == actual ? Status::passed : Status::failed;
+        }
+        switch (exitCode)
+        {
+            case 0: return Status::passed;
+            case 1: return Status::timeout;
+            case 3: return Status::memoryFault;
+            default: return Status::crashed;
+        }
+    }
+
+    void writeJob(FILE* f, const Job& job) const {
+        fprintf(f, "%-8s %10.3f ms  %s", name(job.status), job.ms, job.program.c_str());
+        if (!job.payload.empty())
+            fprintf(f, " %s", job.payload.c_str());
+        if (job.status != Status::passed && !job.output.empty())
+            fprintf(f, " (output %s)", job.output.c_str());
+        fprintf(f, "\n");
+        fflush(f);
+    }
+
+    /**
+     * Totals, returns true when all jobs passed
+     */
+    bool writeSummary(FILE* f, size_t programs, double compileMs) const {
+        size_t passed = 0;
+        double jobMs = 0;
+        for (const Job& job : jobs)
+        {
+            passed += job.status == Status::passed;
+            jobMs += job.ms;
+        }
+        double wallMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+        fprintf(f, "# %zu jobs, %zu passed, %zu failed\n", jobs.size(), passed, jobs.size() - passed);
+        fprintf(f, "# %zu programs compiled in %.3f ms, shared by %zu jobs\n", programs, compileMs, jobs.size());
+        fprintf(f, "# wall %.3f ms, sum of job times %.3f ms\n", wallMs, jobMs);
+        return passed == jobs.size();
+    }
+};
@@ -0,0 +1,294 @@
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <map>
+#include <numeric>
+#include <string>
+#include <vector>
+
+/**
+ * Execution counts of basic blocks, collected by instrumented code
+ * (--profile-gen) and used for block layout of the next compilation
+ * (--profile-use)
+ *
+ * Instrumented code increments counter 2*k when instruction k starts a
+ * block and counter 2*k+1 when JUMPEQ k falls through, taken count of the
+ * branch is the difference. Counters are not atomic, concurrent guest
+ * threads may lose few increments, which does not matter for layout.
+ *
+ * Profile file is text keyed by EVM bit offsets:
+ *   block <bit offset> <entries>
+ *   fallthrough <bit offset> <count>
+ */
+class BlockProfile {
+    std::map<EVM2::Arg::addr_t, uint64_t> blocks;          // leader bit offset -> entries
+    std::map<EVM2::Arg::addr_t, uint64_t> fallthroughs;    // JUMPEQ bit offset -> not taken
+
+    static uint64_t find(const std::map<EVM2::Arg::addr_t, uint64_t>& counts, EVM2::Arg::addr_t bitOffset) {
+        auto it = counts.find(bitOffset);
+        return it == counts.end() ? 0 : it->second;
+    }
+
+public:
+    static size_t counterCount(const std::vector<EVM2::Instruction>& instructions) {
+        return instructions.size() * 2;
+    }
+
+    /**
+     * Take counters written by instrumented code
+     */
+    void collect(const std::vector<EVM2::Instruction>& instructions, const uint64_t* counters) {
+        blocks.clear();
+        fallthroughs.clear();
+        for (size_t k = 0; k < instructions.size(); k++)
+        {
+            if (counters[2*k])
+                blocks[instructions[k].bitOffset] = counters[2*k];
+            if (counters[2*k+1])
+                fallthroughs[instructions[k].bitOffset] = counters[2*k+1];
+        }
+    }
+
+    uint64_t blockCount(EVM2::Arg::addr_t bitOffset) const {
+        return find(blocks, bitOffset);
+    }
+
+    uint64_t fallthroughCount(EVM2::Arg::addr_t bitOffset) const {
+        return find(fallthroughs, bitOffset);
+    }
+
+    bool write(const std::string& filename) const {
+        FILE* f = fopen(filename.c_str(), "w");
+        if (!f)
+            return false;
+        for (const auto& [bitOffset, count] : blocks)
+            fprintf(f, "block %u %" PRIu64 "\n", (unsigned)bitOffset, count);
+        for (const auto& [bitOffset, count] : fallthroughs)
+            fprintf(f, "fallthrough %u %" PRIu64 "\n", (unsigned)bitOffset, count);
+        return fclose(f) == 0;
+    }
+
+    bool read(const std::string& filename) {
+        FILE* f = fopen(filename.c_str(), "r");
+        if (!f)
+            return false;
+        blocks.clear();
+        fallthroughs.clear();
+
+        char kind[16];
+        unsigned bitOffset;
+        uint64_t count;
+        bool valid = true;
+        while (valid && fscanf(f, "%15s %u %" SCNu64, kind, &bitOffset, &count) == 3)
+        {
+            if (strcmp(kind, "block") == 0)
+                blocks[bitOffset] = count;
+            else if (strcmp(kind, "fallthrough") == 0)
+                fallthroughs[bitOffset] = count;
+            else
+                valid = false;
+        }
+        valid = valid && feof(f);
+        fclose(f);
+        return valid;
+    }
+};
+
+/**
+ * Order of basic blocks in generated code
+ *
+ * Without profile the blocks stay in source order. With profile the
+ * blocks are chained greedily along the heaviest edges (Pettis-Hansen),
+ * so the hot successor of every block is its fall-through:
+ *   - JUMP to the next placed block is dropped
+ *   - JUMPEQ whose taken target is placed next is inverted
+ *   - block whose source successor is placed elsewhere ends with jump
+ * Hot chains follow the entry chain ordered by weight, never executed
+ * blocks (error paths, HLT, rare branches) form the cold section placed
+ * after them, in front of the epilogue.
+ */
+class BlockLayout {
+public:
+    struct Block {
+        size_t first;           // instruction range
+        size_t last;
+        uint64_t count = 0;
+    };
+
+    static constexpr size_t none = SIZE_MAX;
+
+private:
+    std::vector<Block> blockList;
+    std::vector<size_t> blockOfInstruction;
+    std::vector<size_t> emitOrder;
+    size_t cold = 0;
+    std::vector<bool> coldBlocks;
+
+    static bool fallsThrough(EVM2::Op op) {
+        return op != EVM2::Op::JUMP && op != EVM2::Op::RET;
+    }
+
+public:
+    BlockLayout(const std::vector<EVM2::Instruction>& instructions, const BlockProfile* profile) {
+        std::map<EVM2::Arg::addr_t, size_t> indices;
+        for (size_t k = 0; k < instructions.size(); k++)
+            indices[instructions[k].bitOffset] = k;
+
+        // leaders: branch, call and thread targets, instructions after control transfer
+        std::vector<bool> leader(instructions.size() + 1, false);
+        leader[0] = true;
+        for (size_t k = 0; k < instructions.size(); k++)
+        {
+            const EVM2::Instruction& i = instructions[k];
+            switch (i.opcode)
+            {
+                case EVM2::Op::JUMP:
+                case EVM2::Op::JUMPEQ:
+                case EVM2::Op::CALL:
+                    leader[indices[i.args[0].addr]] = true;
+                    leader[k + 1] = true;
+                    break;
+                case EVM2::Op::CREATETHREAD:
+                    leader[indices[i.args[0].addr]] = true;
+                    break;
+                case EVM2::Op::RET:
+                case EVM2::Op::HLT:
+                    leader[k + 1] = true;
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        blockOfInstruction.resize(instructions.size());
+        for (size_t k = 0; k < instructions.size(); k++)
+        {
+            if (leader[k])
+                blockList.push_back({k, k});
+            blockList.back().last = k;
+            blockOfInstruction[k] = blockList.size() - 1;
+        }
+
+        size_t n = blockList.size();
+        emitOrder.resize(n);
+        std::iota(emitOrder.begin(), emitOrder.end(), 0);
+        cold = n;
+        coldBlocks.assign(n, false);
+        if (!profile || n == 0)
+            return;
+
+        // edge weights from block entries and branch fall-throughs
+        struct Edge {
+            size_t from, to;
+            uint64_t weight;
+        };
+        std::vector<Edge> edges;
+        for (size_t b = 0; b < n; b++)
+        {
+            Block& block = blockList[b];
+            block.count = profile->blockCount(instructions[block.first].bitOffset);
+            const EVM2::Instruction& last = instructions[block.last];
+            switch (last.opcode)
+            {
+                case EVM2::Op::JUMPEQ:
+                {
+                    uint64_t fall = std::min(profile->fallthroughCount(last.bitOffset), block.count);
+                    edges.push_back({b, blockOf(indices[last.args[0].addr]), block.count - fall});
+                    if (b + 1 < n)
+                        edges.push_back({b, b + 1, fall});
+                    break;
+                }
+                case EVM2::Op::JUMP:
+                    edges.push_back({b, blockOf(indices[last.args[0].addr]), block.count});
+                    break;
+                case EVM2::Op::RET:
+                case EVM2::Op::HLT:
+                    break;
+                default:
+                    if (b + 1 < n)
+                        edges.push_back({b, b + 1, block.count});
+                    break;
+            }
+        }
+        std::stable_sort(edges.begin(), edges.end(), [](const Edge& a, const Edge& b) {
+            return a.weight > b.weight;
+        });
+
+        // chains as linked lists, block 0 (program entry) always heads its chain
+        std::vector<size_t> next(n, none), prev(n, none), head(n);
+        std::iota(head.begin(), head.end(), 0);
+        auto link = [&](size_t from, size_t to) {
+            if (to == 0 || from == to || next[from] != none || prev[to] != none || head[from] == head[to])
+                return;
+            next[from] = to;
+            prev[to] = from;
+            for (size_t b = to; b != none; b = next[b])
+                head[b] = head[from];
+        };
+        for (const Edge& e : edges)
+            if (e.weight)
+                link(e.from, e.to);
+
+        // cold blocks keep their source fall-throughs, so they do not need extra jumps
+        for (size_t b = 0; b + 1 < n; b++)
+            if (!blockList[b].count && !blockList[b + 1].count && fallsThrough(instructions[blockList[b].last].opcode))
+                link(b, b + 1);
+
+        std::vector<size_t> heads;
+        std::vector<uint64_t> weight(n, 0);
+        for (size_t b = 0; b < n; b++)
+        {
+            weight[head[b]] = std::max(weight[head[b]], blockList[b].count);
+            if (head[b] == b)
+                heads.push_back(b);
+        }
+        std::stable_sort(heads.begin(), heads.end(), [&](size_t a, size_t b) {
+            if (a == 0 || b == 0)
+                return a == 0 && b != 0;
+            if ((weight[a] == 0) != (weight[b] == 0))
+                return weight[a] != 0;
+            return weight[a] > weight[b];
+        });
+
+        emitOrder.clear();
+        for (size_t h : heads)
+        {
+            if (cold == n && h != 0 && weight[h] == 0)
+                cold = emitOrder.size();
+            for (size_t b = h; b != none; b = next[b])
+                emitOrder.push_back(b);
+        }
+        for (size_t pos = cold; pos < n; pos++)
+            coldBlocks[emitOrder[pos]] = true;
+    }
+
+    size_t blockCount() const {
+        return blockList.size();
+    }
+
+    const Block& block(size_t b) const {
+        return blockList[b];
+    }
+
+    size_t blockOf(size_t instruction) const {
+        return blockOfInstruction[instruction];
+    }
+
+    /**
+     * Blocks in the order they are emitted
+     */
+    const std::vector<size_t>& order() const {
+        return emitOrder;
+    }
+
+    /**
+     * Position in order() where cold section starts
+     */
+    size_t coldStart() const {
+        return cold;
+    }
+
+    bool isCold(size_t b) const {
+        return coldBlocks[b];
+    }
+};
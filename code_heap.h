@@ -0,0 +1,370 @@
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#ifdef __APPLE__
+#include <pthread.h>
+#include <libkern/OSCacheControl.h>
+#endif
+
+/**
+ * Shared executable memory for JIT code
+ *
+ * All programs allocate their code from one reserved region, in chunks
+ * of cache line granularity, so small programs do not burn a page and
+ * mmap each. Freed chunks are coalesced and their whole pages returned
+ * to the system.
+ *
+ * Code is never writable and executable at the same address:
+ *   - Linux: region backed by memfd and mapped twice, RW view for writing
+ *     and patching, RX view for execution
+ *   - Apple: single MAP_JIT region, writes are enabled only for the
+ *     writing thread with pthread_jit_write_protect_np
+ *
+ * Addresses passed to and returned from the heap are RX addresses,
+ * writes go through write/patch which translate them to the RW view
+ * and invalidate the instruction cache.
+ */
+class CodeHeap {
+    enum {
+        capacity = 256 << 20,
+        granularity = 64
+    };
+
+    std::mutex mutex;
+    uint8_t* rx = nullptr;
+    uint8_t* rw = nullptr;
+    int fd = -1;
+    size_t page_size = 0;
+    std::map<size_t, size_t> free_chunks;   // offset -> size
+    std::map<size_t, size_t> used_chunks;   // offset -> size
+
+    CodeHeap() {
+        page_size = sysconf(_SC_PAGESIZE);
+#ifdef __APPLE__
+        void* mem = mmap(nullptr, capacity, PROT_READ | PROT_WRITE | PROT_EXEC,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_JIT, -1, 0);
+        if (mem == MAP_FAILED)
+            return;
+        rx = rw = (uint8_t*)mem;
+#else
+        fd = memfd_create("evm2-code", MFD_CLOEXEC);
+        if (fd < 0 || ftruncate(fd, capacity) != 0)
+            return;
+        void* memRw = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        void* memRx = mmap(nullptr, capacity, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+        if (memRw == MAP_FAILED || memRx == MAP_FAILED)
+            return;
+        rw = (uint8_t*)memRw;
+        rx = (uint8_t*)memRx;
+#endif
+        free_chunks[0] = capacity;
+    }
+
+    ~CodeHeap() {
+        if (rw && rw != rx)
+            munmap(rw, capacity);
+        if (rx)
+            munmap(rx, capacity);
+        if (fd >= 0)
+            close(fd);
+    }
+
+    // give back physical pages fully covered by free chunk
+    void discard(size_t offset, size_t size) {
+        size_t first = (offset + page_size - 1) & ~(page_size - 1);
+        size_t last = (offset + size) & ~(page_size - 1);
+        if (last <= first)
+            return;
+#ifdef __APPLE__
+        madvise(rx + first, last - first, MADV_FREE);
+#else
+        fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, first, last - first);
+#endif
+    }
+
+    // put chunk back to free list, merged with free neighbours
+    void insertFree(size_t offset, size_t size) {
+        auto next = free_chunks.find(offset + size);
+        if (next != free_chunks.end())
+        {
+            size += next->second;
+            free_chunks.erase(next);
+        }
+        auto prev = free_chunks.lower_bound(offset);
+        if (prev != free_chunks.begin() && (--prev)->first + prev->second == offset)
+        {
+            offset = prev->first;
+            size += prev->second;
+            free_chunks.erase(prev);
+        }
+        free_chunks[offset] = size;
+        discard(offset, size);
+    }
+
+    static size_t roundUp(size_t size) {
+        if (size == 0)
+            size = 1;
+        return (size + granularity - 1) & ~(size_t)(granularity - 1);
+    }
+
+public:
+    CodeHeap(const CodeHeap&) = delete;
+    CodeHeap& operator=(const CodeHeap&) = delete;
+
+    static CodeHeap& instance() {
+        static CodeHeap heap;
+        return heap;
+    }
+
+    /**
+     * Allocate chunk for code, returns RX address or nullptr
+     */
+    void* allocate(size_t size) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!rx || size == 0)
+            return nullptr;
+
+        size = roundUp(size);
+        for (auto it = free_chunks.begin(); it != free_chunks.end(); ++it)
+        {
+            if (it->second < size)
+                continue;
+
+            size_t offset = it->first;
+            size_t remaining = it->second - size;
+            free_chunks.erase(it);
+            if (remaining)
+                free_chunks[offset + size] = remaining;
+            used_chunks[offset] = size;
+            return rx + offset;
+        }
+        return nullptr;
+    }
+
+    /**
+     * Return chunk to the heap, neighbouring free chunks are merged
+     */
+    void release(void* addr) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = used_chunks.find((uint8_t*)addr - rx);
+        assert(it != used_chunks.end());
+
+        size_t offset = it->first;
+        size_t size = it->second;
+        used_chunks.erase(it);
+        insertFree(offset, size);
+    }
+
+    /**
+     * Grow or shrink chunk without moving it, growing fails when the
+     * following space is not free
+     */
+    bool resize(void* addr, size_t size) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = used_chunks.find((uint8_t*)addr - rx);
+        assert(it != used_chunks.end());
+
+        size_t offset = it->first;
+        size = roundUp(size);
+        if (size <= it->second)
+        {
+            size_t tail = it->second - size;
+            it->second = size;
+            if (tail)
+                insertFree(offset + size, tail);
+            return true;
+        }
+
+        auto next = free_chunks.find(offset + it->second);
+        if (next == free_chunks.end() || it->second + next->second < size)
+            return false;
+
+        size_t remaining = it->second + next->second - size;
+        free_chunks.erase(next);
+        if (remaining)
+            free_chunks[offset + size] = remaining;
+        it->second = size;
+        return true;
+    }
+
+    /**
+     * Address of chunk in the RW view, on Apple it is the same address
+     * and writes must be enclosed in beginWrite/endWrite on writing thread
+     */
+    void* writable(void* addr) const {
+        assert(contains(addr));
+        return rw + ((uint8_t*)addr - rx);
+    }
+
+    static void beginWrite() {
+#ifdef __APPLE__
+        pthread_jit_write_protect_np(0);
+#endif
+    }
+
+    static void endWrite() {
+#ifdef __APPLE__
+        pthread_jit_write_protect_np(1);
+#endif
+    }
+
+    static void flushInstructionCache(void* addr, size_t size) {
+#ifdef __APPLE__
+        sys_icache_invalidate(addr, size);
+#else
+        __builtin___clear_cache((char*)addr, (char*)addr + size);
+#endif
+    }
+
+    /**
+     * Copy code into allocated chunk
+     */
+    void write(void* addr, const void* data, size_t size) {
+        assert(contains(addr) && contains((uint8_t*)addr + size - 1));
+        beginWrite();
+        memcpy(writable(addr), data, size);
+        endWrite();
+        flushInstructionCache(addr, size);
+    }
+
+    /**
+     * Replace single instruction of already running code, the store is
+     * atomic so other threads see either old or new instruction
+     */
+    void patch(void* addr, uint32_t instruction) {
+        assert(contains(addr) && ((uintptr_t)addr & 3) == 0);
+        beginWrite();
+        __atomic_store_n((uint32_t*)writable(addr), instruction, __ATOMIC_RELEASE);
+        endWrite();
+        flushInstructionCache(addr, sizeof(instruction));
+    }
+
+    bool contains(const void* addr) const {
+        return rx && addr >= rx && addr < rx + capacity;
+    }
+};
+
+/**
+ * Assembler buffer living directly in the code heap
+ *
+ * Instructions are written into the RW view of a heap chunk, fixups patch
+ * them in place and finalize only trims the chunk and flushes instruction
+ * cache, there is no intermediate copy of the program. When the chunk is
+ * full it is extended in place if the following heap space is free,
+ * otherwise moved to twice larger chunk (all branches inside generated
+ * code are PC relative, so the code can move while it is being built).
+ */
+class CodeBuffer {
+    static constexpr size_t initialCapacity = 64 << 10;    // in bytes
+
+    uint8_t* base = nullptr;    // RX address of chunk
+    uint32_t* words = nullptr;  // same chunk in RW view
+    size_t count = 0;
+    size_t capacity = 0;        // in instructions
+    size_t allocations = 0;     // chunks allocated or resized for current program
+    bool finalized = false;
+
+    void grow() {
+        CodeHeap& heap = CodeHeap::instance();
+        size_t bytes = capacity ? capacity * 2 * sizeof(uint32_t) : initialCapacity;
+        allocations++;
+
+        if (base && heap.resize(base, bytes))
+        {
+            capacity = bytes / sizeof(uint32_t);
+            return;
+        }
+
+        uint8_t* chunk = (uint8_t*)heap.allocate(bytes);
+        assert(chunk);
+        uint32_t* chunkWords = (uint32_t*)heap.writable(chunk);
+        if (base)
+        {
+            memcpy(chunkWords, words, count * sizeof(uint32_t));
+            heap.release(base);
+        }
+        else
+        {
+            CodeHeap::beginWrite();
+        }
+        base = chunk;
+        words = chunkWords;
+        capacity = bytes / sizeof(uint32_t);
+    }
+
+public:
+    CodeBuffer() = default;
+    CodeBuffer(const CodeBuffer&) = delete;
+    CodeBuffer& operator=(const CodeBuffer&) = delete;
+
+    ~CodeBuffer() {
+        if (base && !finalized)
+            CodeHeap::endWrite();
+        if (base)
+            CodeHeap::instance().release(base);
+    }
+
+    /**
+     * Start new program, finalized code is released (it must not be running)
+     */
+    void clear() {
+        if (base && finalized)
+        {
+            CodeHeap::instance().release(base);
+            base = nullptr;
+            words = nullptr;
+            capacity = 0;
+            finalized = false;
+        }
+        count = 0;
+        allocations = 0;
+    }
+
+    void push_back(uint32_t instruction) {
+        assert(!finalized);
+        if (count == capacity)
+            grow();
+        words[count++] = instruction;
+    }
+
+    uint32_t& operator[](size_t index) {
+        assert(!finalized && index < count);
+        return words[index];
+    }
+
+    uint32_t operator[](size_t index) const {
+        return words[index];
+    }
+
+    const uint32_t* data() const {
+        return words;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    size_t allocationCount() const {
+        return allocations;
+    }
+
+    /**
+     * Trim chunk to the program size and make it executable, returns RX address
+     */
+    void* finalize() {
+        if (!base || finalized)
+            return base;
+        CodeHeap& heap = CodeHeap::instance();
+        heap.resize(base, count * sizeof(uint32_t));
+        capacity = count;
+        CodeHeap::endWrite();
+        CodeHeap::flushInstructionCache(base, count * sizeof(uint32_t));
+        finalized = true;
+        return base;
+    }
+};
@@ -1,6 +1,6 @@
+#include <bit>
 #include <map>
-
-typedef void (*JITFunction)(void* memory, uint64_t* registers, size_t entry_point);
+#include <cstddef>
 
 struct JITInterface_t
 {
@@ -14,18 +14,41 @@ struct JITInterface_t
     void (*thread_unlock)(uint64_t id);
     uint64_t (*file_read)(uint64_t ofs, uint64_t toRead, uint64_t addr);
     void (*file_write)(uint64_t ofs, uint64_t toWrite, uint64_t addr);
+    uint64_t* (*shadow_stack)(uint64_t bytes);          // stack for guest calls of current thread
+    void (*shadow_stack_fault)(uint64_t underflow);     // terminates current thread
+    uint64_t* block_counters;   // instrumented code only, see BlockProfile
+};
+
+// host calls in generated code go through iface, code itself has no host addresses
+typedef void (*JITFunction)(void* memory, uint64_t* registers, size_t entry_point, const JITInterface_t* iface);
+
+// EVM bit offset -> host instruction index
+typedef std::map<EVM2::Arg::addr_t, size_t> JITMapping;
+
+struct CompileOptions {
+    bool instrumentBlocks = false;          // count block entries and branch fall-throughs (--profile-gen)
+    const BlockProfile* profile = nullptr;  // profile guided block layout (--profile-use)
+    size_t shadowStackDepth = 0;            // guest call depth on VM managed stack, 0 = native stack (--shadow-stack)
+    CompileStats* stats = nullptr;          // phase timings and code size (--stats)
 };
 
-JITFunction Compile(const EVM2::Disassembler& disasm, ARM64JITFrontend& jit, JITInterface_t& iface)
+JITFunction Compile(const EVM2::Disassembler& disasm, ARM64JITFrontend& jit, JITMapping* bitOffsets = nullptr,
+                    const CompileOptions& options = {})
 {
+    CompileStats unused;
+    CompileStats& stats = options.stats ? *options.stats : unused;
+    CompileStats::Timer timer;
     std::vector<std::pair<size_t, EVM2::Arg::addr_t>> fixups;
-    std::map<EVM2::Arg::addr_t, size_t> mapping;
+    JITMapping mapping;
     std::map<EVM2::Arg::addr_t, char> labels;
+    std::map<EVM2::Arg::addr_t, size_t> indices;
+    constexpr size_t maxInlineBody = 4;
     
     // Identify call/jump labels
     const auto& instructions = disasm.getInstructions();
     for (const EVM2::Instruction& i : instructions)
     {
+        indices.insert({i.bitOffset, indices.size()});
         switch (i.opcode)
         {
             case EVM2::Op::JUMP:
@@ -39,21 +62,71 @@ JITFunction Compile(const EVM2::Disassembler& disasm, ARM64JITFrontend& jit, JIT
                 assert(labels[i.args[0].addr] != 'G');
                 labels[i.args[0].addr] = 'C';
                 break;
+            case EVM2::Op::CREATETHREAD:
+                // thread entry, only needed to keep superinstructions from spanning it
+                labels.insert({i.args[0].addr, 'T'});
+                break;
             default:
                 break;
         }
     }
     
-    jit.begin();
+    // short straight-line helpers (push/pop) replaced with their body at CALL, first -> RET index
+    std::map<size_t, size_t> inlineBodies;
+    for (const auto& [addr, kind] : labels)
+    {
+        auto target = indices.find(addr);
+        if (kind != 'C' || target == indices.end())
+            continue;
+        size_t first = target->second;
+        size_t last = first;
+        for (; instructions[last].opcode != EVM2::Op::RET; last++)
+        {
+            if (last - first >= maxInlineBody || last + 1 >= instructions.size())
+                break;
+            const EVM2::Instruction& b = instructions[last];
+            if (b.opcode == EVM2::Op::JUMP || b.opcode == EVM2::Op::JUMPEQ || b.opcode == EVM2::Op::CALL)
+                break;
+            // the rest of the caller's block is counted with the call site, it must run after the body
+            if (options.instrumentBlocks && b.opcode == EVM2::Op::HLT)
+                break;
+            if (last != first && labels.contains(b.bitOffset))
+                break;
+        }
+        if (instructions[last].opcode == EVM2::Op::RET)
+            inlineBodies[first] = last;
+    }
+    
+    timer.lap(stats.labelsNs);
+    
+    // host registers of EVM registers, set before lowering each instruction
+    RegisterAllocator allocation(instructions, inlineBodies);
+    timer.lap(stats.allocationNs);
+    
+    // counted code keeps source order, so fall-through counters stay on fall-through paths
+    BlockLayout layout(instructions, options.instrumentBlocks ? nullptr : options.profile);
+    timer.lap(stats.layoutNs);
+    
+    std::vector<std::pair<size_t, EVM2::Arg::addr_t>> entryFixups;
+    auto locate = [&](const EVM2::Instruction& i)
+    {
+        size_t k = &i - instructions.data();
+        jit.setRegisterLocations(allocation.sourceLocations(k), allocation.destinationLocations(k));
+    };
 
-    // compile
-    for (const EVM2::Instruction& i : instructions)
+    // JUMPEQ between hot code and cold section can be out of b.cond reach
+    auto branchIfEqual = [&](const EVM2::Instruction& i)
+    {
+        auto target = indices.find(i.args[0].addr);
+        assert(target != indices.end());
+        bool far = layout.isCold(layout.blockOf(&i - instructions.data())) != layout.isCold(layout.blockOf(target->second));
+        fixups.push_back({far ? jit.branchIfEqualFar() : jit.branchIfEqual(), i.args[0].addr});
+    };
+
+    // lower single instruction
+    auto lower = [&](const EVM2::Instruction& i)
     {
-        mapping.insert({i.bitOffset, jit.getCurrentIndex()});
-        
-        if (auto it = labels.find(i.bitOffset); it != labels.end() && it->second == 'C')
-            jit.funcPrologue();
-        
+        locate(i);
         switch (i.opcode)
         {
             case EVM2::Op::LOADCONST:
@@ -62,12 +135,12 @@ JITFunction Compile(const EVM2::Disassembler& disasm, ARM64JITFrontend& jit, JIT
                 break;
             case EVM2::Op::CONSOLEREAD:
                 assert(i.args.size() == 1 && i.args[0].kind == EVM2::Arg::Kind::REG);
-                jit.hostCallWithOps((uintptr_t)iface.read_value, i.args[0], {});
+                jit.hostCallWithOps(offsetof(JITInterface_t, read_value), i.args[0], {});
                 break;
             case EVM2::Op::JUMPEQ:
                 assert(i.args.size() == 3 && i.args[0].kind == EVM2::Arg::Kind::ADDR);
                 jit.compare(i.args[1], i.args[2]);
-                fixups.push_back({jit.branchIfEqual(), i.args[0].addr});
+                branchIfEqual(i);
                 break;
             case EVM2::Op::ADD:
                 assert(i.args.size() == 3);
@@ -92,7 +165,7 @@ JITFunction Compile(const EVM2::Disassembler& disasm, ARM64JITFrontend& jit, JIT
             case EVM2::Op::COMPARE:
                 assert(i.args.size() == 3);
                 jit.alu(ARM64JITFrontend::AluOp::SUB, i.args[2], i.args[0], i.args[1]);
-                jit.alu(ARM64JITFrontend::AluOp::SIGNUM, i.args[2], i.args[2]);
+                jit.signumAcc(i.args[2]);
                 break;
             case EVM2::Op::MOV:
                 assert(i.args.size() == 2);
@@ -100,14 +173,14 @@ JITFunction Compile(const EVM2::Disassembler& disasm, ARM64JITFrontend& jit, JIT
                 break;
             case EVM2::Op::CONSOLEWRITE:
                 assert(i.args.size() == 1);
-                jit.hostCallWithOps((uintptr_t)iface.print_value, {}, i.args[0]);
+                jit.hostCallWithOps(offsetof(JITInterface_t, print_value), {}, i.args[0]);
                 break;
             case EVM2::Op::JUMP:
                 assert(i.args.size() == 1 && i.args[0].kind == EVM2::Arg::Kind::ADDR);
                 fixups.push_back({jit.jump(), i.args[0].addr});
                 break;
             case EVM2::Op::HLT:
-                jit.hostCallWithOps((uintptr_t)iface.terminate, {}, {});
+                jit.hostCallWithOps(offsetof(JITInterface_t, terminate), {}, {});
                 break;
             case EVM2::Op::CALL:
                 assert(i.args.size() == 1 && i.args[0].kind == EVM2::Arg::Kind::ADDR);
@@ -119,38 +192,251 @@ JITFunction Compile(const EVM2::Disassembler& disasm, ARM64JITFrontend& jit, JIT
                 break;
             case EVM2::Op::CREATETHREAD:
                 assert(i.args.size() == 2 && i.args[0].kind == EVM2::Arg::Kind::ADDR);
-                fixups.push_back({jit.hostCallWithOps((uintptr_t)iface.thread_create, i.args[1], i.args[0]), i.args[0].addr});
+                // child thread copies registers[]
+                for (const auto& [reg, host] : allocation.threadCreateStores(&i - instructions.data()))
+                    jit.spillRegister(reg, host);
+                entryFixups.push_back({jit.hostCallWithOps(offsetof(JITInterface_t, thread_create), i.args[1], i.args[0]), i.args[0].addr});
                 break;
             case EVM2::Op::JOINTHREAD:
                 assert(i.args.size() == 1);
-                jit.hostCallWithOps((uintptr_t)iface.thread_join, {}, i.args[0]);
+                jit.hostCallWithOps(offsetof(JITInterface_t, thread_join), {}, i.args[0]);
                 break;
             case EVM2::Op::LOCK:
                 assert(i.args.size() == 1);
-                jit.hostCallWithOps((uintptr_t)iface.thread_lock, {}, i.args[0]);
+                jit.hostCallWithOps(offsetof(JITInterface_t, thread_lock), {}, i.args[0]);
                 break;
             case EVM2::Op::UNLOCK:
                 assert(i.args.size() == 1);
-                jit.hostCallWithOps((uintptr_t)iface.thread_unlock, {}, i.args[0]);
+                jit.hostCallWithOps(offsetof(JITInterface_t, thread_unlock), {}, i.args[0]);
                 break;
             case EVM2::Op::SLEEP:
                 assert(i.args.size() == 1);
-                jit.hostCallWithOps((uintptr_t)iface.thread_sleep, {}, i.args[0]);
+                jit.hostCallWithOps(offsetof(JITInterface_t, thread_sleep), {}, i.args[0]);
                 break;
             case EVM2::Op::READ:
                 assert(i.args.size() == 4);
-                jit.hostCallWithOps((uintptr_t)iface.file_read, i.args[3], i.args[0], i.args[1], i.args[2]);
+                jit.hostCallWithOps(offsetof(JITInterface_t, file_read), i.args[3], i.args[0], i.args[1], i.args[2]);
                 break;
             case EVM2::Op::WRITE:
                 assert(i.args.size() == 3);
-                jit.hostCallWithOps((uintptr_t)iface.file_write, {}, i.args[0], i.args[1], i.args[2]);
+                jit.hostCallWithOps(offsetof(JITInterface_t, file_write), {}, i.args[0], i.args[1], i.args[2]);
                 break;
             default:
                 assert(0);
         }
-        jit.nop();
+    };
+
+    // Superinstructions - frequent pairs (see res/ngrams.py) lowered at once, the value
+    // produced by the first one is taken from accumulator x2 instead of memory
+    auto lowerFused = [&](const EVM2::Instruction& i, const EVM2::Instruction& n) -> bool
+    {
+        auto isReg = [](const EVM2::Arg& a, uint8_t reg) {
+            return a.kind == EVM2::Arg::Kind::REG && a.reg == reg;
+        };
+
+        // loadConst C, rK + add/sub/compare using rK: constant folded into immediate
+        if (i.opcode == EVM2::Op::LOADCONST && (n.opcode == EVM2::Op::ADD || n.opcode == EVM2::Op::SUB ||
+                                                n.opcode == EVM2::Op::COMPARE))
+        {
+            const EVM2::Arg& k = i.args[1];
+            const EVM2::Arg* other = nullptr;
+            if (isReg(n.args[1], k.reg))
+                other = &n.args[0];
+            else if (n.opcode == EVM2::Op::ADD && isReg(n.args[0], k.reg))
+                other = &n.args[1];
+
+            int64_t value = i.args[0].constValue;
+            auto op = n.opcode == EVM2::Op::ADD ? ARM64JITFrontend::AluOp::ADD : ARM64JITFrontend::AluOp::SUB;
+            if (value < 0 && value > -4096)
+            {
+                op = op == ARM64JITFrontend::AluOp::ADD ? ARM64JITFrontend::AluOp::SUB : ARM64JITFrontend::AluOp::ADD;
+                value = -value;
+            }
+            if (!other || value < 0 || value >= 4096)
+                return false;
+
+            lower(i);
+            locate(n);
+            jit.aluImm(op, n.args[2], *other, (uint16_t)value);
+            if (n.opcode == EVM2::Op::COMPARE)
+                jit.signumAcc(n.args[2]);
+            stats.fusedPairs++;
+            return true;
+        }
+
+        // loadConst C, rK + jumpEqual L, x, rK: compare with immediate
+        if (i.opcode == EVM2::Op::LOADCONST && n.opcode == EVM2::Op::JUMPEQ)
+        {
+            const EVM2::Arg& k = i.args[1];
+            const EVM2::Arg* other = nullptr;
+            if (isReg(n.args[2], k.reg))
+                other = &n.args[1];
+            else if (isReg(n.args[1], k.reg))
+                other = &n.args[2];
+
+            int64_t value = i.args[0].constValue;
+            if (!other || value <= -4096 || value >= 4096)
+                return false;
+
+            lower(i);
+            locate(n);
+            jit.compareImm(*other, value);
+            branchIfEqual(n);
+            stats.fusedPairs++;
+            return true;
+        }
+
+        // compare a, b, rT + jumpEqual L, rT, x: signum is compared directly
+        if (i.opcode == EVM2::Op::COMPARE && n.opcode == EVM2::Op::JUMPEQ && i.args[2].kind == EVM2::Arg::Kind::REG)
+        {
+            const EVM2::Arg* other = nullptr;
+            if (isReg(n.args[1], i.args[2].reg))
+                other = &n.args[2];
+            else if (isReg(n.args[2], i.args[2].reg))
+                other = &n.args[1];
+            if (!other)
+                return false;
+
+            lower(i);
+            locate(n);
+            jit.compareAcc(*other);
+            branchIfEqual(n);
+            stats.fusedPairs++;
+            return true;
+        }
+
+        // mov x, size[rA] + mov size[rA], y: round trip through memory is truncation
+        if (i.opcode == EVM2::Op::MOV && n.opcode == EVM2::Op::MOV)
+        {
+            const EVM2::Arg& stored = i.args[1];
+            const EVM2::Arg& loaded = n.args[0];
+            if (stored.kind != EVM2::Arg::Kind::MEM || loaded.kind != EVM2::Arg::Kind::MEM ||
+                stored.reg != loaded.reg || stored.sizeBytes != loaded.sizeBytes)
+                return false;
+
+            lower(i);
+            locate(n);
+            jit.truncateAcc(stored.sizeBytes);
+            jit.storeAcc(n.args[1]);
+            stats.fusedPairs++;
+            return true;
+        }
+
+        return false;
+    };
+
+    // CALL into short straight-line helper is replaced with its body
+    auto lowerInline = [&](const EVM2::Instruction& i) -> bool
+    {
+        auto target = indices.find(i.args[0].addr);
+        assert(target != indices.end());
+        auto body = inlineBodies.find(target->second);
+        if (body == inlineBodies.end())
+            return false;
+        const auto [first, last] = *body;
+
+        stats.inlinedCalls++;
+        // helper body is single block, it is counted as if it was called
+        if (options.instrumentBlocks)
+            jit.incrementCounter(offsetof(JITInterface_t, block_counters), 2*first);
+        for (size_t k = first; k < last; k++)
+        {
+            if (k + 1 < last && lowerFused(instructions[k], instructions[k+1]))
+                k++;
+            else
+                lower(instructions[k]);
+        }
+        return true;
+    };
+
+    const auto& order = layout.order();
+    std::vector<size_t> exitJumps;
+
+    ARM64JITFrontend::ShadowStack shadowStack = {};
+    if (options.shadowStackDepth)
+        shadowStack = {offsetof(JITInterface_t, shadow_stack), offsetof(JITInterface_t, shadow_stack_fault),
+                       std::bit_ceil((options.shadowStackDepth + 1) * sizeof(uint64_t))};
+    jit.begin(shadowStack);
+    for (const auto& [reg, host] : allocation.programEntryLoads())
+        jit.fillRegister(reg, host);
+
+    // compile blocks in layout order, cold section goes between hot code and epilogue
+    for (size_t pos = 0; pos < order.size(); pos++)
+    {
+        const BlockLayout::Block& block = layout.block(order[pos]);
+        size_t nextBlock = pos + 1 < order.size() ? order[pos + 1] : BlockLayout::none;
+        auto placedNext = [&](EVM2::Arg::addr_t target) {
+            return nextBlock != BlockLayout::none && instructions[layout.block(nextBlock).first].bitOffset == target;
+        };
+
+        for (size_t k = block.first; k <= block.last; k++)
+        {
+            const EVM2::Instruction& i = instructions[k];
+            jit.instructionBoundary();
+            mapping.insert({i.bitOffset, jit.getCurrentIndex()});
+            
+            if (auto it = labels.find(i.bitOffset); it != labels.end() && it->second == 'C')
+                jit.funcPrologue();
+            if (options.instrumentBlocks && k == block.first)
+                jit.incrementCounter(offsetof(JITInterface_t, block_counters), 2*k);
+            
+            if (k < block.last && lowerFused(i, instructions[k+1]))
+                mapping.insert({instructions[++k].bitOffset, mapping[i.bitOffset]});
+            else if (i.opcode == EVM2::Op::JUMP && placedNext(i.args[0].addr))
+                ;   // target follows
+            else if (i.opcode != EVM2::Op::CALL || !lowerInline(i))
+                lower(i);
+            jit.nop();
+        }
+
+        // fall-through to source successor
+        const EVM2::Instruction& last = instructions[block.last];
+        if (last.opcode == EVM2::Op::JUMP || last.opcode == EVM2::Op::RET)
+            continue;
+        bool lastBlock = order[pos] + 1 == layout.blockCount();
+        EVM2::Arg::addr_t successor = lastBlock ? 0 : instructions[block.last + 1].bitOffset;
+        if (last.opcode == EVM2::Op::JUMPEQ)
+        {
+            if (options.instrumentBlocks)
+                jit.incrementCounter(offsetof(JITInterface_t, block_counters), 2*block.last + 1);
+            if (!lastBlock && !placedNext(successor) && placedNext(fixups.back().second))
+            {
+                jit.invertBranch(fixups.back().first);
+                fixups.back().second = successor;
+                continue;
+            }
+        }
+        if (lastBlock && nextBlock != BlockLayout::none)
+            exitJumps.push_back(jit.jump());
+        else if (!lastBlock && !placedNext(successor))
+            fixups.push_back({jit.jump(), successor});
     }
-    jit.end();
+    size_t exit = jit.end();
+    for (size_t instruction : exitJumps)
+        jit.patchBranchOrImm(instruction, exit);
+    
+    // thread entry stubs load allocated registers of the child from registers[]
+    std::map<EVM2::Arg::addr_t, size_t> entries;
+    for (const auto& [instruction, target] : entryFixups)
+    {
+        auto it = mapping.find(target);
+        assert(it != mapping.end());
+        const auto& loads = allocation.threadEntryLoads(indices[target]);
+        if (entries.contains(target))
+            continue;
+        if (loads.empty())
+        {
+            entries[target] = it->second;
+            continue;
+        }
+        entries[target] = jit.getCurrentIndex();
+        for (const auto& [reg, host] : loads)
+            jit.fillRegister(reg, host);
+        jit.jump(it->second);
+    }
+    timer.lap(stats.loweringNs);
+    for (const auto& [instruction, target] : entryFixups)
+        jit.patchBranchOrImm(instruction, entries[target]);
     
     // patch branches and immediates
     for (const auto [instruction, target] : fixups)
@@ -160,9 +446,20 @@ JITFunction Compile(const EVM2::Disassembler& disasm, ARM64JITFrontend& jit, JIT
         jit.patchBranchOrImm(instruction, it->second);
     }
     
+    timer.lap(stats.fixupsNs);
+    
+    if (bitOffsets)
+        *bitOffsets = mapping;
+    
     // finalize
     void* func = jit.finalize();
     assert(func);
+    timer.lap(stats.finalizeNs);
+    
+    stats.instructions = instructions.size();
+    stats.codeBytes = jit.getCodeSize();
+    stats.fixups = fixups.size() + entryFixups.size() + exitJumps.size();
+    stats.codeAllocations = jit.getCodeAllocations();
 
     return (JITFunction)func;
 }
@@ -0,0 +1,73 @@
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+
+/**
+ * Startup cost of a program: time of every compile phase and size of its
+ * output
+ *
+ * Phases in order:
+ *   - decode: Disassembler construction (file read and decoding)
+ *   - labels: jump/call/thread target discovery
+ *   - allocation: register allocation (liveness, live ranges)
+ *   - layout: basic blocks and their order
+ *   - lowering: code generation of all blocks, epilogue, thread entries
+ *   - fixups: patching branches to their targets
+ *   - finalize: trimming code and switching it to execution
+ * Decode is filled by the caller, the rest by Compile().
+ */
+struct CompileStats {
+    uint64_t decodeNs = 0;
+    uint64_t labelsNs = 0;
+    uint64_t allocationNs = 0;
+    uint64_t layoutNs = 0;
+    uint64_t loweringNs = 0;
+    uint64_t fixupsNs = 0;
+    uint64_t finalizeNs = 0;
+
+    size_t instructions = 0;        // EVM instructions
+    size_t codeBytes = 0;           // host code
+    size_t fixups = 0;              // patched branches, including thread entries
+    size_t fusedPairs = 0;          // superinstructions
+    size_t inlinedCalls = 0;
+    size_t codeAllocations = 0;     // code heap chunks allocated or resized
+
+    /**
+     * Measures consecutive phases, lap() adds time since the previous lap
+     */
+    class Timer {
+        std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+    public:
+        void lap(uint64_t& phaseNs) {
+            auto now = std::chrono::steady_clock::now();
+            phaseNs += std::chrono::duration_cast<std::chrono::nanoseconds>(now - last).count();
+            last = now;
+        }
+    };
+
+    uint64_t totalNs() const {
+        return decodeNs + labelsNs + allocationNs + layoutNs + loweringNs + fixupsNs + finalizeNs;
+    }
+
+    void write(FILE* f) const {
+        auto phase = [&](const char* name, uint64_t ns) {
+            fprintf(f, "  %-12s %10.3f ms\n", name, ns / 1e6);
+        };
+        fprintf(f, "# compile stats\n");
+        phase("decode", decodeNs);
+        phase("labels", labelsNs);
+        phase("allocation", allocationNs);
+        phase("layout", layoutNs);
+        phase("lowering", loweringNs);
+        phase("fixups", fixupsNs);
+        phase("finalize", finalizeNs);
+        phase("total", totalNs());
+        fprintf(f, "  %-24s %zu\n", "instructions", instructions);
+        fprintf(f, "  %-24s %zu\n", "code bytes", codeBytes);
+        fprintf(f, "  %-24s %.2f\n", "bytes per instruction", instructions ? (double)codeBytes / instructions : 0.0);
+        fprintf(f, "  %-24s %zu\n", "fixups", fixups);
+        fprintf(f, "  %-24s %zu\n", "fused pairs", fusedPairs);
+        fprintf(f, "  %-24s %zu\n", "inlined calls", inlinedCalls);
+        fprintf(f, "  %-24s %zu\n", "code allocations", codeAllocations);
+    }
+};
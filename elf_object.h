@@ -0,0 +1,313 @@
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+/**
+ * Precompiled EVM2 program as relocatable AArch64 ELF object
+ *
+ * Sections:
+ *   - .text: JIT code, page aligned in the file so it can be mapped directly
+ *   - .rodata: evm_entry, evm_data_size, evm_map_count and evm_map
+ *     (pairs of EVM bit offset and host instruction index)
+ *   - .evm.data: initial content of the guest memory
+ *
+ * Generated code calls host through the table passed as JITFunction argument,
+ * so there are no relocations and the object does not depend on the process
+ * that wrote it. It is linkable with system linker, or loaded directly by
+ * ELFObject::read/link with zero compilation.
+ */
+class ELFObject {
+    enum {
+        fileAlign = 16384,      // largest page size (Apple Silicon)
+        machineAArch64 = 183,
+        typeRel = 1,
+        shtProgbits = 1,
+        shtSymtab = 2,
+        shtStrtab = 3,
+        shfAlloc = 2,
+        shfExec = 4
+    };
+
+    struct Header {
+        uint8_t ident[16];
+        uint16_t type;
+        uint16_t machine;
+        uint32_t version;
+        uint64_t entry;
+        uint64_t phoff;
+        uint64_t shoff;
+        uint32_t flags;
+        uint16_t ehsize;
+        uint16_t phentsize;
+        uint16_t phnum;
+        uint16_t shentsize;
+        uint16_t shnum;
+        uint16_t shstrndx;
+    };
+
+    struct Section {
+        uint32_t name;
+        uint32_t type;
+        uint64_t flags;
+        uint64_t addr;
+        uint64_t offset;
+        uint64_t size;
+        uint32_t link;
+        uint32_t info;
+        uint64_t addralign;
+        uint64_t entsize;
+    };
+
+    struct Symbol {
+        uint32_t name;
+        uint8_t info;
+        uint8_t other;
+        uint16_t shndx;
+        uint64_t value;
+        uint64_t size;
+    };
+
+    template<typename T>
+    static void append(std::vector<uint8_t>& out, const T& value) {
+        const uint8_t* p = (const uint8_t*)&value;
+        out.insert(out.end(), p, p + sizeof(T));
+    }
+
+    static uint32_t addString(std::vector<uint8_t>& table, const std::string& str) {
+        uint32_t pos = (uint32_t)table.size();
+        table.insert(table.end(), str.begin(), str.end());
+        table.push_back(0);
+        return pos;
+    }
+
+    std::string path;
+    std::vector<uint8_t> file;
+    size_t textOffset = 0;
+    size_t textSize = 0;
+    size_t entryIndex = 0;
+    uint32_t dataSize = 0;
+    std::vector<uint8_t> data;
+    std::vector<std::pair<uint32_t, uint32_t>> map;
+    void* executable_memory = nullptr;
+    size_t executable_size = 0;
+    bool heapAllocated = false;
+
+public:
+    ELFObject() = default;
+
+    ~ELFObject() {
+        if (executable_memory && heapAllocated)
+            CodeHeap::instance().release(executable_memory);
+        else if (executable_memory)
+            munmap(executable_memory, executable_size);
+    }
+
+    ELFObject(const ELFObject&) = delete;
+    ELFObject& operator=(const ELFObject&) = delete;
+
+    /**
+     * Write relocatable object with code generated by ARM64JITFrontend
+     */
+    static bool write(const std::string& filename, const ARM64JITFrontend& jit,
+                      const JITMapping& mapping, uint32_t dataSize, const std::vector<uint8_t>& initialData) {
+        std::vector<uint8_t> shstrtab(1, 0), strtab(1, 0);
+        std::vector<uint8_t> rodata, symtab;
+        std::span<const uint32_t> code = jit.getCode();
+
+        enum { secNull, secText, secRodata, secData, secSymtab, secStrtab, secShstrtab, secCount };
+
+        // .rodata
+        append<uint64_t>(rodata, jit.entry());
+        append<uint64_t>(rodata, dataSize);
+        append<uint64_t>(rodata, mapping.size());
+        for (const auto& [bitOffset, index] : mapping)
+        {
+            append<uint32_t>(rodata, bitOffset);
+            append<uint32_t>(rodata, (uint32_t)index);
+        }
+
+        // .symtab
+        auto symbol = [&](const std::string& name, uint8_t info, uint16_t shndx, uint64_t value, uint64_t size) {
+            append(symtab, Symbol{name.empty() ? 0 : addString(strtab, name), info, 0, shndx, value, size});
+        };
+        symbol("", 0, 0, 0, 0);
+        symbol("", 0x03, secText, 0, 0);                    // STB_LOCAL, STT_SECTION
+        const uint32_t firstGlobal = 2;
+        symbol("evm_program", 0x12, secText, 0, code.size()*4);    // STB_GLOBAL, STT_FUNC
+        symbol("evm_entry", 0x11, secRodata, 0, 8);                // STB_GLOBAL, STT_OBJECT
+        symbol("evm_data_size", 0x11, secRodata, 8, 8);
+        symbol("evm_map_count", 0x11, secRodata, 16, 8);
+        symbol("evm_map", 0x11, secRodata, 24, mapping.size()*8);
+
+        // layout: header, metadata sections, page aligned .text, section headers
+        const char* names[secCount] = {"", ".text", ".rodata", ".evm.data", ".symtab", ".strtab", ".shstrtab"};
+        uint32_t nameIndex[secCount] = {0};
+        for (int sec = secText; sec < secCount; sec++)
+            nameIndex[sec] = addString(shstrtab, names[sec]);
+
+        std::vector<uint8_t> out(sizeof(Header), 0);
+        std::vector<Section> sections(secCount, Section{});
+        auto place = [&](int sec, uint32_t type, uint64_t flags, const uint8_t* bytes, size_t size,
+                         uint64_t align, uint64_t entsize = 0, uint32_t link = 0, uint32_t info = 0) {
+            while (out.size() % align)
+                out.push_back(0);
+            sections[sec] = Section{nameIndex[sec], type, flags, 0, out.size(), size, link, info, align, entsize};
+            out.insert(out.end(), bytes, bytes + size);
+        };
+
+        place(secRodata, shtProgbits, shfAlloc, rodata.data(), rodata.size(), 8);
+        place(secData, shtProgbits, 0, initialData.data(), initialData.size(), 1);
+        place(secSymtab, shtSymtab, 0, symtab.data(), symtab.size(), 8, sizeof(Symbol), secStrtab, firstGlobal);
+        place(secStrtab, shtStrtab, 0, strtab.data(), strtab.size(), 1);
+        place(secShstrtab, shtStrtab, 0, shstrtab.data(), shstrtab.size(), 1);
+
+        while (out.size() % fileAlign)
+            out.push_back(0);
+        place(secText, shtProgbits, shfAlloc | shfExec, (const uint8_t*)code.data(), code.size()*4, 4);
+
+        while (out.size() % 8)
+            out.push_back(0);
+        uint64_t shoff = out.size();
+        for (const Section& s : sections)
+            append(out, s);
+
+        Header h = {};
+        memcpy(h.ident, "\x7f" "ELF", 4);
+        h.ident[4] = 2;     // ELFCLASS64
+        h.ident[5] = 1;     // ELFDATA2LSB
+        h.ident[6] = 1;     // EV_CURRENT
+        h.type = typeRel;
+        h.machine = machineAArch64;
+        h.version = 1;
+        h.shoff = shoff;
+        h.ehsize = sizeof(Header);
+        h.shentsize = sizeof(Section);
+        h.shnum = secCount;
+        h.shstrndx = secShstrtab;
+        memcpy(out.data(), &h, sizeof(h));
+
+        std::ofstream f(filename, std::ios::binary);
+        f.write((const char*)out.data(), out.size());
+        return (bool)f;
+    }
+
+    /**
+     * Parse object written by write()
+     */
+    bool read(const std::string& filename) {
+        path = filename;
+        if (!EVM2::Disassembler::readFile(filename, file) || file.size() < sizeof(Header))
+            return false;
+
+        Header h;
+        memcpy(&h, file.data(), sizeof(h));
+        if (memcmp(h.ident, "\x7f" "ELF", 4) != 0 || h.ident[4] != 2 || h.machine != machineAArch64 || h.type != typeRel)
+            return false;
+        if (h.shoff + (uint64_t)h.shnum * sizeof(Section) > file.size() || h.shstrndx >= h.shnum)
+            return false;
+
+        std::vector<Section> sections(h.shnum);
+        memcpy(sections.data(), file.data() + h.shoff, h.shnum * sizeof(Section));
+        for (const Section& s : sections)
+            if (s.offset + s.size > file.size())
+                return false;
+
+        auto name = [&](const Section& strings, uint32_t pos) -> std::string {
+            return pos < strings.size ? std::string((const char*)file.data() + strings.offset + pos) : "";
+        };
+        auto find = [&](const std::string& sectionName) -> const Section* {
+            for (const Section& s : sections)
+                if (name(sections[h.shstrndx], s.name) == sectionName)
+                    return &s;
+            return nullptr;
+        };
+
+        const Section* text = find(".text");
+        const Section* rodata = find(".rodata");
+        const Section* evmData = find(".evm.data");
+        if (!text || !rodata || !evmData || rodata->size < 24)
+            return false;
+
+        textOffset = text->offset;
+        textSize = text->size;
+
+        const uint8_t* p = file.data() + rodata->offset;
+        uint64_t values[3];
+        memcpy(values, p, sizeof(values));
+        entryIndex = values[0];
+        dataSize = (uint32_t)values[1];
+        if (rodata->size < 24 + values[2]*8)
+            return false;
+        map.clear();
+        for (uint64_t i = 0; i < values[2]; i++)
+        {
+            uint32_t pair[2];
+            memcpy(pair, p + 24 + i*8, sizeof(pair));
+            map.push_back({pair[0], pair[1]});
+        }
+
+        data.assign(file.begin() + evmData->offset, file.begin() + evmData->offset + evmData->size);
+
+        return true;
+    }
+
+    /**
+     * Map code into executable memory
+     */
+    JITFunction link() {
+        size_t page_size = sysconf(_SC_PAGESIZE);
+
+#ifndef __APPLE__
+        // file pages are mapped executable as they are
+        // (Apple requires signed code for that, so it always goes through copy)
+        if (textOffset % page_size == 0)
+        {
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd >= 0)
+            {
+                executable_size = (textSize + page_size - 1) & ~(page_size - 1);
+                void* mem = mmap(nullptr, executable_size, PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, textOffset);
+                close(fd);
+                if (mem != MAP_FAILED)
+                {
+                    executable_memory = mem;
+                    return (JITFunction)executable_memory;
+                }
+            }
+        }
+#endif
+        executable_memory = CodeHeap::instance().allocate(textSize);
+        if (!executable_memory)
+            return nullptr;
+        heapAllocated = true;
+        CodeHeap::instance().write(executable_memory, file.data() + textOffset, textSize);
+
+        return (JITFunction)executable_memory;
+    }
+
+    /**
+     * Index of first instruction after main prologue
+     */
+    size_t entry() const {
+        return entryIndex;
+    }
+
+    uint32_t getDataSize() const {
+        return dataSize;
+    }
+
+    const std::vector<uint8_t>& getData() const {
+        return data;
+    }
+
+    /**
+     * EVM bit offset and host instruction index pairs
+     */
+    const std::vector<std::pair<uint32_t, uint32_t>>& getMap() const {
+        return map;
+    }
+};
@@ -134,6 +134,45 @@ public:
     uint64_t getPos() const { return pos; }
 };
 
+class BitWriter {
+private:
+    vector<uint8_t> bytes;
+    uint64_t pos = 0;
+    
+public:
+    // Write a single bit (MSB first within the target byte), counterpart of BitReader::readBit.
+    void writeBit(int bit) {
+        if (pos % 8 == 0) bytes.push_back(0);
+        if (bit & 1) bytes.back() |= uint8_t(1 << (7 - pos % 8));
+        pos++;
+    }
+    
+    // Write n bits, MSB of the value first (opcodes).
+    void writeBitsBE(uint64_t v, unsigned n) {
+        for (unsigned i = n; i-- > 0;)
+            writeBit((v >> i) & 1);
+    }
+    
+    // Write n bits, LSB of the value first (little-endian at bit level, see readBitsLEbits).
+    void writeBitsLEbits(uint64_t v, unsigned n) {
+        for (unsigned i = 0; i < n; ++i)
+            writeBit((v >> i) & 1);
+    }
+    
+    // Overwrite n already written bits at position (forward label references).
+    void patchBitsLEbits(uint64_t at, uint64_t v, unsigned n) {
+        for (unsigned i = 0; i < n; ++i, ++at) {
+            uint8_t mask = uint8_t(1 << (7 - at % 8));
+            bytes[at / 8] = ((v >> i) & 1) ? (bytes[at / 8] | mask) : (bytes[at / 8] & ~mask);
+        }
+    }
+    
+    uint64_t getPos() const { return pos; }
+    
+    // Written bytes, last one padded with zero bits.
+    const vector<uint8_t>& getBytes() const { return bytes; }
+};
+
 static const vector<pair<string, Op>> opcodeTable = {
     {"000", Op::MOV},
     {"001", Op::LOADCONST},
@@ -431,6 +470,81 @@ private:
     vector<Instruction> instructions;
 };
 
+// Encodes instructions into EVM2 code and writes EVM2 files, inverse of Disassembler.
+// Arguments are written in the order Disassembler reads them into Instruction::args.
+class Encoder {
+public:
+    static const string& opcodeBits(Op op) {
+        for (auto &p : opcodeTable) {
+            if (p.second == op) return p.first;
+        }
+        throw runtime_error("Unknown opcode");
+    }
+    
+    static unsigned argBits(const Arg& a) {
+        switch (a.kind) {
+            case Arg::Kind::REG: return 1 + 4;
+            case Arg::Kind::MEM: return 1 + 2 + 4;
+            case Arg::Kind::CONST: return 64;
+            case Arg::Kind::ADDR: return 32;
+            default: throw runtime_error("Bad argument");
+        }
+    }
+    
+    // Size of encoded instruction, bit offsets of labels are known before writing.
+    static uint64_t instructionBits(const Instruction& ins) {
+        uint64_t bits = opcodeBits(ins.opcode).size();
+        for (const Arg& a : ins.args) bits += argBits(a);
+        return bits;
+    }
+    
+    static void writeArg(BitWriter& bw, const Arg& a) {
+        switch (a.kind) {
+            case Arg::Kind::REG:
+                bw.writeBit(0);
+                bw.writeBitsLEbits(a.reg, 4);
+                break;
+            case Arg::Kind::MEM: {
+                unsigned ss = a.sizeBytes == 1 ? 0 : a.sizeBytes == 2 ? 1 : a.sizeBytes == 4 ? 2 : 3;
+                bw.writeBit(1);
+                bw.writeBitsLEbits(ss, 2);
+                bw.writeBitsLEbits(a.reg, 4);
+                break;
+            }
+            case Arg::Kind::CONST:
+                bw.writeBitsLEbits((uint64_t)a.constValue, 64);
+                break;
+            case Arg::Kind::ADDR:
+                bw.writeBitsLEbits(a.addr, 32);
+                break;
+            default:
+                throw runtime_error("Bad argument");
+        }
+    }
+    
+    static void writeInstruction(BitWriter& bw, const Instruction& ins) {
+        for (char c : opcodeBits(ins.opcode)) bw.writeBit(c == '1');
+        for (const Arg& a : ins.args) writeArg(bw, a);
+    }
+    
+    static bool writeFile(const string& path, const vector<uint8_t>& code, uint32_t dataSize,
+                          const vector<uint8_t>& initialData) {
+        ofstream f(path, ios::binary);
+        if (!f) return false;
+        auto le32 = [&](uint32_t v) {
+            uint8_t b[4] = {uint8_t(v), uint8_t(v >> 8), uint8_t(v >> 16), uint8_t(v >> 24)};
+            f.write((const char*)b, 4);
+        };
+        f.write("ESET-VM2", 8);
+        le32((uint32_t)code.size());
+        le32(dataSize);
+        le32((uint32_t)initialData.size());
+        f.write((const char*)code.data(), code.size());
+        f.write((const char*)initialData.data(), initialData.size());
+        return (bool)f;
+    }
+};
+
 }
 /*
 int main(int argc, char** argv) {
@@ -0,0 +1,198 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+#include <time.h>
+
+/**
+ * Microbenchmarks of host calls (JITInterface_t entries)
+ *
+ * Guest code is replaced by native function with JITFunction signature,
+ * it calls the host table the same way generated code does, so every
+ * iteration is the full round trip: C ABI call, CThread lookup, host work.
+ * Entry points of the function:
+ *   - mainEntry: starts threads-1 workers through thread_create, runs its
+ *     own loop and joins them
+ *   - workerEntry: waits for all threads, calls the measured entry
+ *     iterations times
+ *   - emptyEntry: returns at once (thread_create/join case)
+ * Locks are measured uncontended (lock id per thread) and contended (one
+ * lock id for all threads).
+ *
+ * Output follows Google Benchmark console format:
+ *   Time - wall time of the slowest thread per iteration
+ *   CPU - CPU time of all threads per iteration of one thread
+ */
+class HostCallBenchmark {
+public:
+    enum Case {
+        consoleWrite,
+        consoleRead,
+        sleep,
+        lockUncontended,
+        lockContended,
+        fileRead,
+        fileWrite,
+        threadCreateJoin,
+        shadowStack,
+        caseCount
+    };
+
+    enum {
+        mainEntry = 0,
+        workerEntry = 1,
+        emptyEntry = 2,
+        fileBytes = 64,
+        dataSize = 4096
+    };
+
+private:
+    static inline Case current = consoleWrite;
+    static inline size_t threadCount = 1;
+    static inline size_t iterationCount = 0;
+    static inline std::atomic<size_t> ready = 0;
+    static inline std::atomic<uint64_t> maxWallNs = 0;
+    static inline std::atomic<uint64_t> cpuNs = 0;
+
+    static uint64_t threadCpuNs() {
+        timespec ts;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+
+    static void measure(uint64_t index, const JITInterface_t* iface) {
+        ready.fetch_add(1);
+        while (ready.load() < threadCount)
+            std::this_thread::yield();
+
+        auto start = std::chrono::steady_clock::now();
+        uint64_t cpuStart = threadCpuNs();
+        for (size_t n = 0; n < iterationCount; n++)
+        {
+            switch (current)
+            {
+                case consoleWrite:
+                    iface->print_value(n);
+                    break;
+                case consoleRead:
+                    iface->read_value();
+                    break;
+                case sleep:
+                    iface->thread_sleep(0);
+                    break;
+                case lockUncontended:
+                    iface->thread_lock(1 + index);
+                    iface->thread_unlock(1 + index);
+                    break;
+                case lockContended:
+                    iface->thread_lock(0);
+                    iface->thread_unlock(0);
+                    break;
+                case fileRead:
+                    iface->file_read(0, fileBytes, index * fileBytes % dataSize);
+                    break;
+                case fileWrite:
+                    iface->file_write(index * fileBytes % dataSize, fileBytes, index * fileBytes % dataSize);
+                    break;
+                case threadCreateJoin:
+                    iface->thread_join(iface->thread_create(emptyEntry));
+                    break;
+                case shadowStack:
+                    iface->shadow_stack(dataSize);
+                    break;
+                default:
+                    break;
+            }
+        }
+        uint64_t wall = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        cpuNs.fetch_add(threadCpuNs() - cpuStart);
+        uint64_t previous = maxWallNs.load();
+        while (wall > previous && !maxWallNs.compare_exchange_weak(previous, wall))
+            ;
+    }
+
+public:
+    static const char* name(Case c) {
+        static const char* names[caseCount] = {
+            "console_write", "console_read", "sleep_0", "lock_unlock/uncontended", "lock_unlock/contended",
+            "file_read", "file_write", "thread_create_join", "shadow_stack"
+        };
+        return names[c];
+    }
+
+    /**
+     * Iterations per thread, every case runs well below the soft timeout of CThread
+     */
+    static size_t iterations(Case c) {
+        switch (c)
+        {
+            case threadCreateJoin:
+                return 200;
+            case sleep:
+                return 2000;
+            case consoleWrite:
+            case consoleRead:
+            case fileRead:
+            case fileWrite:
+                return 20000;
+            default:
+                return 10000;
+        }
+    }
+
+    /**
+     * Set up run of one case, called before the guest starts
+     */
+    static void configure(Case c, size_t threads, size_t iterations) {
+        current = c;
+        threadCount = threads;
+        iterationCount = iterations;
+        ready = 0;
+        maxWallNs = 0;
+        cpuNs = 0;
+    }
+
+    /**
+     * JITFunction standing in for generated code, registers[0] is the thread index
+     */
+    static void guest(void*, uint64_t* registers, size_t entry, const JITInterface_t* iface) {
+        if (entry == emptyEntry)
+            return;
+        if (entry == workerEntry)
+        {
+            measure(registers[0], iface);
+            return;
+        }
+
+        std::vector<uint64_t> workers;
+        for (size_t t = 1; t < threadCount; t++)
+        {
+            registers[0] = t;       // copied by the child
+            workers.push_back(iface->thread_create(workerEntry));
+        }
+        registers[0] = 0;
+        measure(0, iface);
+        for (uint64_t tid : workers)
+            iface->thread_join(tid);
+    }
+
+    static void writeHeader(FILE* f) {
+        fprintf(f, "%s\n%-48s %13s %15s %12s\n%s\n", std::string(92, '-').c_str(), "Benchmark", "Time", "CPU",
+                "Iterations", std::string(92, '-').c_str());
+    }
+
+    /**
+     * Row of the case measured by the last guest run
+     */
+    static void writeResult(FILE* f) {
+        std::string label = std::string("host_call/") + name(current) + "/threads:" + std::to_string(threadCount);
+        double time = iterationCount ? (double)maxWallNs.load() / iterationCount : 0.0;
+        double cpu = iterationCount ? (double)cpuNs.load() / iterationCount : 0.0;
+        fprintf(f, "%-48s %10.0f ns %12.0f ns %12zu\n", label.c_str(), time, cpu, iterationCount);
+        fflush(f);
+    }
+};
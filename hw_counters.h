@@ -0,0 +1,219 @@
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+/**
+ * Hardware performance counters of guest threads (perf_event_open)
+ *
+ * Every native thread running guest code opens its own counters, user
+ * space only, so they work unprivileged up to perf_event_paranoid 2.
+ * Counters are opened one by one, event missing on the CPU or refused by
+ * the kernel is reported as n/a and the rest still counts. When the PMU
+ * multiplexes, values are scaled by enabled/running time.
+ *
+ * Report has the counters of every guest thread and their sum for the VM,
+ * with IPC and miss rates per kilo instruction: high IPC means compute
+ * bound, cache/TLB misses memory bound, low instruction count over long
+ * lifetime waiting (locks, sleep). Threads still running when the report
+ * is written are listed without values and left out of the sum.
+ */
+class HardwareCounters {
+public:
+    enum Counter {
+        cycles,
+        instructions,
+        branchMisses,
+        l1dMisses,
+        llcMisses,
+        dtlbMisses,
+        counterCount
+    };
+
+    struct Values {
+        uint64_t value[counterCount] = {};
+        bool valid[counterCount] = {};
+    };
+
+    /**
+     * Counters of calling thread, count for the lifetime of the object
+     */
+    class ThreadCounters {
+        uint64_t tid;
+#ifdef __linux__
+        int fds[counterCount];
+#endif
+    public:
+        explicit ThreadCounters(uint64_t threadId) : tid(threadId) {
+#ifdef __linux__
+            for (int c = 0; c < counterCount; c++)
+                fds[c] = active ? open((Counter)c) : -1;
+            if (HardwareCounters* counters = active)
+                counters->started(tid);
+            for (int fd : fds)
+                if (fd >= 0)
+                    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+        }
+
+        ~ThreadCounters() {
+#ifdef __linux__
+            Values values;
+            for (int c = 0; c < counterCount; c++)
+            {
+                if (fds[c] < 0)
+                    continue;
+                ioctl(fds[c], PERF_EVENT_IOC_DISABLE, 0);
+                uint64_t data[3];       // value, time enabled, time running
+                if (read(fds[c], data, sizeof(data)) == sizeof(data) && data[2])
+                {
+                    values.value[c] = data[2] < data[1] ? (uint64_t)((double)data[0] * data[1] / data[2]) : data[0];
+                    values.valid[c] = true;
+                }
+                close(fds[c]);
+            }
+            if (HardwareCounters* counters = active)
+                counters->add(tid, values);
+#endif
+        }
+
+        ThreadCounters(const ThreadCounters&) = delete;
+        ThreadCounters& operator=(const ThreadCounters&) = delete;
+    };
+
+    static inline HardwareCounters* active = nullptr;
+
+private:
+    std::mutex threadsMutex;
+    std::map<uint64_t, Values> threads;
+    std::set<uint64_t> running;
+
+    static const char* name(Counter c) {
+        static const char* names[counterCount] = {
+            "cycles", "instructions", "branch-misses", "L1D-misses", "LLC-misses", "dTLB-misses"
+        };
+        return names[c];
+    }
+
+#ifdef __linux__
+    static int open(Counter c) {
+        auto cache = [](uint64_t id) {
+            return id | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        };
+        perf_event_attr attr = {};
+        attr.size = sizeof(attr);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        switch (c)
+        {
+            case cycles:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_CPU_CYCLES;
+                break;
+            case instructions:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+                break;
+            case branchMisses:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+                break;
+            case l1dMisses:
+                attr.type = PERF_TYPE_HW_CACHE;
+                attr.config = cache(PERF_COUNT_HW_CACHE_L1D);
+                break;
+            case llcMisses:
+                attr.type = PERF_TYPE_HW_CACHE;
+                attr.config = cache(PERF_COUNT_HW_CACHE_LL);
+                break;
+            case dtlbMisses:
+                attr.type = PERF_TYPE_HW_CACHE;
+                attr.config = cache(PERF_COUNT_HW_CACHE_DTLB);
+                break;
+            default:
+                return -1;
+        }
+        return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+#endif
+
+    static void writeRow(FILE* f, const std::string& label, const Values& v) {
+        fprintf(f, "%-10s", label.c_str());
+        for (int c = 0; c < counterCount; c++)
+        {
+            if (v.valid[c])
+                fprintf(f, " %14" PRIu64, v.value[c]);
+            else
+                fprintf(f, " %14s", "n/a");
+        }
+        if (v.valid[cycles] && v.valid[instructions] && v.value[cycles])
+            fprintf(f, " %6.2f", (double)v.value[instructions] / v.value[cycles]);
+        else
+            fprintf(f, " %6s", "n/a");
+        for (Counter c : {branchMisses, l1dMisses, llcMisses, dtlbMisses})
+        {
+            if (v.valid[c] && v.valid[instructions] && v.value[instructions])
+                fprintf(f, " %8.2f", 1000.0 * v.value[c] / v.value[instructions]);
+            else
+                fprintf(f, " %8s", "n/a");
+        }
+        fprintf(f, "\n");
+    }
+
+public:
+    void started(uint64_t tid) {
+        std::lock_guard<std::mutex> guard(threadsMutex);
+        running.insert(tid);
+    }
+
+    void add(uint64_t tid, const Values& values) {
+        std::lock_guard<std::mutex> guard(threadsMutex);
+        running.erase(tid);
+        Values& total = threads[tid];
+        for (int c = 0; c < counterCount; c++)
+        {
+            total.value[c] += values.value[c];
+            total.valid[c] = total.valid[c] || values.valid[c];
+        }
+    }
+
+    /**
+     * Per thread table and VM total, rates are per 1000 instructions
+     */
+    void write(FILE* f) {
+        std::lock_guard<std::mutex> guard(threadsMutex);
+        fprintf(f, "# hardware counters\n%-10s", "thread");
+        for (int c = 0; c < counterCount; c++)
+            fprintf(f, " %14s", name((Counter)c));
+        fprintf(f, " %6s %8s %8s %8s %8s\n", "IPC", "br/ki", "L1D/ki", "LLC/ki", "dTLB/ki");
+
+        Values total;
+        bool any = false;
+        for (const auto& [tid, values] : threads)
+        {
+            writeRow(f, std::to_string(tid), values);
+            for (int c = 0; c < counterCount; c++)
+            {
+                total.value[c] += values.value[c];
+                total.valid[c] = total.valid[c] || values.valid[c];
+                any = any || values.valid[c];
+            }
+        }
+        for (uint64_t tid : running)
+            fprintf(f, "%-10s still running, not counted\n", std::to_string(tid).c_str());
+        writeRow(f, "VM", total);
+        if (!any)
+            fprintf(f, "# no counters available (no PMU access, check /proc/sys/kernel/perf_event_paranoid)\n");
+    }
+};
@@ -38,6 +38,68 @@ public:
                ((uint32_t)imm16 << 5) | (reg & 0x1F);
     }
     
+    /**
+     * MOVN Xd, #imm16, LSL #shift
+     * Move wide with NOT, 64-bit (Xd = ~(imm16 << shift))
+     */
+    static uint32_t gen_movn_x(int reg, uint16_t imm16, int shift) {
+        return (0b100 << 29) | (0b100101 << 23) | ((shift / 16) << 21) |
+               ((uint32_t)imm16 << 5) | (reg & 0x1F);
+    }
+    
+    /**
+     * Encode value as logical immediate, result is N:immr:imms (13 bits)
+     * Only repeated (rotated) runs of ones are encodable, 0 and ~0 are not
+     */
+    static bool encode_logical_imm(uint64_t value, uint32_t& encoded) {
+        if (value == 0 || value == ~0ULL)
+            return false;
+        
+        // smallest repeating element
+        int size = 64;
+        while (size > 2) {
+            int half = size / 2;
+            uint64_t mask = (1ULL << half) - 1;
+            if ((value & mask) != ((value >> half) & mask))
+                break;
+            size = half;
+        }
+        
+        uint64_t mask = size == 64 ? ~0ULL : (1ULL << size) - 1;
+        uint64_t element = value & mask;
+        int ones = __builtin_popcountll(element);
+        uint64_t run = (1ULL << ones) - 1;
+        
+        for (int r = 0; r < size; r++) {
+            uint64_t rotated = r == 0 ? element : ((element >> r) | (element << (size - r))) & mask;
+            if (rotated != run)
+                continue;
+            uint32_t n = size == 64;
+            uint32_t immr = (size - r) % size;
+            uint32_t imms = (~(size * 2 - 1) & 0x3F) | (ones - 1);
+            encoded = (n << 12) | (immr << 6) | imms;
+            return true;
+        }
+        return false;
+    }
+    
+    /**
+     * ORR Xd, Xn, #bitmask
+     * Logical OR with immediate, 64-bit, encoded from encode_logical_imm
+     * With Xn = 31 (XZR) it loads the bitmask
+     */
+    static uint32_t gen_orr_x_imm(int rd, int rn, uint32_t encoded) {
+        return 0xB2000000 | ((encoded & 0x1FFF) << 10) | ((rn & 0x1F) << 5) | (rd & 0x1F);
+    }
+    
+    /**
+     * TST Xn, #bitmask (ANDS XZR, Xn, #bitmask)
+     * Test bits with immediate, encoded from encode_logical_imm
+     */
+    static uint32_t gen_tst_x_imm(int rn, uint32_t encoded) {
+        return 0xF2000000 | ((encoded & 0x1FFF) << 10) | ((rn & 0x1F) << 5) | 31;
+    }
+    
     /**
      * MOVZ Wd, #imm16, LSL #shift
      * Move wide with zero, 32-bit
@@ -80,6 +142,17 @@ public:
                (rt & 0x1F);
     }
 
+    /**
+     * LDR Xt, label
+     * Load register (literal), 64-bit, PC relative
+     * offset is in instructions (signed 19-bit, ±1MB range)
+     */
+    static uint32_t gen_ldr_x_literal(int rt, int32_t offset) {
+        assert(offset >= -(1 << 18) && offset < (1 << 18));
+        int32_t imm19 = offset & 0x7FFFF;
+        return 0x58000000 | (imm19 << 5) | (rt & 0x1F);
+    }
+    
     /**
      * LDR Xt, [Xn, Xm]
      * Load register, 64-bit, register offset
@@ -136,6 +209,24 @@ public:
                (rt & 0x1F);
     }
     
+    /**
+     * STR Xt, [Xn], #offset
+     * Store register, 64-bit, post-index (Xn += offset after store)
+     * offset is in bytes (-256 to 255)
+     */
+    static uint32_t gen_str_x_post(int rt, int rn, int offset) {
+        return 0xF8000400 | ((offset & 0x1FF) << 12) | ((rn & 0x1F) << 5) | (rt & 0x1F);
+    }
+    
+    /**
+     * LDR Xt, [Xn, #offset]!
+     * Load register, 64-bit, pre-index (Xn += offset before load)
+     * offset is in bytes (-256 to 255)
+     */
+    static uint32_t gen_ldr_x_pre(int rt, int rn, int offset) {
+        return 0xF8400C00 | ((offset & 0x1FF) << 12) | ((rn & 0x1F) << 5) | (rt & 0x1F);
+    }
+    
     /**
      * STP Xt1, Xt2, [Xn, #offset]
      * Store pair of registers, 64-bit
@@ -258,6 +349,21 @@ public:
                ((rm & 0x1F) << 16) | ((rn & 0x1F) << 5) | 31;
     }
     
+    /**
+     * CMP Xn, #imm12 (implemented as SUBS XZR, Xn, #imm12)
+     */
+    static uint32_t gen_cmp_x_imm(int rn, uint16_t imm12) {
+        return 0xF1000000 | ((imm12 & 0xFFF) << 10) | ((rn & 0x1F) << 5) | 31;
+    }
+    
+    /**
+     * CMN Xn, #imm12 (implemented as ADDS XZR, Xn, #imm12)
+     * Compare with negated immediate
+     */
+    static uint32_t gen_cmn_x_imm(int rn, uint16_t imm12) {
+        return 0xB1000000 | ((imm12 & 0xFFF) << 10) | ((rn & 0x1F) << 5) | 31;
+    }
+    
     /**
      * CSET Xd, cond (implemented as CSINC Xd, XZR, XZR, invert(cond))
      * Conditional set, 64-bit
@@ -278,12 +384,20 @@ public:
     
     // ===== Branch Instructions =====
     
+    /**
+     * Offset in instructions is in reach of B.cond
+     */
+    static bool bcond_in_range(int32_t offset) {
+        return offset >= -(1 << 18) && offset < (1 << 18);
+    }
+    
     /**
      * B.cond offset
      * Conditional branch
      * offset is in instructions (signed 19-bit, ±1MB range)
      */
     static uint32_t gen_bcond(ConditionCode cond, int32_t offset) {
+        assert(bcond_in_range(offset));
         int32_t imm19 = offset & 0x7FFFF;
         return (0b01010100 << 24) | (imm19 << 5) | (static_cast<int>(cond) & 0xF);
     }
@@ -294,6 +408,7 @@ public:
      * offset is in instructions (signed 26-bit, ±128MB range)
      */
     static uint32_t gen_b(int32_t offset) {
+        assert(offset >= -(1 << 25) && offset < (1 << 25));
         int32_t imm26 = offset & 0x3FFFFFF;
         return (0b000101 << 26) | imm26;
     }
@@ -304,6 +419,7 @@ public:
      * offset is in instructions (signed 26-bit)
      */
     static uint32_t gen_bl(int32_t offset) {
+        assert(offset >= -(1 << 25) && offset < (1 << 25));
         int32_t imm26 = offset & 0x3FFFFFF;
         return (0b100101 << 26) | imm26;
     }
@@ -323,6 +439,7 @@ public:
      * offset is in bytes (signed 21-bit, ±1MB range)
      */
     static uint32_t gen_adr(int rd, int32_t offset) {
+        assert(offset >= -(1 << 20) && offset < (1 << 20));
         uint32_t immlo = offset & 0x3;
         uint32_t immhi = (offset >> 2) & 0x7FFFF;
         return (0b0 << 31) | (immlo << 29) | (0b10000 << 24) | (immhi << 5) | (rd & 0x1F);
@@ -340,6 +457,18 @@ public:
                (immr << 16) | (imms << 10) | ((rn & 0x1F) << 5) | (rd & 0x1F);
     }
     
+    /**
+     * UBFX Xd, Xn, #lsb, #width
+     * Unsigned bit field extract, 64-bit
+     * Implemented as UBFM Xd, Xn, #lsb, #(lsb+width-1)
+     */
+    static uint32_t gen_ubfx_x(int rd, int rn, int lsb, int width) {
+        int immr = lsb & 0x3F;
+        int imms = (lsb + width - 1) & 0x3F;
+        return (0b1 << 31) | (0b10 << 29) | (0b100110 << 23) | (0b1 << 22) |
+               (immr << 16) | (imms << 10) | ((rn & 0x1F) << 5) | (rd & 0x1F);
+    }
+    
     /**
      * BLR Xn
      * Branch with link to register (call register)
@@ -362,7 +491,7 @@ public:
     }
 
     static uint32_t gen_prologue1() {
-        return 0xA9BF7BF0; // stp x29, x30, [sp, #-16]!
+        return 0xA9BF7BFD; // stp x29, x30, [sp, #-16]!
     }
     
     static uint32_t gen_prologue2() {
@@ -370,6 +499,6 @@ public:
     }
     
     static uint32_t gen_epilogue() {
-        return 0xA8C17BF0; // ldp x29, x30, [sp], #16
+        return 0xA8C17BFD; // ldp x29, x30, [sp], #16
     }
 };
@@ -1,27 +1,35 @@
 #include "jit_arm64_be.h"
+#include "code_heap.h"
+#include <array>
 #include <cstdint>
 #include <cstring>
+#include <map>
+#include <span>
 #include <vector>
-#include <sys/mman.h>
-#include <unistd.h>
-#include <libkern/OSCacheControl.h>
 
 /**
  * ARM64 JIT Frontend - High-level code generation interface
  * 
  * Generated function signature:
- *   void jit_func(void* memory, uint64_t* registers, int entry_point)
+ *   void jit_func(void* memory, uint64_t* registers, int entry_point, const void* host_table)
  * 
  * Parameters:
  *   - memory: Pointer to machine memory buffer
  *   - registers: Pointer to array of 16 uint64_t registers
  *   - entry_point: Instruction index to jump to (0 for start)
+ *   - host_table: Table of host function pointers (JITInterface_t)
  * 
  * Register usage in generated code:
  *   - x0: memory pointer (preserved)
  *   - x1: registers pointer (preserved)
- *   - x2-x17: temporary/scratch registers
- *   - x19-x28: Available (minimal callee-saved usage)
+ *   - x2-x15: temporary/scratch registers
+ *   - x16, x17: profiling counters of instrumented code
+ *   - x19: memory pointer
+ *   - x20: registers pointer
+ *   - x21: host table, host calls are ldr x9, [x21, #slot]; blr x9 so the
+ *     code does not contain any absolute host address
+ *   - x22: shadow stack pointer when guest calls use shadow stack
+ *   - x23-x28, x5-x8, x11-x15: EVM registers assigned by register allocator
  *   - x29: FP
  *   - x30: LR
  *   - SP: Stack pointer
@@ -29,11 +37,43 @@
 class ARM64JITFrontend {
 public:
     using Operand = EVM2::Arg;
+    
+    /**
+     * ALU operation type
+     */
+    enum class AluOp {
+        ADD,      // dest = src1 + src2
+        SUB,      // dest = src1 - src2
+        MUL,      // dest = src1 * src2
+        DIV,      // dest = src1 / src2 (signed)
+        MOD,      // dest = src1 % src2 (unsigned)
+        SIGNUM    // dest = signum(src1), src2 ignored
+    };
+    
+    /**
+     * Return addresses of guest calls on VM managed stack instead of the
+     * native one, memory is requested from host for every thread in the
+     * prologue and aligned to its size, so bound check is test of low bits
+     * of the stack pointer. Slot 0 holds address of underflow handler, so
+     * RET without CALL does not jump anywhere else.
+     */
+    struct ShadowStack {
+        size_t allocSlot;       // host table: uint64_t* (uint64_t bytes), stack of current thread
+        size_t faultSlot;       // host table: void (uint64_t underflow), does not return
+        size_t bytes;           // power of two, 0 = native stack
+    };
 
 private:
-    std::vector<uint32_t> code;
-    void* executable_memory;
-    size_t executable_size;
+    CodeBuffer code;
+    size_t entry_index;
+    std::vector<std::pair<size_t, uint64_t>> pending_literals;  // ldr index, value
+    std::map<uint64_t, size_t> placed_literals;                // value, pool index
+    std::array<int8_t, 16> src_regs = {};                       // host register of read EVM register
+    std::array<int8_t, 16> dst_regs = {};                       // host register of written EVM register
+    int acc = 2;                                                // register with last result
+    ShadowStack shadow = {};
+    size_t overflow_handler = 0;                                // stack fault handlers, before entry dispatch
+    size_t underflow_handler = 0;
     
     size_t emit(uint32_t instruction) {
         code.push_back(instruction);
@@ -42,47 +82,140 @@ private:
     
     /**
      * Load a 64-bit immediate value into a register
-     * Uses MOVZ and MOVK instructions
+     * Picks the shortest form: single ORR for bitmask values, MOVZ or MOVN
+     * (for mostly ones, negative numbers) followed by MOVKs, and PC relative
+     * load from literal pool when that would take 3 or more instructions
      */
     void emit_load_imm64(int reg, uint64_t value) {
-        uint16_t parts[4] = {
-            (uint16_t)(value & 0xFFFF),
-            (uint16_t)((value >> 16) & 0xFFFF),
-            (uint16_t)((value >> 32) & 0xFFFF),
-            (uint16_t)((value >> 48) & 0xFFFF)
-        };
-        
-        // Find first non-zero part
-        int first = -1;
+        int zeroCost = 0, onesCost = 0;
         for (int i = 0; i < 4; i++) {
-            if (parts[i] != 0) {
-                first = i;
-                break;
-            }
+            uint16_t part = (value >> (i * 16)) & 0xFFFF;
+            zeroCost += part != 0;
+            onesCost += part != 0xFFFF;
         }
         
-        if (first == -1) {
-            emit(ARM64Backend::gen_movz_x(reg, 0, 0));
+        uint32_t logical;
+        if (zeroCost > 1 && onesCost > 1 && ARM64Backend::encode_logical_imm(value, logical)) {
+            emit(ARM64Backend::gen_orr_x_imm(reg, 31, logical));
             return;
         }
         
-        emit(ARM64Backend::gen_movz_x(reg, parts[first], first * 16));
-        for (int i = first + 1; i < 4; i++) {
-            if (parts[i] != 0) {
-                emit(ARM64Backend::gen_movk_x(reg, parts[i], i * 16));
-            }
+        if (zeroCost > 2 && onesCost > 2) {
+            emit_load_literal(reg, value);
+            return;
+        }
+        
+        // MOVN fills ones, remaining parts are corrected with MOVK
+        bool inverted = onesCost < zeroCost;
+        uint16_t fill = inverted ? 0xFFFF : 0;
+        if (zeroCost == 0 || onesCost == 0) {
+            emit(inverted ? ARM64Backend::gen_movn_x(reg, 0, 0) : ARM64Backend::gen_movz_x(reg, 0, 0));
+            return;
+        }
+        
+        bool first = true;
+        for (int i = 0; i < 4; i++) {
+            uint16_t part = (value >> (i * 16)) & 0xFFFF;
+            if (part == fill)
+                continue;
+            if (first)
+                emit(inverted ? ARM64Backend::gen_movn_x(reg, ~part, i * 16)
+                              : ARM64Backend::gen_movz_x(reg, part, i * 16));
+            else
+                emit(ARM64Backend::gen_movk_x(reg, part, i * 16));
+            first = false;
         }
     }
     
-public:
-    ARM64JITFrontend() : executable_memory(nullptr), executable_size(0) {}
+    // ===== Literal Pool =====
+    // 64-bit constants shared by LDR (literal) instructions, deduplicated,
+    // placed after the function or earlier (jumped over) before going out
+    // of LDR range
+    
+    enum {
+        literalRange = 1 << 17      // instructions, half of LDR literal reach
+    };
+    
+    void emit_load_literal(int reg, uint64_t value) {
+        if (auto it = placed_literals.find(value);
+            it != placed_literals.end() && getCurrentIndex() - it->second < literalRange) {
+            emit(ARM64Backend::gen_ldr_x_literal(reg, (int32_t)it->second - (int32_t)getCurrentIndex()));
+            return;
+        }
+        
+        if (!pending_literals.empty() && getCurrentIndex() - pending_literals.front().first >= literalRange)
+            flushLiterals(true);
+        
+        pending_literals.push_back({emit(ARM64Backend::gen_ldr_x_literal(reg, 0)), value});
+    }
+    
+    /**
+     * Place pending literals here and resolve their loads
+     */
+    void flushLiterals(bool jumpOver) {
+        if (pending_literals.empty())
+            return;
+        
+        size_t branch = jumpOver ? emit(ARM64Backend::gen_b(0)) : 0;
+        if (getCurrentIndex() % 2)
+            emit(ARM64Backend::gen_nop());      // 8 byte alignment
+        
+        for (const auto& [index, value] : pending_literals) {
+            auto it = placed_literals.find(value);
+            if (it == placed_literals.end() || (it->second < index && index - it->second >= literalRange)) {
+                size_t pos = emit((uint32_t)value);
+                emit((uint32_t)(value >> 32));
+                it = placed_literals.insert_or_assign(value, pos).first;
+            }
+            code[index] = ARM64Backend::gen_ldr_x_literal(code[index] & 0x1F, (int32_t)it->second - (int32_t)index);
+        }
+        pending_literals.clear();
+        
+        if (jumpOver)
+            code[branch] = ARM64Backend::gen_b((int32_t)(getCurrentIndex() - branch));
+    }
     
-    ~ARM64JITFrontend() {
-        if (executable_memory) {
-            munmap(executable_memory, executable_size);
+    /**
+     * d = a OP b, x3 and x4 are scratch for SIGNUM and MOD
+     */
+    void emit_alu(AluOp op, int d, int a, int b) {
+        switch (op) {
+            case AluOp::ADD:
+                emit(ARM64Backend::gen_add_x_reg(d, a, b));
+                break;
+                
+            case AluOp::SUB:
+                emit(ARM64Backend::gen_sub_x_reg(d, a, b));
+                break;
+                
+            case AluOp::MUL:
+                emit(ARM64Backend::gen_mul_x(d, a, b));
+                break;
+                
+            case AluOp::DIV:
+                emit(ARM64Backend::gen_sdiv_x(d, a, b));
+                break;
+                
+            case AluOp::MOD:
+                // dest = src1 - (src1 / src2) * src2
+                emit(ARM64Backend::gen_udiv_x(4, a, b));
+                emit(ARM64Backend::gen_msub_x(d, 4, b, a));
+                break;
+                
+            case AluOp::SIGNUM:
+                // Returns: -1 if src1 < 0, 0 if src1 == 0, 1 if src1 > 0
+                emit(ARM64Backend::gen_cmp_x(a, 31));
+                emit(ARM64Backend::gen_cset_x(3, ARM64Backend::ConditionCode::COND_GT));
+                emit(ARM64Backend::gen_cmp_x(a, 31));
+                emit(ARM64Backend::gen_cset_x(4, ARM64Backend::ConditionCode::COND_LT));
+                emit(ARM64Backend::gen_sub_x_reg(d, 3, 4));
+                break;
         }
     }
     
+public:
+    ARM64JITFrontend() : entry_index(0) {}
+    
     /**
      * Begin code generation
      * Sets up function prologue
@@ -91,9 +224,16 @@ public:
      *   x0 = memory pointer
      *   x1 = registers pointer
      *   x2 = entry_point (number of ARM64 instructions to skip)
+     *   x3 = host function table
      */
-    void begin() {
+    void begin(const ShadowStack& shadowStack = {}) {
         code.clear();
+        pending_literals.clear();
+        shadow = shadowStack;
+        placed_literals.clear();
+        src_regs = {};
+        dst_regs = {};
+        acc = 2;
         
         // Minimal prologue - only save FP and LR
         // We'll use x19 and x20 to preserve x0 and x1
@@ -107,9 +247,45 @@ public:
         emit(ARM64Backend::gen_sub_x_imm(31, 31, 16));     // sub sp, sp, #16
         emit(ARM64Backend::gen_stp_x(19, 20, 31, 0));      // stp x19, x20, [sp]
         
-        // Preserve x0 (memory) and x1 (registers)
+        // Adjust SP and save x21, x22
+        emit(ARM64Backend::gen_sub_x_imm(31, 31, 16));     // sub sp, sp, #16
+        emit(ARM64Backend::gen_stp_x(21, 22, 31, 0));      // stp x21, x22, [sp]
+        
+        // Adjust SP and save x23-x28 (allocated EVM registers)
+        emit(ARM64Backend::gen_sub_x_imm(31, 31, 48));     // sub sp, sp, #48
+        emit(ARM64Backend::gen_stp_x(23, 24, 31, 0));      // stp x23, x24, [sp]
+        emit(ARM64Backend::gen_stp_x(25, 26, 31, 16));     // stp x25, x26, [sp, #16]
+        emit(ARM64Backend::gen_stp_x(27, 28, 31, 32));     // stp x27, x28, [sp, #32]
+        
+        // Preserve x0 (memory), x1 (registers) and x3 (host table)
         emit(ARM64Backend::gen_mov_x(19, 0));              // mov x19, x0 (memory pointer)
         emit(ARM64Backend::gen_mov_x(20, 1));              // mov x20, x1 (registers pointer)
+        emit(ARM64Backend::gen_mov_x(21, 3));              // mov x21, x3 (host table)
+        
+        if (shadow.bytes) {
+            // stack fault handlers, host terminates the thread; placed here so
+            // that guest code reaches them backward at any code size
+            size_t skip = emit(ARM64Backend::gen_b(0));
+            for (uint64_t underflow = 0; underflow < 2; underflow++) {
+                (underflow ? underflow_handler : overflow_handler) = getCurrentIndex();
+                emit(ARM64Backend::gen_movz_x(0, (uint16_t)underflow, 0));
+                emit(ARM64Backend::gen_ldr_x_imm(9, 21, (int)(shadow.faultSlot / 8)));
+                emit(ARM64Backend::gen_blr(9));
+            }
+            code[skip] = ARM64Backend::gen_b((int32_t)(getCurrentIndex() - skip));
+            
+            // x22 = shadow stack of this thread, entry point survives the call in x22
+            assert((shadow.bytes & (shadow.bytes - 1)) == 0 && shadow.bytes >= 16);
+            emit(ARM64Backend::gen_mov_x(22, 2));
+            emit_load_imm64(0, shadow.bytes);
+            emit(ARM64Backend::gen_ldr_x_imm(9, 21, (int)(shadow.allocSlot / 8)));
+            emit(ARM64Backend::gen_blr(9));
+            emit(ARM64Backend::gen_mov_x(2, 22));
+            emit(ARM64Backend::gen_mov_x(22, 0));
+            emit(ARM64Backend::gen_adr(9, ((int32_t)underflow_handler - (int32_t)getCurrentIndex()) * 4));
+            emit(ARM64Backend::gen_str_x_imm(9, 22, 0));
+            emit(ARM64Backend::gen_add_x_imm(22, 22, 8));
+        }
         
         // Handle entry_point jump: skip x2 ARM64 instructions
         // x2 = number of instructions to skip (0 = no skip)
@@ -117,15 +293,17 @@ public:
         // 
         // Layout:
         //   [N+0] lsl x9, x2, #2     - Multiply skip count by 4
-        //   [N+1] adr x10, #12-entry()*4 (base address)
+        //   [N+1] adr x10, #-(N+1)*4 (function start)
         //   [N+2] add x9, x10, x9    - Compute target = base + (skip * 4)
         //   [N+3] br x9              - Jump to computed address
         //   [N+4] <-- Target when x2=0 (first generated instruction)
         
         emit(ARM64Backend::gen_lsl_x_imm(9, 2, 2));        // lsl x9, x2, #2  (x9 = x2 * 4)
-        emit(ARM64Backend::gen_adr(10, 12-(int)entry()*4));     // adr x10, #12-entry()*4 (get PC + base offset)
+        emit(ARM64Backend::gen_adr(10, -(int)getCurrentIndex()*4)); // adr x10, function start
         emit(ARM64Backend::gen_add_x_reg(9, 10, 9));       // add x9, x10, x9 (x9 = PC + offset)
         emit(ARM64Backend::gen_br(9));                     // br x9 (jump to computed address)
+        
+        entry_index = getCurrentIndex();
     }
     
     /**
@@ -134,6 +312,16 @@ public:
      */
     size_t end() {
         size_t pos = getCurrentIndex();
+        // Restore x23-x28 and adjust SP
+        emit(ARM64Backend::gen_ldp_x(23, 24, 31, 0));      // ldp x23, x24, [sp]
+        emit(ARM64Backend::gen_ldp_x(25, 26, 31, 16));     // ldp x25, x26, [sp, #16]
+        emit(ARM64Backend::gen_ldp_x(27, 28, 31, 32));     // ldp x27, x28, [sp, #32]
+        emit(ARM64Backend::gen_add_x_imm(31, 31, 48));     // add sp, sp, #48
+        
+        // Restore x21, x22 and adjust SP
+        emit(ARM64Backend::gen_ldp_x(21, 22, 31, 0));      // ldp x21, x22, [sp]
+        emit(ARM64Backend::gen_add_x_imm(31, 31, 16));     // add sp, sp, #16
+        
         // Restore x19, x20 and adjust SP
         emit(ARM64Backend::gen_ldp_x(19, 20, 31, 0));      // ldp x19, x20, [sp]
         emit(ARM64Backend::gen_add_x_imm(31, 31, 16));     // add sp, sp, #16
@@ -144,25 +332,62 @@ public:
         
         // Return
         emit(ARM64Backend::gen_ret());
+        
+        flushLiterals(false);
         return pos;
     }
     
     
     // ===== Register Operations =====
+    // EVM register lives either in registers[] (x20) or in host register
+    // given by register allocator, locations are set for each instruction
+    // separately for read and written operands
+
+    /**
+     * Host registers of EVM registers for following operations, 0 = memory
+     */
+    void setRegisterLocations(const std::array<int8_t, 16>& sources, const std::array<int8_t, 16>& destinations) {
+        src_regs = sources;
+        dst_regs = destinations;
+    }
+
+    /**
+     * Copy EVM register between host register and registers[] memory
+     * (program and thread entry, thread creation)
+     */
+    void fillRegister(uint8_t reg, int host_reg) {
+        emit(ARM64Backend::gen_ldr_x_imm(host_reg, 20, reg));
+    }
+
+    void spillRegister(uint8_t reg, int host_reg) {
+        emit(ARM64Backend::gen_str_x_imm(host_reg, 20, reg));
+    }
+
     void loadOperand(const Operand& op, int temp_reg = 2) {
         switch (op.kind)
         {
             case Operand::Kind::NONE:
                 break;
             case Operand::Kind::REG:
-                emit(ARM64Backend::gen_ldr_x_imm(temp_reg, 20, op.reg));
+                if (int host = src_regs[op.reg]) {
+                    if (host != temp_reg)
+                        emit(ARM64Backend::gen_mov_x(temp_reg, host));
+                } else {
+                    emit(ARM64Backend::gen_ldr_x_imm(temp_reg, 20, op.reg));
+                }
                 break;
             case Operand::Kind::MEM:
-                emit(ARM64Backend::gen_ldr_x_imm(temp_reg, 20, op.reg));
-                emit(ARM64Backend::gen_reg_mem(temp_reg, 19, temp_reg, true, op.sizeBytes*8));
+                if (int host = src_regs[op.reg]) {
+                    emit(ARM64Backend::gen_reg_mem(temp_reg, 19, host, true, op.sizeBytes*8));
+                } else {
+                    emit(ARM64Backend::gen_ldr_x_imm(temp_reg, 20, op.reg));
+                    emit(ARM64Backend::gen_reg_mem(temp_reg, 19, temp_reg, true, op.sizeBytes*8));
+                }
                 break;
             case EVM2::Arg::Kind::ADDR:
-                emit_load_imm64(temp_reg, op.addr);
+                // thread entry, patched to instruction index by patchBranchOrImm
+                emit(ARM64Backend::gen_movz_x(temp_reg, 0, 0));
+                emit(ARM64Backend::gen_movk_x(temp_reg, 0, 16));
                 break;
             default:
                 assert(0);
@@ -176,24 +401,59 @@ public:
             case Operand::Kind::NONE:
                 break;
             case Operand::Kind::REG:
-                emit(ARM64Backend::gen_str_x_imm(reg, 20, op.reg));
+                if (int host = dst_regs[op.reg]) {
+                    if (host != reg)
+                        emit(ARM64Backend::gen_mov_x(host, reg));
+                } else {
+                    emit(ARM64Backend::gen_str_x_imm(reg, 20, op.reg));
+                }
                 break;
             case Operand::Kind::MEM:
-                assert(reg != 3);
-                emit(ARM64Backend::gen_ldr_x_imm(3, 20, op.reg));
-                emit(ARM64Backend::gen_reg_mem(reg, 19, 3, false, op.sizeBytes*8));
+                if (int host = src_regs[op.reg]) {
+                    emit(ARM64Backend::gen_reg_mem(reg, 19, host, false, op.sizeBytes*8));
+                } else {
+                    assert(reg != 3);
+                    emit(ARM64Backend::gen_ldr_x_imm(3, 20, op.reg));
+                    emit(ARM64Backend::gen_reg_mem(reg, 19, 3, false, op.sizeBytes*8));
+                }
                 break;
             default:
                 assert(0);
         }
     }
     
+    /**
+     * Register holding operand value, operand is loaded into temp_reg only
+     * when it is not allocated in host register
+     */
+    int operandRegister(const Operand& op, int temp_reg) {
+        if (op.kind == Operand::Kind::REG && src_regs[op.reg])
+            return src_regs[op.reg];
+        loadOperand(op, temp_reg);
+        return temp_reg;
+    }
+    
+    /**
+     * Register to compute result into, allocated register of destination
+     * or temp_reg (then storeOperand writes it to memory)
+     */
+    int resultRegister(const Operand& dest, int temp_reg = 2) const {
+        if (dest.kind == Operand::Kind::REG && dst_regs[dest.reg])
+            return dst_regs[dest.reg];
+        return temp_reg;
+    }
+    
     /**
      * Move operands (used by MOV instruction)
      */
     void mov(Operand op1, Operand op2) {
-        loadOperand(op2);
-        storeOperand(op1);
+        if (op2.kind == Operand::Kind::REG && src_regs[op2.reg]) {
+            acc = src_regs[op2.reg];
+        } else {
+            acc = resultRegister(op1);
+            loadOperand(op2, acc);
+        }
+        storeOperand(op1, acc);
     }
     
     /**
@@ -202,99 +462,160 @@ public:
      */
     size_t loadImmediate(Operand dest, uint64_t value) {
         size_t pos = getCurrentIndex();
-        emit_load_imm64(2, value);
-        storeOperand(dest, 2);
+        acc = resultRegister(dest);
+        emit_load_imm64(acc, value);
+        storeOperand(dest, acc);
         return pos;
     }
     
-    /**
-     * ALU operation type
-     */
-    enum class AluOp {
-        ADD,      // dest = src1 + src2
-        SUB,      // dest = src1 - src2
-        MUL,      // dest = src1 * src2
-        DIV,      // dest = src1 / src2 (signed)
-        MOD,      // dest = src1 % src2 (unsigned)
-        SIGNUM    // dest = signum(src1), src2 ignored
-    };
-    
     /**
      * Unified ALU operation
      * Performs arithmetic operation: dest = src1 OP src2
      */
     void alu(AluOp op, Operand dest, Operand src1, Operand src2 = {}) {
-        loadOperand(src1, 2);
-        loadOperand(src2, 3);
+        int a = operandRegister(src1, 2);
+        int b = op == AluOp::SIGNUM ? 3 : operandRegister(src2, 3);
+        int d = resultRegister(dest);
+
+        emit_alu(op, d, a, b);
+        storeOperand(dest, d);
+        acc = d;
+    }
+
+    /**
+     * ALU operation with immediate second operand
+     * dest = src1 OP imm12, only ADD and SUB are supported
+     */
+    void aluImm(AluOp op, Operand dest, Operand src1, uint16_t imm12) {
+        assert(imm12 < 4096);
+        int a = operandRegister(src1, 2);
+        int d = resultRegister(dest);
 
         switch (op) {
             case AluOp::ADD:
-                emit(ARM64Backend::gen_add_x_reg(2, 2, 3));
+                emit(ARM64Backend::gen_add_x_imm(d, a, imm12));
                 break;
-                
             case AluOp::SUB:
-                emit(ARM64Backend::gen_sub_x_reg(2, 2, 3));
-                break;
-                
-            case AluOp::MUL:
-                emit(ARM64Backend::gen_mul_x(2, 2, 3));
-                break;
-                
-            case AluOp::DIV:
-                emit(ARM64Backend::gen_sdiv_x(2, 2, 3));
-                break;
-                
-            case AluOp::MOD:
-                // dest = src1 - (src1 / src2) * src2
-                emit(ARM64Backend::gen_udiv_x(4, 2, 3));
-                emit(ARM64Backend::gen_msub_x(2, 4, 3, 2));
-                break;
-                
-            case AluOp::SIGNUM:
-                // Returns: -1 if src1 < 0, 0 if src1 == 0, 1 if src1 > 0
-                emit(ARM64Backend::gen_cmp_x(2, 31));
-                emit(ARM64Backend::gen_cset_x(3, ARM64Backend::ConditionCode::COND_GT));
-                emit(ARM64Backend::gen_cmp_x(2, 31));
-                emit(ARM64Backend::gen_cset_x(4, ARM64Backend::ConditionCode::COND_LT));
-                emit(ARM64Backend::gen_sub_x_reg(2, 3, 4));
+                emit(ARM64Backend::gen_sub_x_imm(d, a, imm12));
                 break;
+            default:
+                assert(0);
         }
-        
-        storeOperand(dest, 2);
+
+        storeOperand(dest, d);
+        acc = d;
     }
-    
+
+    // ===== Accumulator Operations =====
+    // mov, alu and loadImmediate leave their result in accumulator (x2 or
+    // allocated register of destination), fused instruction sequences
+    // continue from there instead of reloading it
+
+    /**
+     * Truncate accumulator to memory operand size (zero extended)
+     */
+    void truncateAcc(int sizeBytes) {
+        if (sizeBytes < 8) {
+            emit(ARM64Backend::gen_ubfx_x(2, acc, 0, sizeBytes*8));
+            acc = 2;
+        }
+    }
+
+    /**
+     * Store accumulator into operand
+     */
+    void storeAcc(const Operand& dest) {
+        storeOperand(dest, acc);
+    }
+
+    /**
+     * dest = signum(accumulator), accumulator is first truncated to size of
+     * memory destination as if it was reloaded from there
+     */
+    void signumAcc(const Operand& dest) {
+        if (dest.kind == Operand::Kind::MEM)
+            truncateAcc(dest.sizeBytes);
+        int d = resultRegister(dest);
+        emit_alu(AluOp::SIGNUM, d, acc, 3);
+        storeOperand(dest, d);
+        acc = d;
+    }
+
+    /**
+     * Compare accumulator with operand and set condition flags
+     */
+    size_t compareAcc(const Operand& op) {
+        size_t pos = getCurrentIndex();
+        int b = operandRegister(op, 3);
+        emit(ARM64Backend::gen_cmp_x(acc, b));
+        return pos;
+    }
+
     /**
      * Compare two operands and set condition flags
      */
     size_t compare(const Operand& op1, const Operand& op2) {
         size_t pos = getCurrentIndex();
-        loadOperand(op1, 2);
-        loadOperand(op2, 3);
-        emit(ARM64Backend::gen_cmp_x(2, 3));
+        int a = operandRegister(op1, 2);
+        int b = operandRegister(op2, 3);
+        emit(ARM64Backend::gen_cmp_x(a, b));
         return pos;
     }
 
     /**
-     * Branch if equal
+     * Compare operand with immediate (-4095..4095) and set condition flags
+     */
+    size_t compareImm(const Operand& op, int64_t value) {
+        assert(value > -4096 && value < 4096);
+        size_t pos = getCurrentIndex();
+        int a = operandRegister(op, 2);
+        if (value >= 0)
+            emit(ARM64Backend::gen_cmp_x_imm(a, (uint16_t)value));
+        else
+            emit(ARM64Backend::gen_cmn_x_imm(a, (uint16_t)-value));
+        return pos;
+    }
+
+    /**
+     * Branch if equal, target 0 = patched later
      */
     size_t branchIfEqual(size_t target_index = 0) {
-        int32_t offset = (int32_t)target_index - (int32_t)code.size();
+        int32_t offset = target_index ? (int32_t)target_index - (int32_t)code.size() : 0;
         return emit(ARM64Backend::gen_bcond(ARM64Backend::ConditionCode::COND_EQ, offset));
     }
     
     /**
-     * Unconditional jump
+     * Branch if equal in full b reach, b.ne over b, returns the b
+     */
+    size_t branchIfEqualFar() {
+        emit(ARM64Backend::gen_bcond(ARM64Backend::ConditionCode::COND_NE, 2));
+        return emit(ARM64Backend::gen_b(0));
+    }
+    
+    /**
+     * Swap branch condition (b.eq <-> b.ne), used when the taken target
+     * becomes the fall-through of block layout
+     */
+    void invertBranch(size_t branch_index) {
+        if ((code[branch_index] & 0xFC000000) == 0x14000000)
+            branch_index--;     // far branch, condition of the b.ne over it
+        assert((code[branch_index] & 0xFF000010) == 0x54000000);
+        code[branch_index] ^= 1;
+    }
+    
+    /**
+     * Unconditional jump, target 0 = patched later
      */
     size_t jump(size_t target_index = 0) {
-        int32_t offset = (int32_t)target_index - (int32_t)code.size();
+        int32_t offset = target_index ? (int32_t)target_index - (int32_t)code.size() : 0;
         return emit(ARM64Backend::gen_b(offset));
     }
     
     /**
-     * Call subroutine (with link)
+     * Call subroutine (with link), target 0 = patched later
      */
     size_t call(size_t target_index = 0) {
-        int32_t offset = (int32_t)target_index - (int32_t)code.size();
+        int32_t offset = target_index ? (int32_t)target_index - (int32_t)code.size() : 0;
         return emit(ARM64Backend::gen_bl(offset));
     }
     
@@ -305,6 +626,15 @@ public:
         emit(ARM64Backend::gen_ret());
     }
 
+    /**
+     * Boundary of EVM instruction, pending literals are placed here (jumped
+     * over) before the oldest load goes out of reach
+     */
+    void instructionBoundary() {
+        if (!pending_literals.empty() && getCurrentIndex() - pending_literals.front().first >= literalRange)
+            flushLiterals(true);
+    }
+
     /**
      * No operation
      */
@@ -316,6 +646,21 @@ public:
      * Function prologue for CALL targets
      */
     void funcPrologue() {
+        if (shadow.bytes) {
+            uint32_t mask;
+            bool valid = ARM64Backend::encode_logical_imm(shadow.bytes - 1, mask);
+            assert(valid);
+            emit(ARM64Backend::gen_tst_x_imm(22, mask));                       // full when aligned
+            int32_t offset = (int32_t)overflow_handler - (int32_t)getCurrentIndex();
+            if (ARM64Backend::bcond_in_range(offset)) {
+                emit(ARM64Backend::gen_bcond(ARM64Backend::ConditionCode::COND_EQ, offset));
+            } else {
+                emit(ARM64Backend::gen_bcond(ARM64Backend::ConditionCode::COND_NE, 2));
+                emit(ARM64Backend::gen_b(offset - 1));
+            }
+            emit(ARM64Backend::gen_str_x_post(30, 22, 8));                      // str x30, [x22], #8
+            return;
+        }
         emit(ARM64Backend::gen_prologue1());
         emit(ARM64Backend::gen_prologue2());
     }
@@ -324,6 +669,10 @@ public:
      * Function epilogue for RET instruction
      */
     void funcEpilogue() {
+        if (shadow.bytes) {
+            emit(ARM64Backend::gen_ldr_x_pre(30, 22, -8));                      // ldr x30, [x22, #-8]!
+            return;
+        }
         emit(ARM64Backend::gen_epilogue());
     }
 
@@ -335,11 +684,12 @@ public:
         
         uint32_t inst = code[branch_index];
 
-        // MOVZ immediate (used for thread entry points)
-        if ((inst & 0xFF000000) == 0xD2000000) {
-            int32_t imm16 = target_index & 0xffff;
-            assert(imm16 == target_index);
-            code[branch_index] = (inst & ~(0xffff << 5)) | (imm16 << 5);
+        // MOVZ + MOVK immediate (used for thread entry points)
+        if ((inst & 0xFFE00000) == 0xD2800000) {
+            assert(branch_index + 1 < code.size() && (code[branch_index + 1] & 0xFFE00000) == 0xF2A00000);
+            assert(target_index <= 0xFFFFFFFF);
+            code[branch_index] = (inst & ~(0xffff << 5)) | ((target_index & 0xffff) << 5);
+            code[branch_index + 1] = (code[branch_index + 1] & ~(0xffff << 5)) | (((target_index >> 16) & 0xffff) << 5);
             return;
         }
 
@@ -347,38 +697,54 @@ public:
         
         // Conditional branch (b.cond)
         if ((inst & 0xFF000000) == 0x54000000) {
-            int32_t imm19 = offset & 0x7FFFF;
-            code[branch_index] = (inst & 0xFF00001F) | (imm19 << 5);
+            code[branch_index] = ARM64Backend::gen_bcond((ARM64Backend::ConditionCode)(inst & 0xF), offset);
         }
         // Unconditional branch (b)
         else if ((inst & 0xFC000000) == 0x14000000) {
-            int32_t imm26 = offset & 0x3FFFFFF;
-            code[branch_index] = (inst & 0xFC000000) | imm26;
+            code[branch_index] = ARM64Backend::gen_b(offset);
         }
         // Branch with link (bl)
         else if ((inst & 0xFC000000) == 0x94000000) {
-            int32_t imm26 = offset & 0x3FFFFFF;
-            code[branch_index] = (inst & 0xFC000000) | imm26;
+            code[branch_index] = ARM64Backend::gen_bl(offset);
         }
     }
     
     /**
      * Call a host function with operand arguments
+     * slot is byte offset of the function pointer in host table (x21)
      * Loads operands into x0-x3 and stores result from x0
      */
-    size_t hostCallWithOps(uint64_t func_ptr, const Operand& ret, const Operand& op1, 
+    size_t hostCallWithOps(size_t slot, const Operand& ret, const Operand& op1, 
                            const Operand& op2 = {}, const Operand& op3 = {}, const Operand& op4 = {}) {
+        assert(slot % 8 == 0 && slot / 8 < 4096);
         size_t pos = getCurrentIndex();
         loadOperand(op1, 0);
         loadOperand(op2, 1);
         loadOperand(op3, 2);
         loadOperand(op4, 3);
-        emit_load_imm64(9, func_ptr);
+        emit(ARM64Backend::gen_ldr_x_imm(9, 21, (int)(slot / 8)));   // ldr x9, [x21, #slot]
         emit(ARM64Backend::gen_blr(9));
         storeOperand(ret, 0);
         return pos;
     }
 
+    /**
+     * Increment 64-bit counter, counters array is pointer at byte offset
+     * slot of host table (x21), flags and EVM registers are preserved
+     */
+    void incrementCounter(size_t slot, size_t index) {
+        assert(slot % 8 == 0 && slot / 8 < 4096);
+        emit(ARM64Backend::gen_ldr_x_imm(16, 21, (int)(slot / 8)));    // ldr x16, [x21, #slot]
+        if (index >= 4096) {
+            emit_load_imm64(17, index * 8);
+            emit(ARM64Backend::gen_add_x_reg(16, 16, 17));
+            index = 0;
+        }
+        emit(ARM64Backend::gen_ldr_x_imm(17, 16, (int)index));
+        emit(ARM64Backend::gen_add_x_imm(17, 17, 1));
+        emit(ARM64Backend::gen_str_x_imm(17, 16, (int)index));
+    }
+
     // ===== Code Management =====
     
     /**
@@ -388,6 +754,13 @@ public:
         return code.size();
     }
     
+    /**
+     * Get generated instructions
+     */
+    std::span<const uint32_t> getCode() const {
+        return {code.data(), code.size()};
+    }
+    
     /**
      * Get code size in bytes
      */
@@ -395,43 +768,39 @@ public:
         return code.size() * sizeof(uint32_t);
     }
     
+    /**
+     * Code heap allocations (including growth) of current program
+     */
+    size_t getCodeAllocations() const {
+        return code.allocationCount();
+    }
+    
     /**
      * Finalize code and make it executable
-     * Returns a function pointer: void (*)(void*, uint64_t*, int)
+     * Code is already emitted in the code heap, it is only trimmed and
+     * switched from writing to execution
+     * Returns a function pointer: void (*)(void*, uint64_t*, int, const void*)
      */
     void* finalize() {
-        size_t code_size = code.size() * sizeof(uint32_t);
-        size_t page_size = sysconf(_SC_PAGESIZE);
-        executable_size = (code_size + page_size - 1) & ~(page_size - 1);
-        
-        executable_memory = mmap(nullptr, executable_size,
-                                PROT_READ | PROT_WRITE,
-                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_JIT, -1, 0);
-        
-        if (executable_memory == MAP_FAILED) {
-            return nullptr;
-        }
-        
-        memcpy(executable_memory, code.data(), code_size);
-        
-        if (mprotect(executable_memory, executable_size,
-                    PROT_READ | PROT_EXEC) != 0) {
-            munmap(executable_memory, executable_size);
-            executable_memory = nullptr;
-            return nullptr;
-        }
-        
-        sys_icache_invalidate(executable_memory, code_size);
-        
-        return executable_memory;
+        return code.finalize();
+    }
+    
+    /**
+     * Patch instruction of finalized code in place
+     * (lazy compilation, tiering)
+     */
+    void patchExecutable(size_t index, uint32_t instruction) {
+        void* executable_memory = code.finalize();
+        assert(executable_memory && index < code.size());
+        CodeHeap::instance().patch((uint32_t*)executable_memory + index, instruction);
     }
     
     /**
      * Index of first instruction after main prologue
      */
 
-    size_t entry()
+    size_t entry() const
     {
-        return 11;
+        return entry_index;
     }
 };
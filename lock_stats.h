@@ -0,0 +1,186 @@
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * Contention statistics of guest locks (LOCK/UNLOCK)
+ *
+ * CThread::lock first tries the mutex without blocking, failed attempt is
+ * a contended acquisition and the time until the mutex is taken is its
+ * wait. Hold time runs from acquisition to UNLOCK of the same lock ID.
+ * Per lock ID the report has:
+ *   - acquisitions, contended acquisitions
+ *   - total and max wait, total and max hold
+ *   - threads waiting the longest in total (top waiters)
+ * Written at exit as a table and as JSON. Lock still held at exit counts
+ * its hold until then and is marked as held.
+ */
+class LockStats {
+public:
+    enum {
+        topWaiters = 3
+    };
+
+    struct Waiter {
+        uint64_t count = 0;
+        uint64_t waitNs = 0;
+    };
+
+    struct Lock {
+        uint64_t acquisitions = 0;
+        uint64_t contended = 0;
+        uint64_t waitNs = 0;
+        uint64_t maxWaitNs = 0;
+        uint64_t holdNs = 0;
+        uint64_t maxHoldNs = 0;
+        std::map<uint64_t, Waiter> waiters;    // thread id -> contended acquisitions
+        std::chrono::steady_clock::time_point acquired;
+        bool held = false;
+        bool heldAtExit = false;
+    };
+
+    static inline LockStats* active = nullptr;
+
+private:
+    mutable std::mutex statsMutex;
+    std::map<uint64_t, Lock> locks;
+    bool stopped = false;
+
+    static double ms(uint64_t ns) {
+        return ns / 1e6;
+    }
+
+    static void release(Lock& lock, std::chrono::steady_clock::time_point now) {
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - lock.acquired).count();
+        lock.holdNs += ns;
+        lock.maxHoldNs = std::max(lock.maxHoldNs, ns);
+        lock.held = false;
+    }
+
+    std::vector<std::pair<uint64_t, Waiter>> top(const Lock& lock) const {
+        std::vector<std::pair<uint64_t, Waiter>> list(lock.waiters.begin(), lock.waiters.end());
+        std::stable_sort(list.begin(), list.end(), [](const auto& a, const auto& b) {
+            return a.second.waitNs > b.second.waitNs;
+        });
+        if (list.size() > topWaiters)
+            list.resize(topWaiters);
+        return list;
+    }
+
+    // most contended locks first
+    std::vector<std::pair<uint64_t, const Lock*>> sorted() const {
+        std::vector<std::pair<uint64_t, const Lock*>> list;
+        for (const auto& [id, lock] : locks)
+            list.push_back({id, &lock});
+        std::stable_sort(list.begin(), list.end(), [](const auto& a, const auto& b) {
+            return a.second->waitNs > b.second->waitNs;
+        });
+        return list;
+    }
+
+public:
+    /**
+     * Called by thread owning the lock, right after it got it
+     */
+    void acquired(uint64_t lockId, uint64_t threadId, bool contended, std::chrono::nanoseconds wait) {
+        uint64_t ns = contended ? (uint64_t)wait.count() : 0;
+        std::lock_guard<std::mutex> guard(statsMutex);
+        if (stopped)
+            return;
+        Lock& lock = locks[lockId];
+        lock.acquisitions++;
+        if (contended)
+        {
+            lock.contended++;
+            lock.waitNs += ns;
+            lock.maxWaitNs = std::max(lock.maxWaitNs, ns);
+            Waiter& waiter = lock.waiters[threadId];
+            waiter.count++;
+            waiter.waitNs += ns;
+        }
+        lock.acquired = std::chrono::steady_clock::now();
+        lock.held = true;
+    }
+
+    /**
+     * Called by thread owning the lock, right before it releases it
+     */
+    void released(uint64_t lockId) {
+        auto now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> guard(statsMutex);
+        auto it = locks.find(lockId);
+        if (it == locks.end() || !it->second.held)
+            return;
+        release(it->second, now);
+    }
+
+    /**
+     * End of collection before writing, holds still running end now
+     */
+    void stop() {
+        auto now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> guard(statsMutex);
+        stopped = true;
+        for (auto& [id, lock] : locks)
+        {
+            if (!lock.held)
+                continue;
+            release(lock, now);
+            lock.heldAtExit = true;
+        }
+    }
+
+    void writeTable(FILE* f) const {
+        std::lock_guard<std::mutex> guard(statsMutex);
+        fprintf(f, "# lock contention\n%10s %10s %10s %12s %12s %12s %12s  %s\n", "lock", "acquired", "contended",
+                "wait ms", "max wait ms", "hold ms", "max hold ms", "top waiters (thread:wait ms)");
+        for (const auto& [id, lock] : sorted())
+        {
+            std::string waiters;
+            for (const auto& [tid, waiter] : top(*lock))
+            {
+                char text[48];
+                snprintf(text, sizeof(text), "%s%" PRIu64 ":%.3f", waiters.empty() ? "" : " ", tid, ms(waiter.waitNs));
+                waiters += text;
+            }
+            if (lock->heldAtExit)
+                waiters += waiters.empty() ? "(held at exit)" : " (held at exit)";
+            fprintf(f, "%10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %12.3f %12.3f %12.3f %12.3f  %s\n", id,
+                    lock->acquisitions, lock->contended, ms(lock->waitNs), ms(lock->maxWaitNs), ms(lock->holdNs),
+                    ms(lock->maxHoldNs), waiters.c_str());
+        }
+    }
+
+    bool writeJson(const std::string& filename) const {
+        FILE* f = fopen(filename.c_str(), "w");
+        if (!f)
+            return false;
+        std::lock_guard<std::mutex> guard(statsMutex);
+        fprintf(f, "{\n  \"locks\": [");
+        bool first = true;
+        for (const auto& [id, lock] : sorted())
+        {
+            fprintf(f, "%s\n    {\"id\": %" PRIu64 ", \"acquisitions\": %" PRIu64 ", \"contended\": %" PRIu64
+                    ", \"wait_ns\": %" PRIu64 ", \"max_wait_ns\": %" PRIu64 ", \"hold_ns\": %" PRIu64
+                    ", \"max_hold_ns\": %" PRIu64 ", \"held_at_exit\": %s, \"top_waiters\": [", first ? "" : ",", id,
+                    lock->acquisitions, lock->contended, lock->waitNs, lock->maxWaitNs, lock->holdNs, lock->maxHoldNs,
+                    lock->heldAtExit ? "true" : "false");
+            bool firstWaiter = true;
+            for (const auto& [tid, waiter] : top(*lock))
+            {
+                fprintf(f, "%s{\"thread\": %" PRIu64 ", \"contended\": %" PRIu64 ", \"wait_ns\": %" PRIu64 "}",
+                        firstWaiter ? "" : ", ", tid, waiter.count, waiter.waitNs);
+                firstWaiter = false;
+            }
+            fprintf(f, "]}");
+            first = false;
+        }
+        fprintf(f, "%s]\n}\n", first ? "" : "\n  ");
+        return fclose(f) == 0;
+    }
+};
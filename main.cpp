@@ -10,36 +10,124 @@
 #include <unistd.h>
 #include <sys/wait.h>
 #include <sys/mman.h>
+#include <fcntl.h>
+#include <dirent.h>
 #include <pthread.h>
 #include <cstdio>
 #include <cinttypes>
+#include <functional>
+#include <map>
 
 #include "evm2.h"
 #include "jit_arm64_fe.h"
+#include "regalloc.h"
+#include "block_layout.h"
+#include "op_counts.h"
+#include "compile_stats.h"
 #include "compile.h"
+#include "aot_c.h"
+#include "elf_object.h"
+#include "perf_map.h"
+#include "sampler.h"
+#include "lock_stats.h"
+#include "trace_events.h"
+#include "virtual_clock.h"
+#include "scheduler.h"
+#include "hw_counters.h"
+#include "host_bench.h"
+#include "program_gen.h"
+#include "assembler.h"
+#include "program_cache.h"
+#include "batch.h"
+#include "vm_server.h"
 #include "thread.h"
 
+struct Options {
+    bool aotC = false;          // --aot-c: translate to C and build it with host compiler
+    std::string emitObject;     // --emit-object <file>: write precompiled ELF object and exit
+    bool loadObject = false;    // --load-object: program is precompiled ELF object
+    std::string profileGen;     // --profile-gen <file>: count executed blocks and write profile
+    std::string profileUse;     // --profile-use <file>: lay out blocks by profile
+    std::string countOps;       // --count-ops <file>: count executed instructions and opcodes
+    size_t shadowStack = 0;     // --shadow-stack <depth>: guest calls on VM managed stack
+    bool perfMap = false;       // --perf-map: write /tmp/perf-<pid>.map for JIT code
+    bool jitDump = false;       // --jitdump: write /tmp/jit-<pid>.dump for JIT code
+    std::string sample;         // --sample <file>: sampling profile of guest code
+    long sampleInterval = 1000; // --sample-interval <us>: CPU time between samples
+    std::string lockStats;      // --lock-stats <file>: lock contention as JSON, table on stderr
+    std::string trace;          // --trace <file>: timeline of threads, locks and host calls (Chrome trace JSON)
+    bool hwCounters = false;    // --hw-counters: hardware performance counters per guest thread on stderr
+    bool stats = false;         // --stats: compile phase timings and code size on stderr
+    std::string benchHostCalls; // --bench-host-calls <file>: host call microbenchmarks, no program is run
+    size_t benchThreads = 0;    // --bench-threads <n>: threads of the contended runs, 0 = hardware threads
+    std::string generate;       // --generate <file>: write random program and exit
+    std::string assemble;       // --assemble <file>: assemble EASM program into EVM2 file and exit
+    std::string batch;          // --batch <manifest>: run jobs of the manifest, report status and timing
+    size_t batchJobs = 0;       // --jobs <n>: jobs running at the same time, 0 = hardware threads
+    std::string serve;          // --serve <socket>: VM daemon on Unix domain socket
+    bool virtualTime = false;   // --virtual-time: fast-forward sleeps when all guest threads wait
+    bool deterministic = false; // --deterministic <seed>: guest threads take turns at host calls, seeded schedule
+    uint64_t scheduleSeed = 1;
+    std::string scheduleRecord; // --schedule-record <file>: log of scheduling decisions
+    std::string scheduleReplay; // --schedule-replay <file>: follow recorded log, implies --deterministic
+    uint64_t genSeed = 1;       // --gen-seed <n>: seed of the generated program
+    size_t genSize = 1000;      // --gen-size <n>: approximate instruction count of the generated program
+    std::string genMix;         // --gen-mix <weights>: statement mix, e.g. alu=8,memory=3,calls=1,branches=2,threads=1,io=1
+};
+
 class JitThread : public ThreadBase {
 public:
     uint64_t registers[16] = {0};
     uint8_t* sharedMemory = nullptr;
     JITFunction jitFunc = nullptr;
+    const JITInterface_t* iface = nullptr;
     size_t entry = 0;
+    uint64_t* shadowStack = nullptr;
+    size_t shadowStackSize = 0;
     jmp_buf halt_jmp_buf;
     
     JitThread() = default;
-    JitThread(uint8_t* mem, JITFunction func, size_t entryPoint) 
-        : sharedMemory(mem), jitFunc(func), entry(entryPoint) {}
+    JitThread(uint8_t* mem, JITFunction func, const JITInterface_t* host, size_t entryPoint) 
+        : sharedMemory(mem), jitFunc(func), iface(host), entry(entryPoint) {}
   
-    JitThread(std::shared_ptr<JitThread> jt, size_t entryPoint) : sharedMemory(jt->sharedMemory), jitFunc(jt->jitFunc), entry(entryPoint)
+    JitThread(std::shared_ptr<JitThread> jt, size_t entryPoint) : sharedMemory(jt->sharedMemory), jitFunc(jt->jitFunc), iface(jt->iface), entry(entryPoint)
     {
         memcpy(registers, jt->registers, sizeof(registers));
     }
     
+    ~JitThread()
+    {
+        if (shadowStack)
+            munmap(shadowStack, shadowStackSize);
+    }
+    
+    // return addresses of guest calls, aligned to its size (generated code
+    // detects full stack from low bits of stack pointer)
+    uint64_t* allocateShadowStack(size_t bytes)
+    {
+        if (!shadowStack)
+        {
+            size_t size = std::max(bytes, (size_t)sysconf(_SC_PAGESIZE));
+            uint8_t* mem = (uint8_t*)mmap(NULL, size * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+            assert(mem != MAP_FAILED);
+            uint8_t* aligned = (uint8_t*)(((uintptr_t)mem + size - 1) & ~(uintptr_t)(size - 1));
+            if (aligned != mem)
+                munmap(mem, aligned - mem);
+            munmap(aligned + size, mem + size * 2 - (aligned + size));
+            shadowStack = (uint64_t*)aligned;
+            shadowStackSize = size;
+            GuestSampler::setShadowStack(shadowStack, shadowStackSize);
+        }
+        assert(bytes <= shadowStackSize);
+        return shadowStack;
+    }
+    
     int run(uint64_t tid)
     {
+        GuestSampler::ThreadTimer sampleTimer;
+        HardwareCounters::ThreadCounters hwCounters(tid);
         if (setjmp(halt_jmp_buf) == 0) {
-            jitFunc(sharedMemory, registers, entry);
+            jitFunc(sharedMemory, registers, entry, iface);
             return 0;
         } else
         {
@@ -54,108 +142,164 @@ public:
     }
 };
 
-void RunTest(EVM2::Disassembler& disasm, uint8_t* memory32, std::string _payload)
-{
-    JITFunction func;
-    static std::mutex mutexIo;
-    static FILE* f;
-    static std::string payload;
-    f = nullptr;
-    payload = _payload;
+// Host side of the JIT interface, shared by all guest threads
+static std::mutex mutexIo;
+static FILE* payloadFile = nullptr;
+static std::string payload;
+static bool virtualTime = false;
+static bool deterministic = false;
+static uint64_t scheduleSeed = 1;
+static std::string scheduleRecord;
+static std::string scheduleReplay;
 
-    // Compile the JIT code
-    ARM64JITFrontend jit;
-    JITInterface_t iface = {
-        .print_value = [](uint64_t value) {
-            std::lock_guard<std::mutex> lock(mutexIo);
-            fprintf(stdout, "[Thread %lld] Value: %lld / 0x%llx\n", CThread::currentThreadId, value, value);
-        },
-        .read_value = []() -> uint64_t {
-            uint64_t value = 0;
-            scanf("%" SCNu64, &value);
-            return value;
-        },
-        .terminate = []() {
-            fprintf(stderr, "[Terminate] Called from thread %lld\n", CThread::currentThreadId);
-            CThread::getCurrent()->config->terminate();
-        },
-        .thread_create = [](uint64_t entry) -> uint64_t {
-            auto currentThread = CThread::getCurrent();
-            auto currentJitThread = std::dynamic_pointer_cast<JitThread>(currentThread->config);
-            auto threadConfig = std::make_shared<JitThread>(currentJitThread, entry);
-            auto thread = std::make_shared<CThread>(threadConfig);
-            return thread->run();
-        },
-        .thread_join = [](uint64_t tid) {
-            std::shared_ptr<CThread> thread = CThread::getById(tid);
-            if (thread)
-                thread->join();
-        },
-        .thread_sleep = [](uint64_t milliseconds) {
-            if (auto current = CThread::getCurrent(); current && current->shouldStop)
-            {
-                current->config->terminate();
-                return;
-            }
+JITInterface_t hostInterface = {
+    .print_value = [](uint64_t value) {
+        DeterministicScheduler::hostCall();
+        TraceEvents::Scope traceScope("console write", "io", CThread::currentThreadId);
+        std::lock_guard<std::mutex> lock(mutexIo);
+        fprintf(stdout, "[Thread %lld] Value: %lld / 0x%llx\n", CThread::currentThreadId, value, value);
+    },
+    .read_value = []() -> uint64_t {
+        DeterministicScheduler::hostCall();
+        TraceEvents::Scope traceScope("console read", "io", CThread::currentThreadId);
+        uint64_t value = 0;
+        scanf("%" SCNu64, &value);
+        return value;
+    },
+    .terminate = []() {
+        DeterministicScheduler::hostCall();
+        fprintf(stderr, "[Terminate] Called from thread %lld\n", CThread::currentThreadId);
+        CThread::getCurrent()->config->terminate();
+    },
+    .thread_create = [](uint64_t entry) -> uint64_t {
+        DeterministicScheduler::hostCall();
+        auto currentThread = CThread::getCurrent();
+        auto currentJitThread = std::dynamic_pointer_cast<JitThread>(currentThread->config);
+        auto threadConfig = std::make_shared<JitThread>(currentJitThread, entry);
+        auto thread = std::make_shared<CThread>(threadConfig);
+        return thread->run();
+    },
+    .thread_join = [](uint64_t tid) {
+        DeterministicScheduler::hostCall();
+        std::shared_ptr<CThread> thread = CThread::getById(tid);
+        if (thread)
+            thread->join();
+    },
+    .thread_sleep = [](uint64_t milliseconds) {
+        DeterministicScheduler::hostCall();
+        if (auto current = CThread::getCurrent(); current && current->shouldStop)
+        {
+            current->config->terminate();
+            return;
+        }
+        TraceEvents::Scope traceScope("sleep", "sync", CThread::currentThreadId, "ms", milliseconds);
+        if (DeterministicScheduler* scheduler = DeterministicScheduler::active)
+            scheduler->sleep(milliseconds);
+        else if (VirtualClock* clock = VirtualClock::active)
+            clock->sleep(milliseconds);
+        else
             std::this_thread::sleep_for(std::chrono::milliseconds(milliseconds));
-        },
-        .thread_lock = [](uint64_t lid) {
-            CThread::getCurrent()->lock(lid);
-        },
-        .thread_unlock = [](uint64_t lid) {
-            CThread::getCurrent()->unlock(lid);
-        },
-        .file_read = [](uint64_t ofs, uint64_t toRead, uint64_t addr) -> uint64_t {
-            std::lock_guard<std::mutex> lock(mutexIo);
-            auto currentThread = CThread::getCurrent();
-            auto currentJitThread = std::dynamic_pointer_cast<JitThread>(currentThread->config);
-            uint8_t* mem = currentJitThread->sharedMemory;
-            
-            if (!f)
-            {
-                assert(!payload.empty());
-                f = fopen(payload.c_str(), "rb");
-                assert(f);
-            }
+    },
+    .thread_lock = [](uint64_t lid) {
+        DeterministicScheduler::hostCall();
+        CThread::getCurrent()->lock(lid);
+    },
+    .thread_unlock = [](uint64_t lid) {
+        DeterministicScheduler::hostCall();
+        CThread::getCurrent()->unlock(lid);
+    },
+    .file_read = [](uint64_t ofs, uint64_t toRead, uint64_t addr) -> uint64_t {
+        DeterministicScheduler::hostCall();
+        TraceEvents::Scope traceScope("file read", "io", CThread::currentThreadId, "bytes", toRead);
+        std::lock_guard<std::mutex> lock(mutexIo);
+        auto currentThread = CThread::getCurrent();
+        auto currentJitThread = std::dynamic_pointer_cast<JitThread>(currentThread->config);
+        uint8_t* mem = currentJitThread->sharedMemory;
+        
+        if (!payloadFile)
+        {
+            assert(!payload.empty());
+            payloadFile = fopen(payload.c_str(), "rb");
+            assert(payloadFile);
+        }
 
-            fseek(f, (long)ofs, SEEK_SET);
-            return fread(mem + addr, 1, toRead, f);  // Fixed: read 'toRead' items of size 1
-        },
-        .file_write = [](uint64_t ofs, uint64_t toWrite, uint64_t addr) {
-            std::lock_guard<std::mutex> lock(mutexIo);
-            auto currentThread = CThread::getCurrent();
-            auto currentJitThread = std::dynamic_pointer_cast<JitThread>(currentThread->config);
-            uint8_t* mem = currentJitThread->sharedMemory;
+        fseek(payloadFile, (long)ofs, SEEK_SET);
+        return fread(mem + addr, 1, toRead, payloadFile);  // Fixed: read 'toRead' items of size 1
+    },
+    .file_write = [](uint64_t ofs, uint64_t toWrite, uint64_t addr) {
+        DeterministicScheduler::hostCall();
+        TraceEvents::Scope traceScope("file write", "io", CThread::currentThreadId, "bytes", toWrite);
+        std::lock_guard<std::mutex> lock(mutexIo);
+        auto currentThread = CThread::getCurrent();
+        auto currentJitThread = std::dynamic_pointer_cast<JitThread>(currentThread->config);
+        uint8_t* mem = currentJitThread->sharedMemory;
 
-            if (!f)
-            {
-                assert(!payload.empty());
-                f = fopen(payload.c_str(), "wb");
-                assert(f);
-            }
-            
-            fseek(f, (long)ofs, SEEK_SET);
-            fwrite(mem+addr, toWrite, 1, f);
+        if (!payloadFile)
+        {
+            assert(!payload.empty());
+            payloadFile = fopen(payload.c_str(), "wb");
+            assert(payloadFile);
         }
-    };
-    
-    func = Compile(disasm, jit, iface);
+        
+        fseek(payloadFile, (long)ofs, SEEK_SET);
+        fwrite(mem+addr, toWrite, 1, payloadFile);
+    },
+    .shadow_stack = [](uint64_t bytes) -> uint64_t* {
+        auto currentJitThread = std::dynamic_pointer_cast<JitThread>(CThread::getCurrent()->config);
+        return currentJitThread->allocateShadowStack(bytes);
+    },
+    .shadow_stack_fault = [](uint64_t underflow) {
+        fprintf(stderr, "[Thread %" PRIu64 "] Guest stack %s\n", CThread::currentThreadId, underflow ? "underflow" : "overflow");
+        CThread::getCurrent()->config->terminate();
+    },
+    .block_counters = nullptr
+};
+
+void RunTest(JITFunction func, size_t entry, uint8_t* memory32, std::string _payload)
+{
+    payloadFile = nullptr;
+    payload = _payload;
+    // never freed, threads over the timeout can outlive RunTest
+    if (virtualTime)
+        VirtualClock::active = new VirtualClock();
+    if (deterministic)
+        DeterministicScheduler::active = new DeterministicScheduler(scheduleSeed, scheduleRecord, scheduleReplay);
     
     // Create and configure the main thread
-    auto mainThreadConfig = std::make_shared<JitThread>(memory32, func, jit.entry());
+    auto mainThreadConfig = std::make_shared<JitThread>(memory32, func, &hostInterface, entry);
     auto mainThread = std::make_shared<CThread>(mainThreadConfig);
     mainThread->run();
     mainThread->join();  // Wait for thread to complete
+    if (DeterministicScheduler::active)
+        DeterministicScheduler::active->finish();
     
-    if (f)
-        fclose(f);
+    if (payloadFile)
+        fclose(payloadFile);
 }
 
-void RunGuard(EVM2::Disassembler& disasm, std::string payload, bool useFork = true)
+// message of the parent for exit code of the VM process, nullptr when unexpected
+const char* GuardExitMessage(int code)
+{
+    switch (code)
+    {
+        case 0: return "JIT exited normally.";
+        case 1: return "JIT was terminated with hard timeout.";
+        case 3: return "Child caught memory exception";
+        default: return nullptr;
+    }
+}
+
+// forks the VM process running the program in guarded memory, returns its pid,
+// without fork the calling process becomes the VM and exits
+pid_t StartGuard(uint32_t dataSize, const std::vector<uint8_t>& data, JITFunction func, size_t entry, std::string payload,
+                 std::function<void()> onStart = nullptr, std::function<void()> onExit = nullptr, bool useFork = true)
 {
     pid_t pid = useFork ? fork() : 0;
     
     if (pid == 0) {
+        if (onStart)
+            onStart();
+        
         uint8_t* memory32 = nullptr;
         
         // Signal guards
@@ -171,58 +315,504 @@ void RunGuard(EVM2::Disassembler& disasm, std::string payload, bool useFork = tr
         sigaction(SIGBUS,  &sa, NULL);
         // Memory guards
         size_t page_size = sysconf(_SC_PAGESIZE);
-        size_t memory_size = (disasm.getHeader().dataSize + page_size - 1) & ~(page_size - 1);
+        size_t memory_size = (dataSize + page_size - 1) & ~(page_size - 1);
         
         memory32 = (uint8_t*)mmap(NULL, 1ULL<<32, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
         assert (mprotect(memory32, memory_size, PROT_READ | PROT_WRITE) >= 0);
         
-        if (auto data = disasm.getData(); !data.empty())
+        if (!data.empty())
             memcpy(memory32, &data[0], data.size());
         
-        RunTest(disasm, memory32, payload);
+        RunTest(func, entry, memory32, payload);
+        if (onExit)
+            onExit();
         
         munmap(memory32, 1ULL<<32);
         fflush(stdout);
         fflush(stderr);
         _exit(0);
     }
+    return pid;
+}
 
-    if (!useFork)
-        return;
+void RunGuard(uint32_t dataSize, const std::vector<uint8_t>& data, JITFunction func, size_t entry, std::string payload,
+              std::function<void()> onStart = nullptr, std::function<void()> onExit = nullptr, bool useFork = true)
+{
+    pid_t pid = StartGuard(dataSize, data, func, entry, payload, onStart, onExit, useFork);
     
     int status = 0;
     waitpid(pid, &status, 0);
 
     // Note: doesnt work inside xcode
     assert(WIFEXITED(status));
-    int code = WEXITSTATUS(status);
-    if (code == 0)
-        fprintf(stderr, "JIT exited normally.\n");
-    else if (code == 3)
-        fprintf(stderr, "Child caught memory exception\n");
-    else if (code == 1)
-        fprintf(stderr, "JIT was terminated with hard timeout.\n");
-    else
-        assert(0);
+    const char* message = GuardExitMessage(WEXITSTATUS(status));
+    assert(message);
+    fprintf(stderr, "%s\n", message);
+}
+
+// every case runs in its own forked VM, the child appends its result row,
+// console reads come from a prepared file and writes go to /dev/null
+bool RunHostCallBenchmarks(const std::string& filename, size_t threads)
+{
+    FILE* f = fopen(filename.c_str(), "w");
+    if (!f)
+        return false;
+    HostCallBenchmark::writeHeader(f);
+    fclose(f);
+    
+    char payloadName[] = "/tmp/evm2_bench_XXXXXX";
+    int fd = mkstemp(payloadName);
+    if (fd < 0)
+        return false;
+    std::vector<uint8_t> zeros(HostCallBenchmark::dataSize, 0);
+    bool written = write(fd, zeros.data(), zeros.size()) == (ssize_t)zeros.size();
+    close(fd);
+    
+    char inputName[] = "/tmp/evm2_bench_in_XXXXXX";
+    fd = mkstemp(inputName);
+    if (fd < 0)
+    {
+        unlink(payloadName);
+        return false;
+    }
+    std::string numbers;
+    for (size_t n = 0; n < threads * HostCallBenchmark::iterations(HostCallBenchmark::consoleRead); n++)
+        numbers += "1\n";
+    written = written && write(fd, numbers.data(), numbers.size()) == (ssize_t)numbers.size();
+    close(fd);
+    
+    for (int c = 0; c < HostCallBenchmark::caseCount && written; c++)
+    {
+        for (size_t n : {(size_t)1, threads})
+        {
+            auto benchCase = (HostCallBenchmark::Case)c;
+            HostCallBenchmark::configure(benchCase, n, HostCallBenchmark::iterations(benchCase));
+            RunGuard(HostCallBenchmark::dataSize, {}, HostCallBenchmark::guest, HostCallBenchmark::mainEntry, payloadName,
+                     [&]() {
+                int in = open(inputName, O_RDONLY);
+                int out = open("/dev/null", O_WRONLY);
+                assert(in >= 0 && out >= 0);
+                dup2(in, 0);
+                dup2(out, 1);
+                close(in);
+                close(out);
+            }, [&]() {
+                FILE* out = fopen(filename.c_str(), "a");
+                if (!out)
+                    return;
+                HostCallBenchmark::writeResult(out);
+                fclose(out);
+            });
+        }
+    }
+    unlink(payloadName);
+    unlink(inputName);
+    return written;
+}
+
+// every job runs in its own forked VM with console redirected to a file, at most
+// `parallel` at a time, programs are decoded and compiled once per content hash
+// before the first job starts
+bool RunBatch(const std::string& manifest, size_t parallel, const Options& options)
+{
+    BatchJobs batch;
+    if (!batch.read(manifest))
+    {
+        fprintf(stderr, "Cannot read manifest %s\n", manifest.c_str());
+        return false;
+    }
+    
+    ProgramCache programs(options.aotC, options.shadowStack);
+    for (BatchJobs::Job& job : batch.jobs)
+    {
+        std::string error;
+        if (!programs.load(job.program, job.hash, error))
+            fprintf(stderr, "%s\n", error.c_str());
+    }
+    
+    char dir[] = "/tmp/evm2_batch_XXXXXX";
+    if (!mkdtemp(dir))
+        return false;
+    
+    std::map<pid_t, std::pair<size_t, std::chrono::steady_clock::time_point>> running;
+    for (size_t next = 0; next < batch.jobs.size() || !running.empty();)
+    {
+        if (next < batch.jobs.size() && running.size() < parallel)
+        {
+            size_t index = next++;
+            BatchJobs::Job& job = batch.jobs[index];
+            const ProgramCache::Program* program = programs.find(job.hash);
+            if (!program || (!job.input.empty() && access(job.input.c_str(), R_OK) != 0))
+            {
+                job.status = BatchJobs::Status::error;
+                batch.writeJob(stdout, job);
+                continue;
+            }
+            
+            job.output = std::string(dir) + "/job" + std::to_string(job.line) + ".out";
+            fflush(stdout);
+            fflush(stderr);
+            auto started = std::chrono::steady_clock::now();
+            const auto& header = program->disasm->getHeader();
+            pid_t pid = StartGuard(header.dataSize, program->disasm->getData(), program->func, program->entry, job.payload, [&job]() {
+                int out = open(job.output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                int in = open(job.input.empty() ? "/dev/null" : job.input.c_str(), O_RDONLY);
+                if (out < 0 || in < 0)
+                    _exit(4);
+                dup2(in, 0);
+                dup2(out, 1);
+                dup2(out, 2);
+                close(in);
+                close(out);
+            });
+            assert(pid > 0);
+            running[pid] = {index, started};
+            continue;
+        }
+        
+        int status = 0;
+        pid_t pid = waitpid(-1, &status, 0);
+        assert(pid > 0 && running.count(pid));
+        auto [index, started] = running[pid];
+        running.erase(pid);
+        BatchJobs::Job& job = batch.jobs[index];
+        job.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+        
+        // exit message goes after the console output, as RunGuard prints it
+        int code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+        const char* message = WIFEXITED(status) ? GuardExitMessage(code) : nullptr;
+        if (FILE* out = message ? fopen(job.output.c_str(), "a") : nullptr)
+        {
+            fprintf(out, "%s\n", message);
+            fclose(out);
+        }
+        job.status = BatchJobs::finish(job, message, code);
+        if (job.status == BatchJobs::Status::passed)
+        {
+            unlink(job.output.c_str());
+            job.output.clear();
+        }
+        batch.writeJob(stdout, job);
+    }
+    rmdir(dir);     // outputs of failed jobs stay
+    
+    return batch.writeSummary(stdout, programs.size(), programs.totalCompileNs() / 1e6);
+}
+
+// VM daemon, every run forks from the server holding compiled programs
+bool RunServer(const std::string& socketPath, const Options& options)
+{
+    ProgramCache programs(options.aotC, options.shadowStack);
+    VMServer server(programs, [](const ProgramCache::Program& program, const std::string& payload, int input, int output) {
+        const auto& header = program.disasm->getHeader();
+        return StartGuard(header.dataSize, program.disasm->getData(), program.func, program.entry, payload, [input, output]() {
+            dup2(input, 0);
+            dup2(output, 1);
+            dup2(output, 2);
+            // descriptors of other connections would keep their sockets and pipes open
+            std::vector<int> inherited;
+            if (DIR* dir = opendir("/dev/fd"))
+            {
+                while (dirent* entry = readdir(dir))
+                {
+                    int fd = atoi(entry->d_name);
+                    if (fd > 2 && fd != dirfd(dir))
+                        inherited.push_back(fd);
+                }
+                closedir(dir);
+            }
+            for (int fd : inherited)
+                close(fd);
+        });
+    }, GuardExitMessage);
+    
+    if (!server.listen(socketPath))
+    {
+        fprintf(stderr, "Cannot listen on %s\n", socketPath.c_str());
+        return false;
+    }
+    fprintf(stderr, "Listening on %s\n", socketPath.c_str());
+    server.acceptLoop();
+    return true;
 }
 
 int main(int argc, const char** argv)
 {
     std::string program;
     std::string payload;
+    Options options;
+    std::vector<std::string> args;
     
-    if (argc == 2)
+    for (int i = 1; i < argc; i++)
     {
-        program = argv[1];
-    } else if (argc == 3) {
-        program = argv[1];
-        payload = argv[2];
+        std::string arg = argv[i];
+        if (arg == "--aot-c")
+            options.aotC = true;
+        else if (arg == "--emit-object" && i + 1 < argc)
+            options.emitObject = argv[++i];
+        else if (arg == "--load-object")
+            options.loadObject = true;
+        else if (arg == "--profile-gen" && i + 1 < argc)
+            options.profileGen = argv[++i];
+        else if (arg == "--profile-use" && i + 1 < argc)
+            options.profileUse = argv[++i];
+        else if (arg == "--count-ops" && i + 1 < argc)
+            options.countOps = argv[++i];
+        else if (arg == "--shadow-stack" && i + 1 < argc)
+            options.shadowStack = std::stoull(argv[++i]);
+        else if (arg == "--perf-map")
+            options.perfMap = true;
+        else if (arg == "--jitdump")
+            options.jitDump = true;
+        else if (arg == "--sample" && i + 1 < argc)
+            options.sample = argv[++i];
+        else if (arg == "--sample-interval" && i + 1 < argc)
+            options.sampleInterval = std::stol(argv[++i]);
+        else if (arg == "--lock-stats" && i + 1 < argc)
+            options.lockStats = argv[++i];
+        else if (arg == "--trace" && i + 1 < argc)
+            options.trace = argv[++i];
+        else if (arg == "--hw-counters")
+            options.hwCounters = true;
+        else if (arg == "--stats")
+            options.stats = true;
+        else if (arg == "--bench-host-calls" && i + 1 < argc)
+            options.benchHostCalls = argv[++i];
+        else if (arg == "--bench-threads" && i + 1 < argc)
+            options.benchThreads = std::stoull(argv[++i]);
+        else if (arg == "--generate" && i + 1 < argc)
+            options.generate = argv[++i];
+        else if (arg == "--gen-seed" && i + 1 < argc)
+            options.genSeed = std::stoull(argv[++i]);
+        else if (arg == "--gen-size" && i + 1 < argc)
+            options.genSize = std::stoull(argv[++i]);
+        else if (arg == "--gen-mix" && i + 1 < argc)
+            options.genMix = argv[++i];
+        else if (arg == "--assemble" && i + 1 < argc)
+            options.assemble = argv[++i];
+        else if (arg == "--batch" && i + 1 < argc)
+            options.batch = argv[++i];
+        else if (arg == "--jobs" && i + 1 < argc)
+            options.batchJobs = std::stoull(argv[++i]);
+        else if (arg == "--serve" && i + 1 < argc)
+            options.serve = argv[++i];
+        else if (arg == "--virtual-time")
+            options.virtualTime = true;
+        else if (arg == "--deterministic" && i + 1 < argc)
+        {
+            options.deterministic = true;
+            options.scheduleSeed = std::stoull(argv[++i]);
+        }
+        else if (arg == "--schedule-record" && i + 1 < argc)
+            options.scheduleRecord = argv[++i];
+        else if (arg == "--schedule-replay" && i + 1 < argc)
+        {
+            options.deterministic = true;
+            options.scheduleReplay = argv[++i];
+        }
+        else
+        {
+            assert(arg.substr(0, 2) != "--");
+            args.push_back(arg);
+        }
+    }
+    
+    // scheduler time replaces virtual time
+    assert(!options.virtualTime || !options.deterministic);
+    assert(options.scheduleRecord.empty() || options.deterministic);
+    virtualTime = options.virtualTime;
+    deterministic = options.deterministic;
+    scheduleSeed = options.scheduleSeed;
+    scheduleRecord = options.scheduleRecord;
+    scheduleReplay = options.scheduleReplay;
+    
+    if (!options.benchHostCalls.empty())
+    {
+        size_t threads = options.benchThreads ? options.benchThreads : std::max(2u, std::thread::hardware_concurrency());
+        bool valid = RunHostCallBenchmarks(options.benchHostCalls, threads);
+        assert(valid);
+        return 0;
+    }
+    
+    if (!options.generate.empty())
+    {
+        ProgramGenerator::Mix mix;
+        bool valid = options.genMix.empty() || mix.parse(options.genMix);
+        assert(valid);
+        valid = ProgramGenerator(options.genSeed, mix).write(options.generate, options.genSize);
+        assert(valid);
+        return 0;
+    }
+    
+    if (!options.assemble.empty())
+    {
+        assert(args.size() == 1);
+        return Assembler().build(args[0], options.assemble);
+    }
+    
+    if (!options.batch.empty())
+    {
+        size_t parallel = options.batchJobs ? options.batchJobs : std::max(1u, std::thread::hardware_concurrency());
+        return RunBatch(options.batch, parallel, options) ? 0 : 1;
+    }
+    
+    if (!options.serve.empty())
+        return RunServer(options.serve, options) ? 0 : 1;
+    
+    if (args.size() == 1)
+    {
+        program = args[0];
+    } else if (args.size() == 2) {
+        program = args[0];
+        payload = args[1];
     } else
         assert(0);
     
+    ARM64JITFrontend jit;
+    AOTCompilerC aot;
+    ELFObject object;
+    
+    if (options.loadObject)
+    {
+        bool valid = object.read(program);
+        assert(valid);
+        JITFunction func = object.link();
+        assert(func);
+        RunGuard(object.getDataSize(), object.getData(), func, object.entry(), payload);
+        return 0;
+    }
+    
+    CompileStats stats;
+    CompileStats::Timer decodeTimer;
     EVM2::Disassembler disasm(program);
+    decodeTimer.lap(stats.decodeNs);
+    const auto& header = disasm.getHeader();
+    
+    CompileOptions compileOptions;
+    compileOptions.shadowStackDepth = options.shadowStack;
+    compileOptions.stats = &stats;
+    BlockProfile profile;
+    if (!options.profileUse.empty())
+    {
+        bool valid = profile.read(options.profileUse);
+        assert(valid);
+        compileOptions.profile = &profile;
+    }
+    
+    // counters are shared with the forked child running the program
+    uint64_t* blockCounters = nullptr;
+    size_t countersSize = BlockProfile::counterCount(disasm.getInstructions()) * sizeof(uint64_t);
+    if (!options.profileGen.empty() || !options.countOps.empty())
+    {
+        blockCounters = (uint64_t*)mmap(nullptr, countersSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+        assert(blockCounters != MAP_FAILED);
+        hostInterface.block_counters = blockCounters;
+        compileOptions.instrumentBlocks = true;
+    }
+    
+    if (!options.emitObject.empty())
+    {
+        JITMapping mapping;
+        Compile(disasm, jit, &mapping, compileOptions);
+        if (options.stats)
+            stats.write(stderr);
+        std::vector<uint8_t> initialData(disasm.getData().begin(), disasm.getData().begin() + header.initialDataSize);
+        bool written = ELFObject::write(options.emitObject, jit, mapping, header.dataSize, initialData);
+        assert(written);
+        return 0;
+    }
+    
+    JITMapping mapping;
+    JITFunction func = options.aotC ? aot.compile(disasm, compileOptions) : Compile(disasm, jit, &mapping, compileOptions);
+    assert(func);
+    size_t entry = options.aotC ? aot.entry() : jit.entry();
+    if (options.stats)
+        stats.write(stderr);
+    
+    // profilers run in the forked child, perf looks symbols up by pid of the process running the code
+    std::unique_ptr<GuestSampler> sampler;
+    std::unique_ptr<LockStats> lockStats;
+    std::unique_ptr<TraceEvents> trace;
+    std::unique_ptr<HardwareCounters> hwCounters;
+    auto startProfiling = [&]() {
+        if (!options.lockStats.empty())
+        {
+            lockStats = std::make_unique<LockStats>();
+            LockStats::active = lockStats.get();
+        }
+        if (!options.trace.empty())
+        {
+            trace = std::make_unique<TraceEvents>();
+            TraceEvents::active = trace.get();
+        }
+        if (options.hwCounters)
+        {
+            hwCounters = std::make_unique<HardwareCounters>();
+            HardwareCounters::active = hwCounters.get();
+        }
+        if (options.aotC)
+            return;
+        if (options.perfMap || options.jitDump)
+        {
+            PerfMap perfMap((const void*)func, jit.getCodeSize(), jit.entry(), disasm.getInstructions(), mapping);
+            if (options.perfMap)
+                perfMap.writeMap(getpid());
+            if (options.jitDump)
+                perfMap.writeJitDump(getpid());
+        }
+        if (!options.sample.empty())
+        {
+            sampler = std::make_unique<GuestSampler>((const void*)func, jit.getCodeSize(), jit.entry(), options.sampleInterval);
+            sampler->start();
+        }
+    };
+    auto stopProfiling = [&]() {
+        // guest threads not joined by the program still record
+        if (lockStats || trace || hwCounters || sampler)
+        {
+            if (size_t running = CThread::waitFinished())
+                fprintf(stderr, "[GLOBAL] %zu guest threads still running, profiles miss their end\n", running);
+        }
+        if (lockStats)
+        {
+            lockStats->stop();
+            LockStats::active = nullptr;
+            lockStats->writeTable(stderr);
+            lockStats->writeJson(options.lockStats);
+        }
+        if (trace)
+        {
+            TraceEvents::active = nullptr;
+            trace->write(options.trace);
+        }
+        if (hwCounters)
+        {
+            HardwareCounters::active = nullptr;
+            hwCounters->write(stderr);
+        }
+        if (!sampler)
+            return;
+        sampler->stop();
+        sampler->write(options.sample, disasm.getInstructions(), mapping);
+    };
         
-    RunGuard(disasm, payload);
+    CompileStats::Timer runTimer;
+    uint64_t executeNs = 0;
+    RunGuard(header.dataSize, disasm.getData(), func, entry, payload, startProfiling, stopProfiling);
+    runTimer.lap(executeNs);
+    if (options.stats)
+        fprintf(stderr, "# run stats\n  %-12s %10.3f ms\n", "execute", executeNs / 1e6);
+    
+    if (blockCounters)
+    {
+        BlockProfile collected;
+        collected.collect(disasm.getInstructions(), blockCounters);
+        bool written = options.profileGen.empty() || collected.write(options.profileGen);
+        written = written && (options.countOps.empty() ||
+                              InstructionCounts(disasm.getInstructions(), collected).write(options.countOps));
+        assert(written);
+        munmap(blockCounters, countersSize);
+    }
     
     return 0;
 }
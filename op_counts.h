@@ -0,0 +1,85 @@
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+/**
+ * Execution counts of EVM instructions and opcodes
+ *
+ * Derived from block counters of instrumented code (see BlockProfile),
+ * every instruction of a block runs as many times as the block is entered,
+ * so the generated code pays one counter increment per block and not per
+ * instruction. Blocks end with every control transfer including HLT,
+ * only thread terminated in the middle of a block (SLEEP after timeout)
+ * counts the rest of the block too.
+ */
+class InstructionCounts {
+    const std::vector<EVM2::Instruction>& instructions;
+    std::vector<uint64_t> counts;
+
+public:
+    InstructionCounts(const std::vector<EVM2::Instruction>& program, const BlockProfile& profile)
+        : instructions(program), counts(program.size(), 0) {
+        BlockLayout layout(instructions, nullptr);
+        for (size_t b = 0; b < layout.blockCount(); b++)
+        {
+            const BlockLayout::Block& block = layout.block(b);
+            uint64_t entries = profile.blockCount(instructions[block.first].bitOffset);
+            for (size_t k = block.first; k <= block.last; k++)
+                counts[k] = entries;
+        }
+    }
+
+    uint64_t count(size_t instruction) const {
+        return counts[instruction];
+    }
+
+    std::map<EVM2::Op, uint64_t> opcodeHistogram() const {
+        std::map<EVM2::Op, uint64_t> histogram;
+        for (size_t k = 0; k < instructions.size(); k++)
+            histogram[instructions[k].opcode] += counts[k];
+        return histogram;
+    }
+
+    /**
+     * Write opcode histogram and per-instruction counts, most frequent first
+     */
+    bool write(const std::string& filename) const {
+        FILE* f = fopen(filename.c_str(), "w");
+        if (!f)
+            return false;
+
+        uint64_t total = 0;
+        for (uint64_t c : counts)
+            total += c;
+        fprintf(f, "# executed instructions: %" PRIu64 "\n", total);
+
+        auto histogram = opcodeHistogram();
+        std::vector<std::pair<EVM2::Op, uint64_t>> opcodes(histogram.begin(), histogram.end());
+        std::stable_sort(opcodes.begin(), opcodes.end(), [](const auto& a, const auto& b) {
+            return a.second > b.second;
+        });
+        fprintf(f, "\n# opcodes\n%14s %7s  %s\n", "count", "%", "opcode");
+        for (const auto& [op, c] : opcodes)
+            fprintf(f, "%14" PRIu64 " %7.2f  %s\n", c, total ? 100.0 * c / total : 0.0, EVM2::opToString(op).c_str());
+
+        std::vector<size_t> order(instructions.size());
+        for (size_t k = 0; k < order.size(); k++)
+            order[k] = k;
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return counts[a] > counts[b];
+        });
+        fprintf(f, "\n# instructions\n%14s %10s  %s\n", "count", "bit offset", "instruction");
+        for (size_t k : order)
+        {
+            const EVM2::Instruction& i = instructions[k];
+            std::string text = EVM2::opToString(i.opcode);
+            for (size_t a = 0; a < i.args.size(); a++)
+                text += (a ? ", " : " ") + i.args[a].toString();
+            fprintf(f, "%14" PRIu64 " %10u  %s\n", counts[k], (unsigned)i.bitOffset, text.c_str());
+        }
+        return fclose(f) == 0;
+    }
+};
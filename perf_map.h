@@ -0,0 +1,175 @@
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <set>
+#include <string>
+#include <vector>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+/**
+ * Symbols of JIT code for Linux perf
+ *
+ * Generated code is split into one symbol per basic block, named after
+ * EVM bit offset of the block leader and its role:
+ *   - evm_main, evm_func_<offset> (CALL target), evm_thread_<offset>
+ *     (CREATETHREAD target), evm_block_<offset>
+ *   - evm_prologue for the entry dispatch, code behind the last block
+ *     (epilogue, thread entry stubs) belongs to the last block
+ * The EVM2 binary carries no source labels, so the bit offsets are the
+ * names, labels of res/ EASM sources can be matched by the disassembler
+ * listing.
+ *
+ * Two formats:
+ *   - /tmp/perf-<pid>.map, text file read by perf report
+ *   - /tmp/jit-<pid>.dump (jitdump), includes code bytes so perf can
+ *     annotate it, used with `perf record -k mono` and `perf inject --jit`
+ * Both must be written by the process running the code (after fork).
+ */
+class PerfMap {
+public:
+    struct Symbol {
+        size_t start;       // bytes from code start
+        size_t size;
+        std::string name;
+    };
+
+private:
+    const uint8_t* code;
+    size_t codeSize;
+    std::vector<Symbol> symbols;
+
+    static uint64_t timestamp() {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+
+    static uint32_t threadId() {
+#ifdef __linux__
+        return (uint32_t)syscall(SYS_gettid);
+#else
+        return (uint32_t)getpid();
+#endif
+    }
+
+    template<typename T>
+    static void append(std::vector<uint8_t>& out, const T& value) {
+        const uint8_t* p = (const uint8_t*)&value;
+        out.insert(out.end(), p, p + sizeof(T));
+    }
+
+public:
+    PerfMap(const void* func, size_t size, size_t entry, const std::vector<EVM2::Instruction>& instructions,
+            const JITMapping& mapping) : code((const uint8_t*)func), codeSize(size) {
+        std::set<EVM2::Arg::addr_t> functions, threads;
+        for (const EVM2::Instruction& i : instructions)
+        {
+            if (i.opcode == EVM2::Op::CALL)
+                functions.insert(i.args[0].addr);
+            else if (i.opcode == EVM2::Op::CREATETHREAD)
+                threads.insert(i.args[0].addr);
+        }
+
+        // blocks are contiguous in any layout, symbol ends where the next one starts
+        std::vector<std::pair<size_t, std::string>> starts = {{0, "evm_prologue"}};
+        BlockLayout layout(instructions, nullptr);
+        for (size_t b = 0; b < layout.blockCount(); b++)
+        {
+            EVM2::Arg::addr_t bitOffset = instructions[layout.block(b).first].bitOffset;
+            auto it = mapping.find(bitOffset);
+            if (it == mapping.end())
+                continue;
+
+            std::string name = b == 0 ? "evm_main" :
+                               functions.contains(bitOffset) ? "evm_func_" + std::to_string(bitOffset) :
+                               threads.contains(bitOffset) ? "evm_thread_" + std::to_string(bitOffset) :
+                               "evm_block_" + std::to_string(bitOffset);
+            starts.push_back({b == 0 ? entry * 4 : it->second * 4, name});
+        }
+        std::stable_sort(starts.begin(), starts.end(), [](const auto& a, const auto& b) {
+            return a.first < b.first;
+        });
+
+        for (size_t k = 0; k < starts.size(); k++)
+        {
+            size_t end = k + 1 < starts.size() ? starts[k + 1].first : codeSize;
+            if (end > starts[k].first)
+                symbols.push_back({starts[k].first, end - starts[k].first, starts[k].second});
+        }
+    }
+
+    const std::vector<Symbol>& getSymbols() const {
+        return symbols;
+    }
+
+    /**
+     * Append symbols to /tmp/perf-<pid>.map
+     */
+    bool writeMap(pid_t pid) const {
+        std::string path = "/tmp/perf-" + std::to_string(pid) + ".map";
+        FILE* f = fopen(path.c_str(), "a");
+        if (!f)
+            return false;
+        for (const Symbol& s : symbols)
+            fprintf(f, "%" PRIxPTR " %zx %s\n", (uintptr_t)(code + s.start), s.size, s.name.c_str());
+        return fclose(f) == 0;
+    }
+
+    /**
+     * Write /tmp/jit-<pid>.dump with one code load record per symbol, the
+     * file stays mapped executable so perf record notices it
+     */
+    bool writeJitDump(pid_t pid) const {
+        enum {
+            magic = 0x4A695444,     // "JiTD"
+            version = 1,
+            machineAArch64 = 183,
+            codeLoad = 0
+        };
+
+        std::vector<uint8_t> out;
+        append<uint32_t>(out, magic);
+        append<uint32_t>(out, version);
+        append<uint32_t>(out, 40);                  // header size
+        append<uint32_t>(out, machineAArch64);
+        append<uint32_t>(out, 0);                   // padding
+        append<uint32_t>(out, (uint32_t)pid);
+        append<uint64_t>(out, timestamp());
+        append<uint64_t>(out, 0);                   // flags
+
+        uint32_t tid = threadId();
+        for (size_t k = 0; k < symbols.size(); k++)
+        {
+            const Symbol& s = symbols[k];
+            uint64_t address = (uint64_t)(uintptr_t)(code + s.start);
+            append<uint32_t>(out, codeLoad);
+            append<uint32_t>(out, (uint32_t)(16 + 40 + s.name.size() + 1 + s.size));
+            append<uint64_t>(out, timestamp());
+            append<uint32_t>(out, (uint32_t)pid);
+            append<uint32_t>(out, tid);
+            append<uint64_t>(out, address);         // vma
+            append<uint64_t>(out, address);         // code address
+            append<uint64_t>(out, s.size);
+            append<uint64_t>(out, k);               // code index
+            out.insert(out.end(), s.name.begin(), s.name.end());
+            out.push_back(0);
+            out.insert(out.end(), code + s.start, code + s.start + s.size);
+        }
+
+        std::string path = "/tmp/jit-" + std::to_string(pid) + ".dump";
+        int fd = open(path.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0666);
+        if (fd < 0)
+            return false;
+        bool written = ::write(fd, out.data(), out.size()) == (ssize_t)out.size();
+        // marker mapping, kept for the lifetime of the process
+        void* marker = mmap(nullptr, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, 0);
+        close(fd);
+        return written && marker != MAP_FAILED;
+    }
+};
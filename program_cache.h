@@ -0,0 +1,100 @@
+#include <map>
+#include <memory>
+#include <string>
+
+/**
+ * Decoded and compiled programs by content hash (64-bit FNV-1a of the
+ * EVM2 file), shared by jobs of the batch mode and runs of the server
+ *
+ * Programs are compiled with the JIT or the C translator and stay loaded
+ * for the lifetime of the cache, forked VMs run them without compiling.
+ * Failed loads are not cached.
+ */
+class ProgramCache {
+public:
+    struct Program {
+        std::unique_ptr<EVM2::Disassembler> disasm;
+        std::unique_ptr<ARM64JITFrontend> jit;
+        std::unique_ptr<AOTCompilerC> aot;
+        JITFunction func = nullptr;
+        size_t entry = 0;
+    };
+
+private:
+    std::map<uint64_t, Program> programs;
+    bool aotC;
+    size_t shadowStackDepth;
+    uint64_t compileNs = 0;
+
+public:
+    ProgramCache(bool useAotC, size_t shadowStack) : aotC(useAotC), shadowStackDepth(shadowStack) {}
+
+    static uint64_t contentHash(const std::string& content) {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (unsigned char c : content)
+        {
+            hash ^= c;
+            hash *= 0x100000001b3ULL;
+        }
+        return hash;
+    }
+
+    /**
+     * Program of the file, compiled on first use, nullptr with error message on failure
+     */
+    const Program* load(const std::string& filename, uint64_t& hash, std::string& error) {
+        std::ifstream file(filename, std::ios::binary);
+        if (!file)
+        {
+            error = "Cannot open file: " + filename;
+            return nullptr;
+        }
+        std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        hash = contentHash(content);
+        if (const Program* cached = find(hash))
+            return cached;
+
+        Program program;
+        CompileStats::Timer timer;
+        try {
+            program.disasm = std::make_unique<EVM2::Disassembler>(filename);
+        } catch (const std::exception& e) {
+            error = e.what();
+            return nullptr;
+        }
+        CompileOptions compileOptions;
+        compileOptions.shadowStackDepth = shadowStackDepth;
+        if (aotC)
+        {
+            program.aot = std::make_unique<AOTCompilerC>();
+            program.func = program.aot->compile(*program.disasm, compileOptions);
+            program.entry = program.aot->entry();
+        }
+        else
+        {
+            program.jit = std::make_unique<ARM64JITFrontend>();
+            program.func = Compile(*program.disasm, *program.jit, nullptr, compileOptions);
+            program.entry = program.jit->entry();
+        }
+        timer.lap(compileNs);
+        if (!program.func)
+        {
+            error = "Cannot compile " + filename;
+            return nullptr;
+        }
+        return &(programs[hash] = std::move(program));
+    }
+
+    const Program* find(uint64_t hash) const {
+        auto found = programs.find(hash);
+        return found != programs.end() ? &found->second : nullptr;
+    }
+
+    size_t size() const {
+        return programs.size();
+    }
+
+    uint64_t totalCompileNs() const {
+        return compileNs;
+    }
+};
@@ -0,0 +1,354 @@
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+/**
+ * Random EVM2 programs for decoder/compiler stress and differential
+ * testing of execution engines
+ *
+ * Programs always terminate and their console output is deterministic:
+ *   - data registers r0-r11 hold values, r12 memory address, r13 divisor
+ *     or constant operand, r14 loop counter, r15 loop scratch
+ *   - memory is addressed by constants only, main thread uses the lower
+ *     half of data, thread slots (handle, result) the upper half
+ *   - branches go forward, loops are counted and not nested, functions
+ *     are short and only the first half of them calls the second half,
+ *     so every call executes a bounded number of instructions
+ *   - divisors are positive constants
+ *   - threads compute on their copy of registers, store result into own
+ *     slot and halt, main thread joins them and prints the results, only
+ *     main thread writes to console
+ * Statement kinds are drawn by weights of Mix, size is the approximate
+ * instruction count of the program.
+ */
+class ProgramGenerator {
+public:
+    struct Mix {
+        unsigned alu = 8;
+        unsigned memory = 3;
+        unsigned calls = 1;
+        unsigned branches = 2;
+        unsigned threads = 0;
+        unsigned io = 1;
+
+        /**
+         * Weights as "alu=8,memory=3,calls=1,branches=2,threads=0,io=1", missing ones keep default
+         */
+        bool parse(const std::string& text) {
+            size_t start = 0;
+            while (start < text.size())
+            {
+                size_t end = text.find(',', start);
+                if (end == std::string::npos)
+                    end = text.size();
+                std::string item = text.substr(start, end - start);
+                size_t eq = item.find('=');
+                if (eq == std::string::npos)
+                    return false;
+                std::string name = item.substr(0, eq);
+                unsigned weight = (unsigned)std::stoul(item.substr(eq + 1));
+                if (name == "alu")
+                    alu = weight;
+                else if (name == "memory")
+                    memory = weight;
+                else if (name == "calls")
+                    calls = weight;
+                else if (name == "branches")
+                    branches = weight;
+                else if (name == "threads")
+                    threads = weight;
+                else if (name == "io")
+                    io = weight;
+                else
+                    return false;
+                start = end + 1;
+            }
+            return alu + memory + calls + branches + threads + io > 0;
+        }
+    };
+
+    enum {
+        dataRegisters = 12,
+        addressRegister = 12,
+        operandRegister = 13,
+        counterRegister = 14,
+        scratchRegister = 15,
+        dataSize = 1 << 16,
+        threadSlots = 256,
+        maxFunctions = 4096,
+        functionSize = 64,
+        maxLoop = 16
+    };
+
+private:
+    typedef EVM2::Instruction Instruction;
+    typedef EVM2::Arg Arg;
+    typedef EVM2::Op Op;
+
+    std::mt19937_64 random;
+    Mix mix;
+
+    std::vector<Instruction> code;
+    std::vector<size_t> labels;             // label id -> instruction index
+    std::vector<std::pair<size_t, size_t>> references;     // instruction index, label id
+    size_t functionCount = 0;
+    size_t threadCount = 0;
+
+    static Arg reg(unsigned r) {
+        Arg a;
+        a.kind = Arg::Kind::REG;
+        a.reg = (uint8_t)r;
+        return a;
+    }
+
+    static Arg mem(unsigned r, unsigned size) {
+        Arg a;
+        a.kind = Arg::Kind::MEM;
+        a.reg = (uint8_t)r;
+        a.sizeBytes = (uint8_t)size;
+        return a;
+    }
+
+    static Arg constant(int64_t value) {
+        Arg a;
+        a.kind = Arg::Kind::CONST;
+        a.constValue = value;
+        return a;
+    }
+
+    size_t newLabel() {
+        labels.push_back(SIZE_MAX);
+        return labels.size() - 1;
+    }
+
+    void place(size_t label) {
+        labels[label] = code.size();
+    }
+
+    void emit(Op op, std::vector<Arg> args = {}) {
+        Instruction i;
+        i.opcode = op;
+        i.args = std::move(args);
+        code.push_back(i);
+    }
+
+    void emitBranch(Op op, size_t label, std::vector<Arg> args = {}) {
+        Arg a;
+        a.kind = Arg::Kind::ADDR;
+        args.insert(args.begin(), a);
+        references.push_back({code.size(), label});
+        emit(op, args);
+    }
+
+    uint64_t below(uint64_t n) {
+        return random() % n;
+    }
+
+    unsigned dataRegister() {
+        return (unsigned)below(dataRegisters);
+    }
+
+    int64_t value() {
+        // small values keep arithmetic interesting, some are full width
+        switch (below(4))
+        {
+            case 0: return (int64_t)random();
+            case 1: return -(int64_t)below(1000);
+            default: return (int64_t)below(1000);
+        }
+    }
+
+    void alu() {
+        static const Op ops[] = {Op::ADD, Op::SUB, Op::MUL, Op::DIV, Op::MOD, Op::COMPARE, Op::MOV, Op::LOADCONST};
+        Op op = ops[below(std::size(ops))];
+        if (op == Op::LOADCONST)
+            emit(op, {constant(value()), reg(dataRegister())});
+        else if (op == Op::MOV)
+            emit(op, {reg(dataRegister()), reg(dataRegister())});
+        else if (op == Op::DIV || op == Op::MOD)
+        {
+            emit(Op::LOADCONST, {constant(1 + (int64_t)below(1000)), reg(operandRegister)});
+            emit(op, {reg(dataRegister()), reg(operandRegister), reg(dataRegister())});
+        }
+        else if (below(4) == 0)
+        {
+            // constant operand, the form of superinstructions
+            emit(Op::LOADCONST, {constant(value()), reg(operandRegister)});
+            emit(op, {reg(dataRegister()), reg(operandRegister), reg(dataRegister())});
+        }
+        else
+            emit(op, {reg(dataRegister()), reg(dataRegister()), reg(dataRegister())});
+    }
+
+    void memory() {
+        static const unsigned sizes[] = {1, 2, 4, 8};
+        unsigned size = sizes[below(4)];
+        emit(Op::LOADCONST, {constant((int64_t)(below(dataSize / 2 / 8) * 8)), reg(addressRegister)});
+        if (below(2))
+            emit(Op::MOV, {reg(dataRegister()), mem(addressRegister, size)});
+        else
+            emit(Op::MOV, {mem(addressRegister, size), reg(dataRegister())});
+    }
+
+    void io() {
+        emit(Op::CONSOLEWRITE, {reg(dataRegister())});
+    }
+
+    void branch() {
+        size_t skip = newLabel();
+        emitBranch(Op::JUMPEQ, skip, {reg(dataRegister()), reg(dataRegister())});
+        for (size_t n = 1 + below(3); n > 0; n--)
+            alu();
+        place(skip);
+    }
+
+    void thread(std::vector<size_t>& workers) {
+        if (threadCount == threadSlots)
+            return;
+        size_t worker = newLabel();
+        workers.push_back(worker);
+        emit(Op::LOADCONST, {constant(dataSize / 2 + (int64_t)threadCount * 16), reg(addressRegister)});
+        emitBranch(Op::CREATETHREAD, worker, {mem(addressRegister, 8)});
+        threadCount++;
+    }
+
+    // straight-line or branching statement, calls functions from firstCallee on,
+    // threads are created by main thread only
+    void statement(size_t firstCallee, std::vector<size_t>* workers) {
+        unsigned weights[] = {mix.alu, mix.memory, mix.calls, mix.branches, workers ? mix.threads : 0,
+                              workers ? mix.io : 0};
+        std::discrete_distribution<unsigned> kind(std::begin(weights), std::end(weights));
+        switch (kind(random))
+        {
+            case 0:
+                alu();
+                break;
+            case 1:
+                memory();
+                break;
+            case 2:
+                if (firstCallee < functionCount)
+                    emitBranch(Op::CALL, firstCallee + below(functionCount - firstCallee));
+                break;
+            case 3:
+                branch();
+                break;
+            case 4:
+                thread(*workers);
+                break;
+            case 5:
+                io();
+                break;
+        }
+    }
+
+    // counter register is shared by all loops, so no calls inside
+    void loop(size_t statements) {
+        size_t top = newLabel(), done = newLabel();
+        emit(Op::LOADCONST, {constant(1 + (int64_t)below(maxLoop)), reg(counterRegister)});
+        place(top);
+        for (size_t n = 0; n < statements; n++)
+            statement(functionCount, nullptr);
+        emit(Op::LOADCONST, {constant(1), reg(scratchRegister)});
+        emit(Op::SUB, {reg(counterRegister), reg(scratchRegister), reg(counterRegister)});
+        emit(Op::LOADCONST, {constant(0), reg(scratchRegister)});
+        emitBranch(Op::JUMPEQ, done, {reg(counterRegister), reg(scratchRegister)});
+        emitBranch(Op::JUMP, top);
+        place(done);
+    }
+
+    void body(size_t instructions, size_t firstCallee, std::vector<size_t>* workers) {
+        size_t end = code.size() + instructions;
+        while (code.size() < end)
+        {
+            if (mix.branches && below(16) == 0)
+                loop(1 + below(4));
+            else
+                statement(firstCallee, workers);
+        }
+    }
+
+public:
+    ProgramGenerator(uint64_t seed, const Mix& weights) : random(seed), mix(weights) {}
+
+    /**
+     * Generate program of about size instructions, returns EVM2 code with
+     * resolved bit offsets
+     */
+    std::vector<Instruction> generate(size_t size) {
+        code.clear();
+        labels.clear();
+        references.clear();
+        threadCount = 0;
+
+        // label ids 0..functionCount-1 are the functions
+        // about a quarter of code is in functions
+        functionCount = mix.calls ? std::clamp<size_t>(size / 4 / functionSize, 2, maxFunctions) : 0;
+        for (size_t f = 0; f < functionCount; f++)
+            newLabel();
+
+        for (unsigned r = 0; r < dataRegisters; r++)
+            emit(Op::LOADCONST, {constant(value()), reg(r)});
+
+        // main body calls any function, function f only the ones after it
+        std::vector<size_t> workers;
+        body(size - std::min(size, functionSize * functionCount), 0, &workers);
+        if (functionCount)
+            for (size_t n = 0; n < 4; n++)
+                emitBranch(Op::CALL, below(functionCount));
+
+        for (size_t t = 0; t < threadCount; t++)
+        {
+            emit(Op::LOADCONST, {constant(dataSize / 2 + (int64_t)t * 16), reg(addressRegister)});
+            emit(Op::JOINTHREAD, {mem(addressRegister, 8)});
+            emit(Op::LOADCONST, {constant(dataSize / 2 + (int64_t)t * 16 + 8), reg(addressRegister)});
+            emit(Op::MOV, {mem(addressRegister, 8), reg(0)});
+            emit(Op::CONSOLEWRITE, {reg(0)});
+        }
+        for (unsigned r = 0; r < dataRegisters; r++)
+            emit(Op::CONSOLEWRITE, {reg(r)});
+        emit(Op::HLT);
+
+        for (size_t f = 0; f < functionCount; f++)
+        {
+            place(f);
+            body(functionSize, f < functionCount / 2 ? functionCount / 2 : functionCount, nullptr);
+            emit(Op::RET);
+        }
+
+        // worker: slot address comes in r12 copied from creator
+        for (size_t worker : workers)
+        {
+            place(worker);
+            emit(Op::LOADCONST, {constant(8), reg(operandRegister)});
+            emit(Op::ADD, {reg(addressRegister), reg(operandRegister), reg(addressRegister)});
+            for (size_t n = 1 + below(8); n > 0; n--)
+                emit(Op::ADD, {reg(dataRegister()), reg(dataRegister()), reg(0)});
+            emit(Op::MOV, {reg(0), mem(addressRegister, 8)});
+            emit(Op::HLT);
+        }
+
+        // bit offsets, then label references
+        std::vector<uint32_t> offsets(code.size() + 1, 0);
+        for (size_t k = 0; k < code.size(); k++)
+        {
+            code[k].bitOffset = offsets[k];
+            offsets[k + 1] = offsets[k] + (uint32_t)EVM2::Encoder::instructionBits(code[k]);
+        }
+        for (const auto& [instruction, label] : references)
+            code[instruction].args[0].addr = offsets[labels[label]];
+        return code;
+    }
+
+    /**
+     * Generate program and write it as EVM2 file
+     */
+    bool write(const std::string& filename, size_t size) {
+        EVM2::BitWriter writer;
+        for (const Instruction& i : generate(size))
+            EVM2::Encoder::writeInstruction(writer, i);
+        return EVM2::Encoder::writeFile(filename, writer.getBytes(), dataSize, {});
+    }
+};
@@ -0,0 +1,475 @@
+#include <algorithm>
+#include <array>
+#include <map>
+#include <numeric>
+#include <vector>
+
+/**
+ * Linear scan allocation of host registers for EVM registers
+ *
+ * Virtual registers are webs - every EVM register is split into independent
+ * values connected through control flow (def -> uses), so a register reused
+ * for unrelated purposes gets separate virtual registers.
+ *
+ *   - liveness is solved on instruction level control flow graph: jumps,
+ *     calls, RETs of a function go through its return node to the call
+ *     sites of the function, CREATETHREAD uses everything that is live at
+ *     thread entry (child copies parent registers[])
+ *   - live interval of a web is the range of instructions where it is live
+ *     or accessed, calls of inlined helpers also cover the call site
+ *   - intervals sorted by start get free host register, intervals crossing
+ *     host call only callee saved x23-x28, others prefer caller saved
+ *     x5-x8, x11-x15
+ *   - under pressure the interval with the lowest loop weighted use count
+ *     stays in registers[] memory for its whole lifetime
+ *
+ * Intervals are not split, so there is no spill or reload code inside the
+ * program, registers[] is synchronized only at entry points (program start,
+ * thread entry stubs) and before CREATETHREAD.
+ */
+class RegisterAllocator {
+public:
+    typedef std::array<int8_t, 16> Locations;               // host register, 0 = registers[] memory
+    typedef std::vector<std::pair<uint8_t, int>> Transfers; // EVM register, host register
+
+private:
+    typedef uint16_t RegSet;
+
+    struct Interval {
+        size_t start = SIZE_MAX;
+        size_t end = 0;
+        uint64_t weight = 0;
+        bool crossesCall = false;
+        int host = 0;
+        size_t web = 0;
+
+        void cover(size_t pos) {
+            start = std::min(start, pos);
+            end = std::max(end, pos);
+        }
+    };
+
+    static constexpr int callerSaved[] = {5, 6, 7, 8, 11, 12, 13, 14, 15};
+    static constexpr int calleeSaved[] = {23, 24, 25, 26, 27, 28};
+
+    std::vector<Locations> sources;
+    std::vector<Locations> destinations;
+    Transfers programEntry;
+    std::map<size_t, Transfers> threadEntries;
+    std::map<size_t, Transfers> threadStores;
+    size_t allocated = 0;
+    size_t spilled = 0;
+
+    static int destinationArg(EVM2::Op op) {
+        switch (op)
+        {
+            case EVM2::Op::CONSOLEREAD:
+                return 0;
+            case EVM2::Op::LOADCONST:
+            case EVM2::Op::MOV:
+            case EVM2::Op::CREATETHREAD:
+                return 1;
+            case EVM2::Op::ADD:
+            case EVM2::Op::SUB:
+            case EVM2::Op::MUL:
+            case EVM2::Op::DIV:
+            case EVM2::Op::MOD:
+            case EVM2::Op::COMPARE:
+                return 2;
+            case EVM2::Op::READ:
+                return 3;
+            default:
+                return -1;
+        }
+    }
+
+    static bool isHostCall(EVM2::Op op) {
+        switch (op)
+        {
+            case EVM2::Op::CONSOLEREAD:
+            case EVM2::Op::CONSOLEWRITE:
+            case EVM2::Op::HLT:
+            case EVM2::Op::CREATETHREAD:
+            case EVM2::Op::JOINTHREAD:
+            case EVM2::Op::SLEEP:
+            case EVM2::Op::LOCK:
+            case EVM2::Op::UNLOCK:
+            case EVM2::Op::READ:
+            case EVM2::Op::WRITE:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // union-find over value ids
+    std::vector<uint32_t> parent;
+
+    size_t find(size_t id) {
+        while (parent[id] != id)
+            id = parent[id] = parent[parent[id]];
+        return id;
+    }
+
+    void unite(size_t a, size_t b) {
+        parent[find(a)] = find(b);
+    }
+
+public:
+    /**
+     * Inlined helpers by index of first instruction -> index of its RET
+     */
+    RegisterAllocator(const std::vector<EVM2::Instruction>& instructions, const std::map<size_t, size_t>& inlineBodies) {
+        const size_t count = instructions.size();
+        // instructions are in bit offset order
+        auto target = [&](const EVM2::Instruction& i) {
+            auto it = std::lower_bound(instructions.begin(), instructions.end(), i.args[0].addr,
+                                       [](const EVM2::Instruction& a, EVM2::Arg::addr_t addr) { return a.bitOffset < addr; });
+            assert(it != instructions.end() && it->bitOffset == i.args[0].addr);
+            return size_t(it - instructions.begin());
+        };
+
+        // nodes: instructions, program entry, thread entries, function returns
+        std::vector<size_t> entryTargets = {0};
+        std::map<size_t, size_t> threadNodes;
+        std::map<size_t, size_t> functions;     // first instruction -> return node
+        for (const EVM2::Instruction& i : instructions)
+        {
+            if (i.opcode == EVM2::Op::CREATETHREAD && !threadNodes.contains(target(i)))
+            {
+                threadNodes[target(i)] = count + entryTargets.size();
+                entryTargets.push_back(target(i));
+            }
+            if (i.opcode == EVM2::Op::CALL)
+                functions.insert({target(i), 0});
+        }
+        size_t nodes = count + entryTargets.size();
+        for (auto& [first, node] : functions)
+            node = nodes++;
+
+        std::vector<RegSet> use(nodes, 0), def(nodes, 0);
+        std::vector<std::vector<size_t>> succ(nodes);
+        for (size_t k = 0; k + 1 < count; k++)
+            if (instructions[k].opcode == EVM2::Op::CALL)
+                succ[functions[target(instructions[k])]].push_back(k + 1);
+
+        for (size_t k = 0; k < count; k++)
+        {
+            const EVM2::Instruction& i = instructions[k];
+            int dest = destinationArg(i.opcode);
+            for (int a = 0; a < (int)i.args.size(); a++)
+            {
+                const EVM2::Arg& arg = i.args[a];
+                if (arg.kind == EVM2::Arg::Kind::REG && a == dest)
+                    def[k] |= 1 << arg.reg;
+                else if (arg.kind == EVM2::Arg::Kind::REG || arg.kind == EVM2::Arg::Kind::MEM)
+                    use[k] |= 1 << arg.reg;
+            }
+
+            switch (i.opcode)
+            {
+                case EVM2::Op::JUMP:
+                case EVM2::Op::CALL:
+                    succ[k].push_back(target(i));
+                    break;
+                case EVM2::Op::JUMPEQ:
+                    succ[k].push_back(target(i));
+                    if (k + 1 < count)
+                        succ[k].push_back(k + 1);
+                    break;
+                case EVM2::Op::RET:
+                case EVM2::Op::HLT:
+                    break;
+                default:
+                    if (k + 1 < count)
+                        succ[k].push_back(k + 1);
+            }
+        }
+        for (size_t e = 0; e < entryTargets.size(); e++)
+        {
+            def[count + e] = 0xFFFF;
+            succ[count + e].push_back(entryTargets[e]);
+        }
+
+        // RETs reachable from function entry without returning, callees are stepped over
+        std::vector<size_t> visited(count, SIZE_MAX);
+        for (const auto& [first, node] : functions)
+        {
+            std::vector<size_t> pending = {first};
+            while (!pending.empty())
+            {
+                size_t k = pending.back();
+                pending.pop_back();
+                if (k >= count || visited[k] == node)
+                    continue;
+                visited[k] = node;
+                switch (instructions[k].opcode)
+                {
+                    case EVM2::Op::RET:
+                        succ[k].push_back(node);
+                        break;
+                    case EVM2::Op::HLT:
+                        break;
+                    case EVM2::Op::JUMP:
+                        pending.push_back(target(instructions[k]));
+                        break;
+                    case EVM2::Op::JUMPEQ:
+                        pending.push_back(target(instructions[k]));
+                        pending.push_back(k + 1);
+                        break;
+                    default:
+                        pending.push_back(k + 1);
+                }
+            }
+        }
+
+        // liveness
+        std::vector<RegSet> liveIn(nodes, 0), liveOut(nodes, 0);
+        for (bool changed = true; changed; )
+        {
+            changed = false;
+            for (size_t n = nodes; n-- > 0; )
+            {
+                RegSet out = 0;
+                for (size_t s : succ[n])
+                    out |= liveIn[s];
+                RegSet in = use[n] | (out & ~def[n]);
+                if (n < count && instructions[n].opcode == EVM2::Op::CREATETHREAD)
+                    in |= liveIn[target(instructions[n])];
+                changed |= in != liveIn[n] || out != liveOut[n];
+                liveIn[n] = in;
+                liveOut[n] = out;
+            }
+        }
+
+        // webs: value of register r entering node n is n*16+r, defined by n is (nodes+n)*16+r
+        assert(nodes * 32 <= UINT32_MAX);
+        parent.resize(nodes * 32);
+        std::iota(parent.begin(), parent.end(), 0);
+        auto valueIn = [&](size_t n, int r) { return n * 16 + r; };
+        auto valueOut = [&](size_t n, int r) { return def[n] & (1 << r) ? (nodes + n) * 16 + r : valueIn(n, r); };
+
+        for (size_t n = 0; n < nodes; n++)
+            for (size_t s : succ[n])
+                for (int r = 0; r < 16; r++)
+                    if (liveIn[s] & (1 << r))
+                        unite(valueOut(n, r), valueIn(s, r));
+
+        // loop depth from backward jumps, difference array over their spans
+        std::vector<int> depth(count + 1, 0);
+        for (size_t k = 0; k < count; k++)
+        {
+            EVM2::Op op = instructions[k].opcode;
+            if ((op == EVM2::Op::JUMP || op == EVM2::Op::JUMPEQ) && target(instructions[k]) <= k)
+            {
+                depth[target(instructions[k])]++;
+                depth[k + 1]--;
+            }
+        }
+        std::partial_sum(depth.begin(), depth.end(), depth.begin());
+
+        // live intervals, slots index them by web
+        std::vector<Interval> intervals;
+        std::vector<uint32_t> slots(parent.size(), UINT32_MAX);
+        auto intervalOf = [&](size_t value) -> Interval& {
+            size_t web = find(value);
+            if (slots[web] == UINT32_MAX)
+            {
+                slots[web] = intervals.size();
+                intervals.push_back({});
+                intervals.back().web = web;
+            }
+            return intervals[slots[web]];
+        };
+        for (size_t k = 0; k < count; k++)
+        {
+            uint64_t weight = 1ULL << (3 * std::min(depth[k], 5));
+            for (int r = 0; r < 16; r++)
+            {
+                RegSet bit = 1 << r;
+                if (liveIn[k] & bit)
+                    intervalOf(valueIn(k, r)).cover(k);
+                if (liveOut[k] & bit)
+                    intervalOf(valueOut(k, r)).cover(k);
+                if (use[k] & bit)
+                    intervalOf(valueIn(k, r)).weight += weight;
+                if (def[k] & bit)
+                {
+                    Interval& defined = intervalOf(valueOut(k, r));
+                    defined.cover(k);
+                    defined.weight += weight;
+                }
+            }
+        }
+        for (size_t e = 0; e < entryTargets.size(); e++)
+            for (int r = 0; r < 16; r++)
+                if (liveOut[count + e] & (1 << r))
+                    intervalOf(valueOut(count + e, r)).cover(entryTargets[e]);
+
+        // body of inlined helper runs at call site
+        for (size_t c = 0; c < count; c++)
+        {
+            if (instructions[c].opcode != EVM2::Op::CALL)
+                continue;
+            auto body = inlineBodies.find(target(instructions[c]));
+            if (body == inlineBodies.end())
+                continue;
+            for (size_t j = body->first; j < body->second; j++)
+                for (int r = 0; r < 16; r++)
+                {
+                    if (use[j] & (1 << r))
+                        intervalOf(valueIn(j, r)).cover(c);
+                    if (def[j] & (1 << r))
+                        intervalOf(valueOut(j, r)).cover(c);
+                }
+        }
+
+        // host calls before each instruction
+        std::vector<size_t> hostCalls(count + 1, 0);
+        for (size_t k = 0; k < count; k++)
+            hostCalls[k + 1] = hostCalls[k] + isHostCall(instructions[k].opcode);
+        for (Interval& interval : intervals)
+            interval.crossesCall = hostCalls[interval.end + 1] > hostCalls[interval.start];
+
+        // linear scan
+        std::vector<Interval*> order;
+        for (Interval& interval : intervals)
+            order.push_back(&interval);
+        std::sort(order.begin(), order.end(), [](const Interval* a, const Interval* b) {
+            return a->start != b->start ? a->start < b->start : a->web < b->web;
+        });
+
+        std::vector<Interval*> active;
+        bool free[32];
+        std::fill(std::begin(free), std::end(free), false);
+        for (int reg : callerSaved)
+            free[reg] = true;
+        for (int reg : calleeSaved)
+            free[reg] = true;
+
+        for (Interval* current : order)
+        {
+            std::erase_if(active, [&](Interval* a) {
+                if (a->end >= current->start)
+                    return false;
+                free[a->host] = true;
+                return true;
+            });
+
+            auto allowed = [&](int reg) {
+                return std::find(std::begin(calleeSaved), std::end(calleeSaved), reg) != std::end(calleeSaved) ||
+                       !current->crossesCall;
+            };
+
+            if (!current->crossesCall)
+                for (int reg : callerSaved)
+                    if (free[reg] && !current->host)
+                        current->host = reg;
+            for (int reg : calleeSaved)
+                if (free[reg] && !current->host)
+                    current->host = reg;
+
+            if (!current->host)
+            {
+                Interval* victim = nullptr;
+                for (Interval* a : active)
+                    if (allowed(a->host) && (!victim || a->weight < victim->weight))
+                        victim = a;
+                if (!victim || victim->weight >= current->weight)
+                    continue;
+                current->host = victim->host;
+                victim->host = 0;
+                std::erase(active, victim);
+            }
+            free[current->host] = false;
+            active.push_back(current);
+        }
+
+        for (const Interval& interval : intervals)
+            interval.host ? allocated++ : spilled++;
+
+        // locations of operands and register transfers
+        auto host = [&](size_t value) {
+            uint32_t slot = slots[find(value)];
+            return slot == UINT32_MAX ? 0 : intervals[slot].host;
+        };
+
+        sources.assign(count, Locations{});
+        destinations.assign(count, Locations{});
+        for (size_t k = 0; k < count; k++)
+            for (int r = 0; r < 16; r++)
+            {
+                if (liveIn[k] & (1 << r))
+                    sources[k][r] = host(valueIn(k, r));
+                if (def[k] & (1 << r))
+                    destinations[k][r] = host(valueOut(k, r));
+            }
+
+        for (size_t e = 0; e < entryTargets.size(); e++)
+        {
+            Transfers& loads = e == 0 ? programEntry : threadEntries[entryTargets[e]];
+            for (int r = 0; r < 16; r++)
+                if (liveOut[count + e] & (1 << r))
+                    if (int reg = host(valueOut(count + e, r)))
+                        loads.push_back({r, reg});
+        }
+
+        for (size_t k = 0; k < count; k++)
+        {
+            if (instructions[k].opcode != EVM2::Op::CREATETHREAD)
+                continue;
+            Transfers& stores = threadStores[k];
+            for (int r = 0; r < 16; r++)
+                if (liveIn[target(instructions[k])] & (1 << r))
+                    if (int reg = host(valueIn(k, r)))
+                        stores.push_back({r, reg});
+        }
+    }
+
+    /**
+     * Host registers of operands read by instruction
+     */
+    const Locations& sourceLocations(size_t index) const {
+        return sources[index];
+    }
+
+    /**
+     * Host registers of operands written by instruction
+     */
+    const Locations& destinationLocations(size_t index) const {
+        return destinations[index];
+    }
+
+    /**
+     * Registers to load from registers[] when program starts
+     */
+    const Transfers& programEntryLoads() const {
+        return programEntry;
+    }
+
+    /**
+     * Registers to load from registers[] when thread starts at instruction index
+     */
+    const Transfers& threadEntryLoads(size_t index) const {
+        static const Transfers none;
+        auto it = threadEntries.find(index);
+        return it == threadEntries.end() ? none : it->second;
+    }
+
+    /**
+     * Registers to store into registers[] before CREATETHREAD at instruction index
+     */
+    const Transfers& threadCreateStores(size_t index) const {
+        static const Transfers none;
+        auto it = threadStores.find(index);
+        return it == threadStores.end() ? none : it->second;
+    }
+
+    size_t allocatedCount() const {
+        return allocated;
+    }
+
+    size_t spilledCount() const {
+        return spilled;
+    }
+};
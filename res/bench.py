@@ -0,0 +1,200 @@
+import os
+import re
+import sys
+import glob
+import json
+import time
+import shutil
+import argparse
+import tempfile
+import statistics
+import subprocess
+
+from compiler import Lexer, Parser, Assembler
+
+
+Phases = ["decode", "labels", "allocation", "layout", "lowering", "fixups", "finalize", "execute"]
+
+Reported = ["decode", "compile", "execute"]
+
+CompilePhases = ["labels", "allocation", "layout", "lowering", "fixups", "finalize"]
+
+StatLine = re.compile(r"^\s+(\w+)\s+([0-9.]+) ms$")
+
+
+def assemble(source, output):
+    parser = Parser(Lexer(source))
+    parser.analyse()
+    Assembler(parser).build(output)
+
+
+def scaled(source, workdir, name, replacements):
+    # variant of res/ workload with some constants replaced
+    with open(source, "r") as handle:
+        text = handle.read()
+
+    for pattern, replacement in replacements:
+        text, count = re.subn(pattern, replacement, text, count=1, flags=re.MULTILINE)
+        if count != 1:
+            raise RuntimeError("%s: pattern %r not found" % (source, pattern))
+
+    path = os.path.join(workdir, name + ".easm")
+    with open(path, "w") as handle:
+        handle.write(text)
+    return path
+
+
+def workloads(workdir, scale):
+    # (name, easm, payload, stdin) of every res/ program plus scaled up variants
+    jobs = []
+    for source in sorted(glob.glob("*.easm")):
+        base = source[:-len(".easm")]
+        payload = base + ".bin" if os.path.exists(base + ".bin") else None
+        stdin = base + ".in" if os.path.exists(base + ".in") else None
+        jobs.append((base, source, payload, stdin))
+
+    # crc over payload repeated scale times
+    crc = os.path.join(workdir, "crc_x%d.bin" % scale)
+    with open("crc.bin", "rb") as handle:
+        data = handle.read()
+    with open(crc, "wb") as handle:
+        handle.write(data * scale)
+    jobs.append(("crc_x%d" % scale, "crc.easm", crc, None))
+
+    # more philosophers around the table
+    stdin = os.path.join(workdir, "philosophers_x%d.in" % scale)
+    with open("philosophers.in", "r") as handle:
+        count = int(handle.read().split()[0])
+    with open(stdin, "w") as handle:
+        handle.write("%d\n" % (count * scale))
+    jobs.append(("philosophers_x%d" % scale, "philosophers.easm", None, stdin))
+
+    # more writer threads, thread handles are followed by 2 bytes of scratch space per writer
+    writers = 1000 * scale
+    source = scaled("multithreaded_file_write.easm", workdir, "multithreaded_file_write_x%d" % scale, [
+        (r"^\.dataSize 16000$", ".dataSize %d" % (10 * writers)),
+        (r"^loadConst 1000, r1$", "loadConst %d, r1" % writers),
+        (r"^(\s*)loadConst 8000, r1", r"\g<1>loadConst %d, r1" % (8 * writers)),
+    ])
+    payload = os.path.join(workdir, "multithreaded_file_write_x%d.bin" % scale)
+    jobs.append(("multithreaded_file_write_x%d" % scale, source, payload, None))
+    return jobs
+
+
+def run(binary, program, payload, stdin, timeout):
+    # one run of the VM, returns phase -> ms parsed from --stats
+    command = [binary, "--stats", program] + ([payload] if payload else [])
+    with open(stdin or os.devnull, "rb") as handle:
+        started = time.perf_counter()
+        result = subprocess.run(command, stdin=handle, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE,
+                                timeout=timeout)
+        wall = (time.perf_counter() - started) * 1000
+
+    times = {}
+    for line in result.stderr.decode(errors="replace").splitlines():
+        match = StatLine.match(line)
+        if match and match.group(1) in Phases:
+            times[match.group(1)] = float(match.group(2))
+
+    missing = [phase for phase in Phases if phase not in times]
+    if result.returncode != 0 or missing:
+        raise RuntimeError("%s failed (exit %d, missing %s)" % (program, result.returncode, ", ".join(missing)))
+
+    return {
+        "decode": times["decode"],
+        "compile": sum(times[phase] for phase in CompilePhases),
+        "execute": times["execute"],
+        "wall": wall,
+    }
+
+
+def summary(values):
+    ordered = sorted(values)
+    p99 = ordered[min(len(ordered) - 1, int(round(0.99 * (len(ordered) - 1))))]
+    return {
+        "median": statistics.median(ordered),
+        "p99": p99,
+        "stdev": statistics.stdev(ordered) if len(ordered) > 1 else 0.0,
+    }
+
+
+def compare(results, baseline, threshold, floor):
+    # regressions of median times over baseline, times below floor ms are noise
+    regressions = []
+    for name, phases in results.items():
+        for phase, stats in phases.items():
+            base = baseline.get(name, {}).get(phase)
+            if not base or max(stats["median"], base["median"]) < floor:
+                continue
+            change = (stats["median"] - base["median"]) / base["median"]
+            if change > threshold:
+                regressions.append((name, phase, base["median"], stats["median"], change))
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Benchmark of res/ workloads: decode, compile and execute times")
+    parser.add_argument("--binary", default="./test.elf", help="VM binary")
+    parser.add_argument("--runs", type=int, default=10, help="runs of every workload")
+    parser.add_argument("--scale", type=int, default=16, help="size factor of scaled variants")
+    parser.add_argument("--filter", default="", help="regex of workload names")
+    parser.add_argument("--timeout", type=float, default=30, help="seconds per run")
+    parser.add_argument("--output", help="write results as JSON")
+    parser.add_argument("--baseline", help="compare with results JSON, fail on regression")
+    parser.add_argument("--threshold", type=float, default=0.10, help="allowed relative slowdown of median")
+    parser.add_argument("--floor", type=float, default=0.5, help="ignore phases faster than this many ms")
+    args = parser.parse_args()
+
+    baseline = {}
+    if args.baseline:
+        with open(args.baseline, "r") as handle:
+            baseline = json.load(handle)
+
+    workdir = tempfile.mkdtemp(prefix="evm2_bench_")
+    results = {}
+    failed = False
+    try:
+        for name, source, payload, stdin in workloads(workdir, args.scale):
+            if args.filter and not re.search(args.filter, name):
+                continue
+
+            program = os.path.join(workdir, name + ".evm")
+            assemble(source, program)
+            if payload and not payload.startswith(workdir):
+                # programs may write their payload, work on a copy
+                shutil.copy(payload, os.path.join(workdir, name + ".bin"))
+                payload = os.path.join(workdir, name + ".bin")
+
+            samples = {phase: [] for phase in Reported + ["wall"]}
+            try:
+                for _ in range(args.runs):
+                    for phase, value in run(args.binary, program, payload, stdin, args.timeout).items():
+                        samples[phase].append(value)
+            except (RuntimeError, subprocess.TimeoutExpired) as exc:
+                # error tests (gabo_label) fail always, only those in baseline were expected to work
+                print("%-32s FAILED %s" % (name, exc))
+                failed = failed or name in baseline
+                continue
+
+            results[name] = {phase: summary(values) for phase, values in samples.items()}
+            print("%-32s %s" % (name, "  ".join("%s %9.3f / %9.3f ms" % (phase, results[name][phase]["median"],
+                                                                         results[name][phase]["p99"])
+                                                for phase in Reported)))
+    finally:
+        shutil.rmtree(workdir)
+
+    if args.output:
+        with open(args.output, "w") as handle:
+            json.dump(results, handle, indent=2, sort_keys=True)
+
+    if args.baseline:
+        regressions = compare(results, baseline, args.threshold, args.floor)
+        for name, phase, before, after, change in regressions:
+            print("REGRESSION %-32s %-8s %9.3f -> %9.3f ms (%+.1f%%)" % (name, phase, before, after, change * 100))
+        failed = failed or bool(regressions)
+
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()
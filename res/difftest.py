@@ -0,0 +1,103 @@
+import os
+import sys
+import shutil
+import argparse
+import tempfile
+import subprocess
+
+
+def engines(workdir):
+    # name -> VM command lines run in order, output of the last one is compared
+    profile = os.path.join(workdir, "program.prof")
+    obj = os.path.join(workdir, "program.o")
+    return {
+        "jit": [["{program}"]],
+        "aot-c": [["--aot-c", "{program}"]],
+        "shadow-stack": [["--shadow-stack", "256", "{program}"]],
+        "profile-gen": [["--profile-gen", profile, "{program}"]],
+        "profile-use": [["--profile-gen", profile, "{program}"], ["--profile-use", profile, "{program}"]],
+        "object": [["--emit-object", obj, "{program}"], ["--load-object", obj]],
+    }
+
+
+def run(binary, arguments, program, timeout):
+    command = [binary] + [program if argument == "{program}" else argument for argument in arguments]
+    with open(os.devnull, "rb") as stdin:
+        result = subprocess.run(command, stdin=stdin, stdout=subprocess.PIPE, stderr=subprocess.PIPE, timeout=timeout)
+    return result.returncode, result.stdout.decode(errors="replace")
+
+
+def check(binary, program, selected, workdir, timeout):
+    # returns list of (engine, problem), the first engine is the reference
+    outputs = {}
+    problems = []
+    for name in selected:
+        try:
+            for arguments in engines(workdir)[name]:
+                code, output = run(binary, arguments, program, timeout)
+                if code != 0:
+                    break
+        except subprocess.TimeoutExpired:
+            problems.append((name, "timeout"))
+            continue
+        if code != 0:
+            problems.append((name, "exit %d" % code))
+            continue
+        outputs[name] = output
+
+    names = [name for name in selected if name in outputs]
+    for name in names[1:]:
+        if outputs[name] != outputs[names[0]]:
+            expected = outputs[names[0]].splitlines()
+            got = outputs[name].splitlines()
+            line = next((k for k in range(min(len(expected), len(got))) if expected[k] != got[k]),
+                        min(len(expected), len(got)))
+            problems.append((name, "output differs from %s at line %d" % (names[0], line + 1)))
+    return problems
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Differential test of execution engines on random programs")
+    parser.add_argument("--binary", default="./test.elf", help="VM binary")
+    parser.add_argument("--seeds", type=int, default=100, help="number of programs")
+    parser.add_argument("--first-seed", type=int, default=1, help="seed of the first program")
+    parser.add_argument("--size", type=int, default=2000, help="instructions per program")
+    parser.add_argument("--mix", default="", help="statement weights, e.g. alu=8,memory=3,calls=1,branches=2,threads=1,io=1")
+    parser.add_argument("--engines", default=",".join(engines("").keys()), help="comma separated engines, first is reference")
+    parser.add_argument("--timeout", type=float, default=60, help="seconds per run")
+    parser.add_argument("--keep", help="directory to keep failing programs in")
+    args = parser.parse_args()
+
+    selected = args.engines.split(",")
+    for name in selected:
+        if name not in engines(""):
+            parser.error("unknown engine %s" % name)
+
+    workdir = tempfile.mkdtemp(prefix="evm2_difftest_")
+    failures = 0
+    try:
+        for seed in range(args.first_seed, args.first_seed + args.seeds):
+            program = os.path.join(workdir, "seed%d.evm" % seed)
+            command = [args.binary, "--generate", program, "--gen-seed", str(seed), "--gen-size", str(args.size)]
+            if args.mix:
+                command += ["--gen-mix", args.mix]
+            subprocess.run(command, check=True)
+
+            problems = check(args.binary, program, selected, workdir, args.timeout)
+            for name, problem in problems:
+                print("seed %d: %s %s" % (seed, name, problem))
+            if problems:
+                failures += 1
+                if args.keep:
+                    os.makedirs(args.keep, exist_ok=True)
+                    shutil.copy(program, args.keep)
+            os.remove(program)
+    finally:
+        shutil.rmtree(workdir)
+
+    print("%d of %d programs failed" % (failures, args.seeds))
+    sys.exit(1 if failures else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,74 @@
+import sys
+import glob
+import argparse
+import collections
+
+from compiler import Lexer, Parser
+
+
+ControlFlow = {"jump", "jumpEqual", "call", "ret", "hlt"}
+
+
+def static_sequences(filepath):
+    # straight-line runs of the code section, split at labels and after branches
+    parser = Parser(Lexer(filepath))
+    parser.analyse()
+
+    labels = set(parser.code_labels.values())
+    sequence = []
+
+    for index, instruction in enumerate(parser.code_section):
+        if index in labels and sequence:
+            yield sequence
+            sequence = []
+
+        sequence.append(instruction[0])
+
+        if instruction[0] in ControlFlow:
+            yield sequence
+            sequence = []
+
+    if sequence:
+        yield sequence
+
+
+def trace_sequences(filepath):
+    # executed opcode names separated by whitespace, one trace per file
+    with open(filepath, "r") as handle:
+        yield handle.read().split()
+
+
+def count(sequences, lengths):
+    counter = collections.Counter()
+
+    for sequence in sequences:
+        for n in lengths:
+            for i in range(len(sequence) - n + 1):
+                counter[tuple(sequence[i:i + n])] += 1
+
+    return counter
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Frequent EVM2 opcode sequences")
+    parser.add_argument("sources", nargs="*", help="easm files (default *.easm)")
+    parser.add_argument("--trace", action="append", default=[], help="opcode trace file")
+    parser.add_argument("--min", type=int, default=2, help="shortest sequence")
+    parser.add_argument("--max", type=int, default=3, help="longest sequence")
+    parser.add_argument("--top", type=int, default=20, help="number of reported sequences")
+    args = parser.parse_args()
+
+    sequences = []
+    for filepath in args.sources or sorted(glob.glob("*.easm")):
+        sequences.extend(static_sequences(filepath))
+    for filepath in args.trace:
+        sequences.extend(trace_sequences(filepath))
+
+    counter = count(sequences, range(args.min, args.max + 1))
+
+    for sequence, hits in counter.most_common(args.top):
+        print("%8d  %s" % (hits, " + ".join(sequence)))
+
+
+if __name__ == "__main__":
+    main()
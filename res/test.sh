@@ -7,7 +7,7 @@ for src in *.easm; do
 
     echo "Running $src"
 
-    python compiler.py "$src" "$file"
+    ./test.elf --assemble "$file" "$src"
 
     if [[ -f "$input_file" ]]; then
         ./test.elf "$file" "$payload_file" < "$input_file" > "$output_file" 2>&1
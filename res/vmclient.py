@@ -0,0 +1,120 @@
+import os
+import sys
+import socket
+import argparse
+
+
+class Client:
+    # connection to test.elf --serve, see vm_server.h for the protocol
+
+    class Error(RuntimeError):
+        pass
+
+    def __init__(self, path):
+        self.__socket = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.__socket.connect(path)
+        self.__buffer = b""
+
+    def __read_line(self):
+        while b"\n" not in self.__buffer:
+            chunk = self.__socket.recv(65536)
+            if not chunk:
+                raise Client.Error("connection closed")
+            self.__buffer += chunk
+        line, self.__buffer = self.__buffer.split(b"\n", 1)
+        return line.decode()
+
+    def __read_bytes(self, size):
+        while len(self.__buffer) < size:
+            chunk = self.__socket.recv(65536)
+            if not chunk:
+                raise Client.Error("connection closed")
+            self.__buffer += chunk
+        data, self.__buffer = self.__buffer[:size], self.__buffer[size:]
+        return data
+
+    def __reply(self, expected):
+        line = self.__read_line()
+        kind, _, rest = line.partition(" ")
+        if kind != expected:
+            raise Client.Error(rest if kind == "error" else "unexpected reply: " + line)
+        return rest
+
+    def load(self, program):
+        self.__socket.sendall(("load %s\n" % os.path.abspath(program)).encode())
+        return self.__reply("ok")
+
+    def run(self, handle, payload=None, stdin=b"", output=None):
+        # streams console output into output, returns (exit code, ms, message)
+        payload = os.path.abspath(payload) if payload else "-"
+        self.__socket.sendall(("run %s %s %d\n" % (handle, payload, len(stdin))).encode() + stdin)
+        while True:
+            line = self.__read_line()
+            kind, _, rest = line.partition(" ")
+            if kind == "out":
+                data = self.__read_bytes(int(rest))
+                if output:
+                    output.write(data)
+                    output.flush()
+            elif kind == "exit":
+                code, ms, message = rest.split(" ", 2)
+                return int(code), float(ms), message
+            elif kind == "error":
+                raise Client.Error(rest)
+            else:
+                raise Client.Error("unexpected reply: " + line)
+
+    def stats(self):
+        self.__socket.sendall(b"stats\n")
+        fields = self.__reply("stats").split()
+        return dict(zip(fields[::2], fields[1::2]))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Client of the VM daemon (test.elf --serve <socket>)")
+    parser.add_argument("socket", help="socket path of the server")
+    commands = parser.add_subparsers(dest="command", required=True)
+
+    load = commands.add_parser("load", help="compile program, print its handle")
+    load.add_argument("program")
+
+    run = commands.add_parser("run", help="run program (handle or EVM2 file), console output to stdout")
+    run.add_argument("program")
+    run.add_argument("payload", nargs="?")
+    run.add_argument("--stdin", help="file with console input, - for stdin of the client")
+    run.add_argument("--repeat", type=int, default=1, help="number of runs")
+
+    commands.add_parser("stats", help="print server statistics")
+    args = parser.parse_args()
+
+    client = Client(args.socket)
+    try:
+        if args.command == "load":
+            print(client.load(args.program))
+
+        elif args.command == "run":
+            handle = client.load(args.program) if os.path.exists(args.program) else args.program
+            stdin = b""
+            if args.stdin == "-":
+                stdin = sys.stdin.buffer.read()
+            elif args.stdin:
+                with open(args.stdin, "rb") as handle_in:
+                    stdin = handle_in.read()
+
+            code = 0
+            for _ in range(args.repeat):
+                code, ms, message = client.run(handle, args.payload, stdin, sys.stdout.buffer)
+                print("%s (%.3f ms)" % (message, ms), file=sys.stderr)
+            sys.exit(code)
+
+        elif args.command == "stats":
+            for name, value in client.stats().items():
+                print("%-12s %s" % (name, value))
+
+    except Client.Error as exc:
+        print("Error: %s" % exc, file=sys.stderr)
+        sys.exit(2)
+
+
+if __name__ == "__main__":
+    main()
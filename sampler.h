@@ -0,0 +1,308 @@
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <cstdio>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <signal.h>
+#include <time.h>
+#include <sys/time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+/**
+ * Sampling profiler of guest code
+ *
+ * Every guest thread gets CPU time timer delivering SIGPROF to itself
+ * (timer_create with SIGEV_THREAD_ID, on systems without it process wide
+ * setitimer). Signal handler takes interrupted PC, when it points into JIT
+ * code it records the host instruction index together with guest call
+ * stack:
+ *   - native stack: frame chain of funcPrologue (x29 -> saved x29, x30)
+ *   - shadow stack: return addresses below x22
+ * Samples are stored into preallocated array, the handler only reserves
+ * slot with atomic increment.
+ *
+ * Report maps host indices back to EVM bit offsets through the Compile()
+ * mapping and aggregates hits per instruction, per guest function (self
+ * and total) and per call stack. Call stacks are also written in folded
+ * format (<file>.folded) for flame graph tools.
+ */
+class GuestSampler {
+public:
+    enum {
+        maxDepth = 32,
+        capacity = 1 << 16
+    };
+
+    struct Sample {
+        uint32_t depth;
+        uint32_t frames[maxDepth];      // host instruction indices, leaf first, then call sites
+    };
+
+    /**
+     * Timer of calling thread, lives for the time the thread runs guest code
+     */
+    class ThreadTimer {
+#ifdef __linux__
+        timer_t timer;
+        bool valid = false;
+#endif
+    public:
+        ThreadTimer() {
+#ifdef __linux__
+            if (!active)
+                return;
+            sigevent event = {};
+            event.sigev_notify = SIGEV_THREAD_ID;
+            event.sigev_signo = SIGPROF;
+            event.sigev_notify_thread_id = (pid_t)syscall(SYS_gettid);
+            if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &timer) != 0)
+                return;
+            valid = true;
+            long ns = active->intervalUs * 1000;
+            itimerspec spec = {{ns / 1000000000, ns % 1000000000}, {ns / 1000000000, ns % 1000000000}};
+            timer_settime(timer, 0, &spec, nullptr);
+#endif
+        }
+
+        ~ThreadTimer() {
+#ifdef __linux__
+            if (valid)
+                timer_delete(timer);
+#endif
+        }
+
+        ThreadTimer(const ThreadTimer&) = delete;
+        ThreadTimer& operator=(const ThreadTimer&) = delete;
+    };
+
+private:
+    static inline GuestSampler* active = nullptr;
+    static inline thread_local const uint64_t* shadowBase = nullptr;
+    static inline thread_local size_t shadowSize = 0;
+
+    uintptr_t codeStart;
+    uintptr_t codeEnd;
+    size_t entry;
+    long intervalUs;
+    std::vector<Sample> samples;
+    std::atomic<size_t> count = 0;
+    std::atomic<size_t> hostSamples = 0;
+
+    bool inCode(uint64_t address) const {
+        return address >= codeStart && address < codeEnd;
+    }
+
+    static bool readContext(void* context, uint64_t& pc, uint64_t& fp, uint64_t& sp, uint64_t& x22) {
+        ucontext_t* uc = (ucontext_t*)context;
+#if defined(__APPLE__) && defined(__aarch64__)
+        pc = uc->uc_mcontext->__ss.__pc;
+        fp = uc->uc_mcontext->__ss.__fp;
+        sp = uc->uc_mcontext->__ss.__sp;
+        x22 = uc->uc_mcontext->__ss.__x[22];
+        return true;
+#elif defined(__linux__) && defined(__aarch64__)
+        pc = uc->uc_mcontext.pc;
+        fp = uc->uc_mcontext.regs[29];
+        sp = uc->uc_mcontext.sp;
+        x22 = uc->uc_mcontext.regs[22];
+        return true;
+#else
+        (void)uc; (void)pc; (void)fp; (void)sp; (void)x22;
+        return false;
+#endif
+    }
+
+    static void handler(int, siginfo_t*, void* context) {
+        GuestSampler* s = active;
+        uint64_t pc, fp, sp, x22;
+        if (!s || !readContext(context, pc, fp, sp, x22))
+            return;
+        if (!s->inCode(pc))
+        {
+            s->hostSamples.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        size_t slot = s->count.fetch_add(1, std::memory_order_relaxed);
+        if (slot >= s->samples.size())
+            return;
+
+        Sample& sample = s->samples[slot];
+        uint32_t depth = 0;
+        size_t index = (pc - s->codeStart) / 4;
+        sample.frames[depth++] = (uint32_t)index;
+
+        // x29/x22 belong to generated code only behind the main prologue
+        if (index >= s->entry && shadowBase)
+        {
+            const uint64_t* top = (const uint64_t*)x22;
+            if (top > shadowBase && top <= shadowBase + shadowSize / 8)
+                for (const uint64_t* p = top - 1; p > shadowBase && depth < maxDepth && s->inCode(*p); p--)
+                    sample.frames[depth++] = (uint32_t)((*p - s->codeStart) / 4 - 1);
+        }
+        else if (index >= s->entry)
+        {
+            // frames are on this thread stack, anything else is not followed
+            const uint64_t stackLimit = 8 << 20;
+            while (depth < maxDepth && fp >= sp && fp < sp + stackLimit && fp % 16 == 0)
+            {
+                const uint64_t* frame = (const uint64_t*)fp;
+                if (!s->inCode(frame[1]))
+                    break;
+                sample.frames[depth++] = (uint32_t)((frame[1] - s->codeStart) / 4 - 1);
+                if (frame[0] <= fp)
+                    break;
+                fp = frame[0];
+            }
+        }
+        sample.depth = depth;
+    }
+
+public:
+    GuestSampler(const void* code, size_t codeSize, size_t entryIndex, long interval = 1000)
+        : codeStart((uintptr_t)code), codeEnd((uintptr_t)code + codeSize), entry(entryIndex),
+          intervalUs(interval), samples(capacity) {}
+
+    /**
+     * Shadow stack of calling thread, walked instead of frame chain
+     */
+    static void setShadowStack(const uint64_t* base, size_t bytes) {
+        shadowBase = base;
+        shadowSize = bytes;
+    }
+
+    void start() {
+        struct sigaction sa = {};
+        sa.sa_sigaction = handler;
+        sa.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGPROF, &sa, nullptr);
+        active = this;
+#ifndef __linux__
+        itimerval spec = {{0, (int)intervalUs}, {0, (int)intervalUs}};
+        setitimer(ITIMER_PROF, &spec, nullptr);
+#endif
+    }
+
+    void stop() {
+#ifndef __linux__
+        itimerval spec = {};
+        setitimer(ITIMER_PROF, &spec, nullptr);
+#endif
+        active = nullptr;
+    }
+
+    /**
+     * Write report to filename and folded call stacks to filename.folded
+     */
+    bool write(const std::string& filename, const std::vector<EVM2::Instruction>& instructions,
+               const JITMapping& mapping) const {
+        // host index -> instruction, instructions occupy contiguous ranges
+        std::vector<std::pair<size_t, size_t>> starts;
+        for (size_t k = 0; k < instructions.size(); k++)
+        {
+            if (auto it = mapping.find(instructions[k].bitOffset); it != mapping.end())
+                starts.push_back({it->second, k});
+        }
+        std::stable_sort(starts.begin(), starts.end());
+        auto instructionAt = [&](size_t index) -> size_t {
+            auto it = std::upper_bound(starts.begin(), starts.end(), std::make_pair(index, SIZE_MAX));
+            return it == starts.begin() ? SIZE_MAX : std::prev(it)->second;
+        };
+
+        // guest function of every instruction, body runs from CALL target to the next one
+        std::set<EVM2::Arg::addr_t> functions, threads;
+        for (const EVM2::Instruction& i : instructions)
+        {
+            if (i.opcode == EVM2::Op::CALL)
+                functions.insert(i.args[0].addr);
+            else if (i.opcode == EVM2::Op::CREATETHREAD)
+                threads.insert(i.args[0].addr);
+        }
+        std::vector<std::string> functionOf(instructions.size());
+        std::string current = "evm_main";
+        for (size_t k = 0; k < instructions.size(); k++)
+        {
+            EVM2::Arg::addr_t bitOffset = instructions[k].bitOffset;
+            if (functions.contains(bitOffset))
+                current = "evm_func_" + std::to_string(bitOffset);
+            else if (threads.contains(bitOffset))
+                current = "evm_thread_" + std::to_string(bitOffset);
+            functionOf[k] = current;
+        }
+        auto functionAt = [&](size_t index) -> std::string {
+            size_t k = instructionAt(index);
+            return k == SIZE_MAX ? "evm_prologue" : functionOf[k];
+        };
+
+        size_t taken = std::min(count.load(), samples.size());
+        std::map<size_t, uint64_t> instructionHits;
+        std::map<std::string, std::pair<uint64_t, uint64_t>> functionHits;     // self, total
+        std::map<std::string, uint64_t> stacks;
+        for (size_t n = 0; n < taken; n++)
+        {
+            const Sample& sample = samples[n];
+            instructionHits[instructionAt(sample.frames[0])]++;
+
+            std::string folded;
+            std::set<std::string> seen;
+            for (size_t d = sample.depth; d-- > 0;)
+            {
+                std::string function = functionAt(sample.frames[d]);
+                folded += (folded.empty() ? "" : ";") + function;
+                if (seen.insert(function).second)
+                    functionHits[function].second++;
+            }
+            functionHits[functionAt(sample.frames[0])].first++;
+            stacks[folded]++;
+        }
+
+        FILE* f = fopen(filename.c_str(), "w");
+        if (!f)
+            return false;
+        fprintf(f, "# samples: %zu in guest code, %zu in host calls, %zu dropped, interval %ld us\n",
+                taken, hostSamples.load(), count.load() - taken, intervalUs);
+
+        auto byHits = [](const auto& a, const auto& b) { return a.second > b.second; };
+        std::vector<std::pair<size_t, uint64_t>> instructionList(instructionHits.begin(), instructionHits.end());
+        std::stable_sort(instructionList.begin(), instructionList.end(), byHits);
+        fprintf(f, "\n# instructions\n%10s %7s %10s  %-24s %s\n", "hits", "%", "bit offset", "function", "instruction");
+        for (const auto& [k, hits] : instructionList)
+        {
+            double percent = 100.0 * hits / taken;
+            if (k == SIZE_MAX)
+                fprintf(f, "%10" PRIu64 " %7.2f %10s  %-24s\n", hits, percent, "-", "evm_prologue");
+            else
+                fprintf(f, "%10" PRIu64 " %7.2f %10u  %-24s %s\n", hits, percent, (unsigned)instructions[k].bitOffset,
+                        functionOf[k].c_str(), EVM2::opToString(instructions[k].opcode).c_str());
+        }
+
+        std::vector<std::pair<std::string, std::pair<uint64_t, uint64_t>>> functionList(functionHits.begin(), functionHits.end());
+        std::stable_sort(functionList.begin(), functionList.end(), byHits);
+        fprintf(f, "\n# functions\n%10s %10s  %s\n", "self", "total", "function");
+        for (const auto& [function, hits] : functionList)
+            fprintf(f, "%10" PRIu64 " %10" PRIu64 "  %s\n", hits.first, hits.second, function.c_str());
+
+        std::vector<std::pair<std::string, uint64_t>> stackList(stacks.begin(), stacks.end());
+        std::stable_sort(stackList.begin(), stackList.end(), byHits);
+        fprintf(f, "\n# call stacks\n");
+        for (const auto& [stack, hits] : stackList)
+            fprintf(f, "%10" PRIu64 "  %s\n", hits, stack.c_str());
+        bool valid = fclose(f) == 0;
+
+        FILE* folded = fopen((filename + ".folded").c_str(), "w");
+        if (!folded)
+            return false;
+        for (const auto& [stack, hits] : stacks)
+            fprintf(folded, "%s %" PRIu64 "\n", stack.c_str(), hits);
+        return fclose(folded) == 0 && valid;
+    }
+};
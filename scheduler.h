@@ -0,0 +1,313 @@
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+/**
+ * Deterministic scheduling of guest threads for reproducible runs
+ *
+ * Only the thread holding the turn runs guest code. At every host call
+ * the turn goes to a runnable thread picked by a seeded generator, threads
+ * sleeping, waiting for a lock or joining are not runnable. The same seed
+ * and input give the same interleaving, console output and lock order.
+ *
+ * Sleeps and thread timeouts run in scheduler time: guest code takes no
+ * time, when no thread is runnable the time jumps to the nearest wake-up
+ * or timeout. Guests computing without host calls still time out in real
+ * time, the only point where a run can differ.
+ *
+ * Record log has a line "<decision> <thread>" for every decision giving
+ * the turn to another thread, replay follows it and falls back to the
+ * seed when the run diverges (different program or input). The run ends
+ * with the main thread, other threads do not get the turn after it.
+ */
+class DeterministicScheduler {
+    enum class State {
+        runnable,
+        sleeping,
+        lock,
+        join
+    };
+
+    struct Thread {
+        State state = State::runnable;
+        uint64_t waitFor = 0;           // lock ID or joined thread
+        uint64_t wakeNs = 0;
+        uint64_t softNs = 0;
+        uint64_t hardNs = 0;
+        bool softFired = false;
+        std::function<void()> onSoft;
+        std::function<void()> onHard;
+        std::condition_variable turn;
+    };
+
+    std::mutex mutex;
+    std::map<uint64_t, Thread> threads;     // ordered, candidates in thread ID order
+    uint64_t running = 0;
+    uint64_t mainThread = 0;
+    bool finished = false;                  // main thread ended, the rest never runs again
+    uint64_t nowNs = 0;
+    uint64_t decisions = 0;
+    uint64_t switches = 0;
+    std::mt19937_64 random;
+    FILE* record = nullptr;
+    std::vector<std::pair<uint64_t, uint64_t>> replay;
+    size_t replayPos = 0;
+    bool replaying = false;
+
+    static inline thread_local uint64_t current = 0;
+
+    uint64_t choose(const std::vector<uint64_t>& candidates) {
+        uint64_t decision = decisions++;
+        uint64_t chosen = 0;
+        if (replaying)
+        {
+            chosen = running;
+            if (replayPos < replay.size() && replay[replayPos].first == decision)
+                chosen = replay[replayPos++].second;
+            if (std::find(candidates.begin(), candidates.end(), chosen) == candidates.end())
+            {
+                fprintf(stderr, "[Scheduler] Replay diverges at decision %llu, continuing with seed\n", (unsigned long long)decision);
+                replaying = false;
+            }
+        }
+        if (!replaying)
+            chosen = candidates[random() % candidates.size()];
+        if (chosen != running)
+        {
+            switches++;
+            if (record)
+                fprintf(record, "%llu %llu\n", (unsigned long long)decision, (unsigned long long)chosen);
+        }
+        return chosen;
+    }
+
+    /**
+     * Time jumps to the nearest wake-up or timeout, false when there is none (deadlock)
+     */
+    bool advance() {
+        uint64_t next = UINT64_MAX;
+        for (auto& [tid, thread] : threads)
+        {
+            if (thread.state == State::sleeping)
+                next = std::min(next, thread.wakeNs);
+            next = std::min(next, thread.softFired ? thread.hardNs : thread.softNs);
+        }
+        if (next == UINT64_MAX)
+            return false;
+        nowNs = std::max(nowNs, next);
+        for (auto& [tid, thread] : threads)
+        {
+            if (thread.state == State::sleeping && thread.wakeNs <= nowNs)
+                thread.state = State::runnable;
+            if (!thread.softFired && thread.softNs <= nowNs)
+            {
+                thread.softFired = true;
+                thread.onSoft();
+            }
+            if (thread.hardNs <= nowNs)
+                thread.onHard();
+        }
+        return true;
+    }
+
+    /**
+     * Give the turn to the next thread, called by the thread holding it
+     */
+    void dispatch() {
+        while (!finished)
+        {
+            std::vector<uint64_t> candidates;
+            for (auto& [tid, thread] : threads)
+            {
+                if (thread.state == State::runnable)
+                    candidates.push_back(tid);
+            }
+            if (!candidates.empty())
+            {
+                running = choose(candidates);
+                threads[running].turn.notify_one();
+                return;
+            }
+            if (!advance())
+                break;
+        }
+        running = 0;
+    }
+
+    void waitTurn(std::unique_lock<std::mutex>& lock) {
+        Thread& thread = threads.at(current);
+        thread.turn.wait(lock, [&]() { return running == current; });
+    }
+
+    void block(State state, uint64_t waitFor) {
+        std::unique_lock<std::mutex> lock(mutex);
+        Thread& thread = threads.at(current);
+        thread.state = state;
+        thread.waitFor = waitFor;
+        dispatch();
+        waitTurn(lock);
+    }
+
+public:
+    static inline DeterministicScheduler* active = nullptr;
+
+    /**
+     * Empty file names for no record or replay
+     */
+    DeterministicScheduler(uint64_t seed, const std::string& recordFile, const std::string& replayFile) : random(seed) {
+        if (!replayFile.empty())
+        {
+            FILE* f = fopen(replayFile.c_str(), "r");
+            assert(f);
+            char line[256];
+            while (fgets(line, sizeof(line), f))
+            {
+                unsigned long long decision, tid;
+                if (line[0] != '#' && sscanf(line, "%llu %llu", &decision, &tid) == 2)
+                    replay.emplace_back(decision, tid);
+            }
+            fclose(f);
+            replaying = true;
+        }
+        if (!recordFile.empty())
+        {
+            record = fopen(recordFile.c_str(), "w");
+            assert(record);
+            fprintf(record, "# seed %llu\n", (unsigned long long)seed);
+        }
+    }
+
+    /**
+     * Guest thread created with its timeouts, runnable from now, the main
+     * thread runs when the host joins it
+     */
+    void threadCreated(uint64_t tid, uint64_t softMs, uint64_t hardMs, std::function<void()> onSoft, std::function<void()> onHard) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!mainThread)
+            mainThread = tid;
+        Thread& thread = threads[tid];
+        thread.softNs = nowNs + softMs * 1000000;
+        thread.hardNs = nowNs + hardMs * 1000000;
+        thread.onSoft = onSoft;
+        thread.onHard = onHard;
+    }
+
+    /**
+     * Called on the native thread running guest code, waits for its turn
+     */
+    void threadStart(uint64_t tid) {
+        std::unique_lock<std::mutex> lock(mutex);
+        current = tid;
+        waitTurn(lock);
+    }
+
+    /**
+     * Thread finished, the turn is kept until its exit is reported
+     */
+    void threadEnd(uint64_t tid) {
+        std::lock_guard<std::mutex> lock(mutex);
+        threads.erase(tid);
+        finished = finished || tid == mainThread;
+        for (auto& [other, thread] : threads)
+        {
+            if (thread.state == State::join && thread.waitFor == tid)
+                thread.state = State::runnable;
+        }
+        if (running == tid)
+            dispatch();
+    }
+
+    /**
+     * Real time timeout of the thread, fired unless scheduler time did it
+     */
+    void expire(uint64_t tid, bool hard) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = threads.find(tid);
+        if (found == threads.end())
+            return;
+        if (hard)
+            found->second.onHard();
+        else if (!found->second.softFired)
+        {
+            found->second.softFired = true;
+            found->second.onSoft();
+        }
+    }
+
+    /**
+     * Switch point at host call
+     */
+    static void hostCall() {
+        if (DeterministicScheduler* scheduler = active; scheduler && current)
+        {
+            std::unique_lock<std::mutex> lock(scheduler->mutex);
+            scheduler->dispatch();
+            scheduler->waitTurn(lock);
+        }
+    }
+
+    static bool guestThread() {
+        return current != 0;
+    }
+
+    void sleep(uint64_t milliseconds) {
+        std::unique_lock<std::mutex> lock(mutex);
+        Thread& thread = threads.at(current);
+        thread.state = State::sleeping;
+        thread.wakeNs = nowNs + milliseconds * 1000000;
+        dispatch();
+        waitTurn(lock);
+    }
+
+    /**
+     * Lock held by another thread, runnable again after its unlock
+     */
+    void waitLock(uint64_t lockId) {
+        block(State::lock, lockId);
+    }
+
+    void unlocked(uint64_t lockId) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& [tid, thread] : threads)
+        {
+            if (thread.state == State::lock && thread.waitFor == lockId)
+                thread.state = State::runnable;
+        }
+    }
+
+    /**
+     * Join, host caller starts the run and waits outside the scheduler
+     */
+    void waitThread(uint64_t tid) {
+        if (!current)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!running && !finished)
+                dispatch();
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!threads.count(tid))
+                return;
+        }
+        block(State::join, tid);
+    }
+
+    /**
+     * Summary on stderr, record log flushed
+     */
+    void finish() {
+        std::lock_guard<std::mutex> lock(mutex);
+        fprintf(stderr, "[Scheduler] %llu decisions, %llu switches, %.3f ms of scheduler time\n",
+                (unsigned long long)decisions, (unsigned long long)switches, nowNs / 1e6);
+        if (record)
+            fflush(record);
+    }
+};
@@ -14,6 +14,7 @@
 #include <chrono>
 #include <memory>
 #include <future>
+#include <optional>
 
 class ThreadBase {
 public:
@@ -40,6 +41,7 @@ private:
     static std::atomic<uint64_t> threadCounter;
     static std::mutex gThreadRegistryMutex;
     static std::unordered_map<uint64_t, std::shared_ptr<CThread>> gThreadRegistry;
+    static std::condition_variable gThreadRegistryChanged;
     static std::mutex syncObjectsMutex;
     static std::unordered_map<uint64_t, std::unique_ptr<std::mutex>> mutexMap;
 
@@ -53,6 +55,7 @@ private:
         std::lock_guard<std::mutex> lock(gThreadRegistryMutex);
         fprintf(stderr, "[GLOBAL] unregister threadId %lld\n", threadId);
         gThreadRegistry.erase(threadId);
+        gThreadRegistryChanged.notify_all();
     }
 
 public:
@@ -62,7 +65,11 @@ public:
     
     ~CThread() {
         if (nativeThread.joinable()) {
-            nativeThread.join();
+            // last reference can be dropped by unregisterThread of the thread itself
+            if (nativeThread.get_id() == std::this_thread::get_id())
+                nativeThread.detach();
+            else
+                nativeThread.join();
         }
     }
     
@@ -79,7 +86,22 @@ public:
         pthread_attr_setstacksize(&attr, maxStack);
                 
         registerThread();
-        nativeThread = std::thread([this]() {
+        auto softTimeout = [this]() {
+            fprintf(stderr, "[Thread %lld] Execution timeout\n", threadId);
+            std::lock_guard<std::mutex> lock(gThreadRegistryMutex);
+            shouldStop = true;
+            gThreadRegistryChanged.notify_all();
+        };
+        auto hardTimeout = [this]() {
+            fprintf(stderr, "[Thread %lld] Not responding, terminating\n", threadId);
+            exit(1);
+        };
+        if (VirtualClock::active)
+            VirtualClock::active->threadCreated(threadId, timeoutSoftMs, timeoutHardMs, softTimeout, hardTimeout);
+        if (DeterministicScheduler::active)
+            DeterministicScheduler::active->threadCreated(threadId, timeoutSoftMs, timeoutHardMs, softTimeout, hardTimeout);
+        uint64_t traceStart = TraceEvents::active ? TraceEvents::active->now() : 0;
+        nativeThread = std::thread([this, traceStart, softTimeout, hardTimeout]() {
             currentThreadId = threadId;
             
             // Execute with timeout using async
@@ -87,19 +109,40 @@ public:
                 // Set for async thread too, two threads share the same CThread obj
                 // Ugly, but std::async doesn't allow setting stack size limit
                 currentThreadId = threadId;
-                return config->run(threadId);
+                if (DeterministicScheduler::active)
+                    DeterministicScheduler::active->threadStart(threadId);
+                VirtualClock* clock = VirtualClock::active;
+                if (!clock)
+                    return config->run(threadId);
+                clock->threadStart();
+                int result = config->run(threadId);
+                clock->threadEnd(threadId);
+                return result;
             });
             
-            auto status = future.wait_for(std::chrono::milliseconds {timeoutSoftMs});
-            if (status == std::future_status::timeout) {
-                fprintf(stderr, "[Thread %lld] Execution timeout\n", threadId);
-                shouldStop = true;
-                auto status = future.wait_for(std::chrono::milliseconds {timeoutHardMs - timeoutSoftMs});
-                if (status == std::future_status::timeout) {
-                    fprintf(stderr, "[Thread %lld] Not responding, terminating\n", threadId);
-                    exit(1);
+            // virtual clock fires timeouts in virtual time, deterministic scheduler in its own time first
+            auto waitFor = [&future, this](uint64_t ms) {
+                if (VirtualClock* clock = VirtualClock::active) {
+                    clock->waitEnd(threadId);
+                    return std::future_status::ready;
                 }
-            } else {
+                return future.wait_for(std::chrono::milliseconds {ms});
+            };
+            auto expire = [&](bool hard) {
+                if (DeterministicScheduler* scheduler = DeterministicScheduler::active)
+                    scheduler->expire(threadId, hard);
+                else if (hard)
+                    hardTimeout();
+                else
+                    softTimeout();
+            };
+            auto status = waitFor(timeoutSoftMs);
+            if (status == std::future_status::timeout) {
+                expire(false);
+                auto status = waitFor(timeoutHardMs - timeoutSoftMs);
+                if (status == std::future_status::timeout)
+                    expire(true);
+            } else if (!shouldStop) {
                 int result = future.get();
                 if (result == 1) {
                     fprintf(stderr, "[Thread %lld] Halted via terminate\n", threadId);
@@ -108,7 +151,13 @@ public:
                 }
             }
             
+            if (TraceEvents* trace = TraceEvents::active)
+                trace->complete("thread", "thread", threadId, traceStart, trace->now());
+            // turn of the deterministic scheduler is passed on after the exit is reported
+            uint64_t tid = threadId;
             unregisterThread();
+            if (DeterministicScheduler::active)
+                DeterministicScheduler::active->threadEnd(tid);
         });
         
         pthread_attr_destroy(&attr);
@@ -118,11 +167,44 @@ public:
     // Wait for thread to complete
     void join() {
         assert(nativeThread.joinable());
+        TraceEvents::Scope traceScope("join", "sync", currentThreadId, "thread", threadId);
         fprintf(stderr, "[Thread %lld] Joining...\n", threadId);
+        if (VirtualClock::active)
+            VirtualClock::active->joining(threadId);
+        if (DeterministicScheduler::active)
+            DeterministicScheduler::active->waitThread(threadId);
         nativeThread.join();
         fprintf(stderr, "[Thread %lld] Join done...\n", threadId);
     }
 
+    /**
+     * Wait for guest threads still running after the main one, returns how
+     * many are left. Threads past their soft timeout get half of the time to
+     * the hard one to stop, so the wait ends before a hard timeout would
+     * terminate the VM.
+     */
+    static size_t waitFinished() {
+        std::unique_lock<std::mutex> lock(gThreadRegistryMutex);
+        std::optional<std::chrono::steady_clock::time_point> deadline;
+        while (!gThreadRegistry.empty())
+        {
+            bool stopping = true;
+            for (const auto& [tid, thread] : gThreadRegistry)
+                stopping = stopping && thread->shouldStop;
+            if (!stopping)
+            {
+                deadline.reset();
+                gThreadRegistryChanged.wait(lock);
+                continue;
+            }
+            if (!deadline)
+                deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds {(timeoutHardMs - timeoutSoftMs) / 2};
+            if (gThreadRegistryChanged.wait_until(lock, *deadline) == std::cv_status::timeout)
+                break;
+        }
+        return gThreadRegistry.size();
+    }
+
     // guarantees validity of returned object
     static std::shared_ptr<CThread> getCurrent()
     {
@@ -154,7 +236,34 @@ public:
         auto* mtx = mutexMap[lockId].get();
         registryLock.unlock();
         
-        mtx->lock();
+        LockStats* stats = LockStats::active;
+        TraceEvents* trace = TraceEvents::active;
+        VirtualClock* clock = VirtualClock::active;
+        DeterministicScheduler* scheduler = DeterministicScheduler::active;
+        if (stats || trace || clock || scheduler) {
+            auto start = std::chrono::steady_clock::now();
+            uint64_t traceStart = trace ? trace->now() : 0;
+            bool contended = !mtx->try_lock();
+            if (contended && scheduler) {
+                // holder runs only when this thread gives up the turn
+                do {
+                    scheduler->waitLock(lockId);
+                } while (!mtx->try_lock());
+            } else if (contended && clock) {
+                clock->lock(lockId, *mtx);
+            } else if (contended) {
+                mtx->lock();
+            }
+            if (stats)
+                stats->acquired(lockId, threadId, contended, std::chrono::steady_clock::now() - start);
+            if (trace) {
+                if (contended)
+                    trace->complete("lock wait", "sync", threadId, traceStart, trace->now(), "lock", lockId);
+                trace->asyncBegin("lock hold", "sync", threadId, lockId);
+            }
+        } else {
+            mtx->lock();
+        }
         fprintf(stderr, "[Thread %lld] Locked object %llu\n", threadId, lockId);
     }
     
@@ -164,7 +273,15 @@ public:
         auto it = mutexMap.find(lockId);
         if (it != mutexMap.end()) {
             fprintf(stderr, "[Thread %lld] Unlocking object %llu\n", threadId, lockId);
+            if (LockStats::active)
+                LockStats::active->released(lockId);
+            if (TraceEvents::active)
+                TraceEvents::active->asyncEnd("lock hold", "sync", threadId, lockId);
             it->second->unlock();
+            if (VirtualClock::active)
+                VirtualClock::active->unlocked(lockId);
+            if (DeterministicScheduler::active)
+                DeterministicScheduler::active->unlocked(lockId);
         } else {
             fprintf(stderr, "[Thread %lld] Warning: Unlock on non-existent lock %llu\n", threadId, lockId);
         }
@@ -175,6 +292,7 @@ public:
 thread_local uint64_t CThread::currentThreadId = 10;
 std::mutex CThread::gThreadRegistryMutex;
 std::unordered_map<uint64_t, std::shared_ptr<CThread>> CThread::gThreadRegistry;
+std::condition_variable CThread::gThreadRegistryChanged;
 std::mutex CThread::syncObjectsMutex;
 std::unordered_map<uint64_t, std::unique_ptr<std::mutex>> CThread::mutexMap;
 std::atomic<uint64_t> CThread::threadCounter{1};
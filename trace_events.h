@@ -0,0 +1,155 @@
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+/**
+ * Timeline of VM activity in Chrome trace-event JSON format (Perfetto,
+ * chrome://tracing)
+ *
+ * Events are keyed by guest thread id:
+ *   - thread: lifetime of guest thread, from CThread::run to unregister
+ *   - lock wait: contended LOCK until the mutex is taken
+ *   - lock hold: async event from LOCK to UNLOCK with the lock id as its
+ *     id (holds of different locks do not have to nest)
+ *   - sleep, join, file read/write, console read/write: host call spans
+ * Every native thread appends to its own buffer, buffers are only joined
+ * when the trace is written at exit. Writing closes the trace, events of
+ * threads still running after that are dropped.
+ */
+class TraceEvents {
+public:
+    struct Event {
+        const char* name;
+        const char* category;
+        char phase;                 // X complete, b/e async begin/end
+        uint64_t tid;
+        uint64_t startNs;
+        uint64_t durationNs;
+        const char* argName;        // nullptr without argument
+        uint64_t arg;
+    };
+
+    /**
+     * Complete event covering lifetime of the scope
+     */
+    class Scope {
+        TraceEvents* trace;
+        const char* name;
+        const char* category;
+        uint64_t tid;
+        const char* argName;
+        uint64_t arg;
+        uint64_t start;
+    public:
+        Scope(const char* eventName, const char* eventCategory, uint64_t threadId, const char* argumentName = nullptr,
+              uint64_t argument = 0) : trace(active), name(eventName), category(eventCategory), tid(threadId),
+                                       argName(argumentName), arg(argument), start(trace ? trace->now() : 0) {}
+
+        ~Scope() {
+            if (trace)
+                trace->complete(name, category, tid, start, trace->now(), argName, arg);
+        }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    };
+
+    static inline TraceEvents* active = nullptr;
+
+private:
+    // mutex of the owning thread is uncontended until the trace is written
+    struct Buffer {
+        std::mutex mutex;
+        std::vector<Event> events;
+    };
+
+    static inline thread_local TraceEvents* bufferOwner = nullptr;
+    static inline thread_local Buffer* buffer = nullptr;
+
+    std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+    std::mutex buffersMutex;
+    std::vector<std::unique_ptr<Buffer>> buffers;
+    std::atomic<bool> closed{false};
+
+    void record(const Event& event) {
+        if (bufferOwner != this)
+        {
+            std::lock_guard<std::mutex> guard(buffersMutex);
+            buffers.push_back(std::make_unique<Buffer>());
+            buffers.back()->events.reserve(1024);
+            buffer = buffers.back().get();
+            bufferOwner = this;
+        }
+        std::lock_guard<std::mutex> guard(buffer->mutex);
+        if (!closed)
+            buffer->events.push_back(event);
+    }
+
+public:
+    uint64_t now() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count();
+    }
+
+    void complete(const char* name, const char* category, uint64_t tid, uint64_t startNs, uint64_t endNs,
+                  const char* argName = nullptr, uint64_t arg = 0) {
+        record({name, category, 'X', tid, startNs, endNs - startNs, argName, arg});
+    }
+
+    void asyncBegin(const char* name, const char* category, uint64_t tid, uint64_t id) {
+        record({name, category, 'b', tid, now(), 0, nullptr, id});
+    }
+
+    void asyncEnd(const char* name, const char* category, uint64_t tid, uint64_t id) {
+        record({name, category, 'e', tid, now(), 0, nullptr, id});
+    }
+
+    /**
+     * Join buffers of all threads into trace file, later events are dropped
+     */
+    bool write(const std::string& filename) {
+        std::lock_guard<std::mutex> guard(buffersMutex);
+        closed = true;
+        // event being recorded is finished under the buffer mutex, later ones see closed
+        for (const auto& events : buffers)
+            std::lock_guard<std::mutex> fence(events->mutex);
+        FILE* f = fopen(filename.c_str(), "w");
+        if (!f)
+            return false;
+        int pid = (int)getpid();
+        fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+        fprintf(f, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": 0, \"args\": {\"name\": \"evm2\"}}", pid);
+        std::set<uint64_t> threads;
+        for (const auto& events : buffers)
+            for (const Event& e : events->events)
+                threads.insert(e.tid);
+        for (uint64_t tid : threads)
+            fprintf(f, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %" PRIu64
+                    ", \"args\": {\"name\": \"guest thread %" PRIu64 "\"}}", pid, tid, tid);
+        for (const auto& events : buffers)
+        {
+            for (const Event& e : events->events)
+            {
+                fprintf(f, ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"%c\", \"pid\": %d, \"tid\": %" PRIu64
+                        ", \"ts\": %.3f", e.name, e.category, e.phase, pid, e.tid, e.startNs / 1e3);
+                if (e.phase == 'X')
+                {
+                    fprintf(f, ", \"dur\": %.3f", e.durationNs / 1e3);
+                    if (e.argName)
+                        fprintf(f, ", \"args\": {\"%s\": %" PRIu64 "}", e.argName, e.arg);
+                }
+                else
+                    fprintf(f, ", \"id\": %" PRIu64, e.arg);
+                fprintf(f, "}");
+            }
+        }
+        fprintf(f, "\n]}\n");
+        return fclose(f) == 0;
+    }
+};
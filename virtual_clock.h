@@ -0,0 +1,234 @@
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+
+/**
+ * Virtual time of the VM, guest sleeps are fast-forwarded
+ *
+ * Virtual time runs with real time while any guest thread computes.
+ * Sleeping threads register their wake-up, every thread its soft and hard
+ * timeout. Threads waiting for a lock or join are idle until the unlock or
+ * the end of the joined thread, which makes them runnable at once. When
+ * every guest thread is sleeping or idle, the time jumps to the nearest
+ * wake-up or timeout, so the program sees the same passage of time
+ * without waiting for it.
+ */
+class VirtualClock {
+    typedef std::chrono::steady_clock Clock;
+
+    struct Thread {
+        uint64_t softNs = 0;
+        uint64_t hardNs = 0;
+        bool softFired = false;
+        bool finished = false;
+        size_t joiners = 0;             // idle guest threads joining this one
+        std::function<void()> onSoft;
+        std::function<void()> onHard;
+    };
+
+    struct Lock {
+        uint64_t unlocks = 0;
+        size_t waiters = 0;             // idle guest threads
+    };
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::map<uint64_t, Thread> threads;
+    std::map<uint64_t, Lock> locks;
+    std::multimap<uint64_t, bool*> sleepers;    // virtual ns, still idle
+    uint64_t offsetNs = 0;                      // skipped time
+    size_t running = 0;                         // created and not finished guest threads
+    size_t idle = 0;                            // of them sleeping or waiting
+    Clock::time_point started = Clock::now();
+
+    static inline thread_local bool guest = false;
+
+    uint64_t nowLocked() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - started).count() + offsetNs;
+    }
+
+    Clock::time_point realTime(uint64_t virtualNs) const {
+        return started + std::chrono::nanoseconds(virtualNs > offsetNs ? virtualNs - offsetNs : 0);
+    }
+
+    static uint64_t nextTimeout(const Thread& thread) {
+        return thread.finished ? UINT64_MAX : thread.softFired ? thread.hardNs : thread.softNs;
+    }
+
+    void fireTimeouts(Thread& thread, uint64_t now) {
+        if (thread.finished)
+            return;
+        if (!thread.softFired && thread.softNs <= now)
+        {
+            thread.softFired = true;
+            thread.onSoft();
+        }
+        if (thread.hardNs <= now)
+            thread.onHard();
+    }
+
+    /**
+     * Nothing can run before the nearest wake-up or timeout, skip to it
+     */
+    void jumpIfIdle() {
+        while (running && idle == running)
+        {
+            uint64_t next = UINT64_MAX;
+            for (const auto& [deadline, waiting] : sleepers)
+            {
+                if (*waiting)
+                {
+                    next = deadline;
+                    break;
+                }
+            }
+            for (const auto& [tid, thread] : threads)
+                next = std::min(next, nextTimeout(thread));
+            if (next == UINT64_MAX)
+                return;
+            uint64_t now = nowLocked();
+            if (next > now)
+                offsetNs += next - now;
+            now = std::max(now, next);
+
+            for (auto it = sleepers.begin(); it != sleepers.end() && it->first <= now; ++it)
+            {
+                if (*it->second)
+                {
+                    *it->second = false;
+                    idle--;
+                }
+            }
+            for (auto& [tid, thread] : threads)
+                fireTimeouts(thread, now);
+            wake.notify_all();
+        }
+    }
+
+public:
+    static inline VirtualClock* active = nullptr;
+
+    uint64_t now() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return nowLocked();
+    }
+
+    /**
+     * Guest thread created with its timeouts, counts as running until threadEnd
+     */
+    void threadCreated(uint64_t tid, uint64_t softMs, uint64_t hardMs, std::function<void()> onSoft, std::function<void()> onHard) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Thread& thread = threads[tid];
+        uint64_t now = nowLocked();
+        thread.softNs = now + softMs * 1000000;
+        thread.hardNs = now + hardMs * 1000000;
+        thread.onSoft = onSoft;
+        thread.onHard = onHard;
+        running++;
+    }
+
+    /**
+     * Called on the native thread running guest code
+     */
+    void threadStart() {
+        guest = true;
+    }
+
+    /**
+     * Guest code returned, its joiners are runnable and timeouts dropped
+     */
+    void threadEnd(uint64_t tid) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Thread& thread = threads.at(tid);
+        thread.finished = true;
+        idle -= thread.joiners;
+        thread.joiners = 0;
+        running--;
+        wake.notify_all();
+        jumpIfIdle();
+    }
+
+    /**
+     * Timeouts of the thread in virtual time, returns after threadEnd
+     */
+    void waitEnd(uint64_t tid) {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;)
+        {
+            Thread& thread = threads.at(tid);
+            fireTimeouts(thread, nowLocked());
+            if (thread.finished)
+                break;
+            wake.wait_until(lock, realTime(nextTimeout(thread)));
+        }
+        threads.erase(tid);
+    }
+
+    /**
+     * Join of guest thread, idle until the joined thread ends
+     */
+    void joining(uint64_t tid) {
+        if (!guest)
+            return;
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = threads.find(tid);
+        if (found == threads.end() || found->second.finished)
+            return;
+        found->second.joiners++;
+        idle++;
+        jumpIfIdle();
+    }
+
+    /**
+     * Contended lock, idle until the next unlock of the same lock
+     */
+    void lock(uint64_t lockId, std::mutex& mtx) {
+        if (!guest)
+        {
+            mtx.lock();
+            return;
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        // try_lock under the clock mutex, unlocked() cannot slip in between
+        while (!mtx.try_lock())
+        {
+            Lock& state = locks[lockId];
+            uint64_t unlocks = state.unlocks;
+            state.waiters++;
+            idle++;
+            jumpIfIdle();
+            wake.wait(lock, [&]() { return locks[lockId].unlocks != unlocks; });
+        }
+    }
+
+    void unlocked(uint64_t lockId) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = locks.find(lockId);
+        if (found == locks.end())
+            return;
+        found->second.unlocks++;
+        idle -= found->second.waiters;
+        found->second.waiters = 0;
+        wake.notify_all();
+    }
+
+    void sleep(uint64_t milliseconds) {
+        std::unique_lock<std::mutex> lock(mutex);
+        bool waiting = guest;
+        uint64_t deadline = nowLocked() + milliseconds * 1000000;
+        auto registered = sleepers.insert({deadline, &waiting});
+        if (waiting)
+        {
+            idle++;
+            jumpIfIdle();
+        }
+        while (nowLocked() < deadline)
+            wake.wait_until(lock, realTime(deadline));
+        sleepers.erase(registered);
+        // a jump has already counted it running
+        if (waiting)
+            idle--;
+    }
+};
@@ -0,0 +1,295 @@
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+/**
+ * Long-lived VM serving requests over a Unix domain socket
+ *
+ * Text protocol, one request per line, every connection is served by its
+ * own thread:
+ *   load <path>                   -> ok <handle> | error <message>
+ *   run <handle> <payload> <n>    followed by n bytes of stdin ("-" for no payload)
+ *                                 -> out <n> followed by n bytes of console output,
+ *                                    repeated while the program runs, then
+ *                                    exit <code> <ms> <message> | error <message>
+ *   stats                         -> stats <name> <value> ...
+ *   quit
+ * Handle is the content hash of the program, loading the same file again
+ * is served from ProgramCache, paths are relative to the server.
+ *
+ * Every run is a forked VM (StartGuard) with stdin from a temporary file
+ * and stdout/stderr into a pipe the connection thread forwards, so
+ * guests are isolated from the server and from each other. Forks and
+ * loads are serialized, the child closes inherited descriptors of other
+ * connections.
+ */
+class VMServer {
+public:
+    typedef std::function<pid_t(const ProgramCache::Program& program, const std::string& payload, int input, int output)> Start;
+    typedef std::function<const char*(int code)> ExitMessage;
+
+private:
+    ProgramCache& cache;
+    Start start;
+    ExitMessage exitMessage;
+    std::mutex cacheMutex;
+    int listener = -1;
+
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    std::atomic<uint64_t> connections = 0;
+    std::atomic<uint64_t> loads = 0;
+    std::atomic<uint64_t> runs = 0;
+    std::atomic<uint64_t> failedRuns = 0;
+    std::atomic<uint64_t> runNs = 0;
+
+    /**
+     * Buffered reading of requests, stdin bytes may follow the request line
+     */
+    class Connection {
+        int fd;
+        std::string buffer;
+
+        bool fill() {
+            char chunk[4096];
+            ssize_t n = ::read(fd, chunk, sizeof(chunk));
+            if (n <= 0)
+                return false;
+            buffer.append(chunk, n);
+            return true;
+        }
+
+    public:
+        explicit Connection(int socket) : fd(socket) {}
+
+        ~Connection() {
+            close(fd);
+        }
+
+        bool readLine(std::string& line) {
+            size_t end;
+            while ((end = buffer.find('\n')) == std::string::npos)
+            {
+                if (!fill())
+                    return false;
+            }
+            line = buffer.substr(0, end);
+            buffer.erase(0, end + 1);
+            return true;
+        }
+
+        bool readBytes(size_t size, std::string& bytes) {
+            while (buffer.size() < size)
+            {
+                if (!fill())
+                    return false;
+            }
+            bytes = buffer.substr(0, size);
+            buffer.erase(0, size);
+            return true;
+        }
+
+        bool send(const char* data, size_t size) {
+            while (size)
+            {
+                ssize_t n = ::write(fd, data, size);
+                if (n <= 0)
+                    return false;
+                data += n;
+                size -= n;
+            }
+            return true;
+        }
+
+        bool send(const std::string& text) {
+            return send(text.data(), text.size());
+        }
+    };
+
+    static std::string handleName(uint64_t hash) {
+        char name[17];
+        snprintf(name, sizeof(name), "%016" PRIx64, hash);
+        return name;
+    }
+
+    bool load(Connection& connection, const std::string& path) {
+        std::lock_guard<std::mutex> guard(cacheMutex);
+        uint64_t hash = 0;
+        std::string error;
+        loads++;
+        if (!cache.load(path, hash, error))
+            return connection.send("error " + error + "\n");
+        return connection.send("ok " + handleName(hash) + "\n");
+    }
+
+    bool run(Connection& connection, const std::string& handle, const std::string& payload, size_t inputSize) {
+        std::string input;
+        if (!connection.readBytes(inputSize, input))
+            return false;
+
+        // stdin of the VM, unlinked temporary file
+        char inputName[] = "/tmp/evm2_serve_XXXXXX";
+        int inputFd = mkstemp(inputName);
+        if (inputFd < 0)
+            return connection.send("error cannot create stdin file\n");
+        unlink(inputName);
+        bool written = input.empty() || ::write(inputFd, input.data(), input.size()) == (ssize_t)input.size();
+        lseek(inputFd, 0, SEEK_SET);
+
+        int output[2];
+        if (!written || pipe(output) != 0)
+        {
+            close(inputFd);
+            return connection.send("error cannot set up console\n");
+        }
+
+        auto runStarted = std::chrono::steady_clock::now();
+        pid_t pid = -1;
+        {
+            std::lock_guard<std::mutex> guard(cacheMutex);
+            char* end = nullptr;
+            const ProgramCache::Program* program = cache.find(strtoull(handle.c_str(), &end, 16));
+            if (program && !handle.empty() && *end == 0)
+                pid = start(*program, payload == "-" ? "" : payload, inputFd, output[1]);
+        }
+        close(inputFd);
+        close(output[1]);
+        if (pid < 0)
+        {
+            close(output[0]);
+            return connection.send("error unknown handle " + handle + "\n");
+        }
+
+        // console output as it comes, client going away kills the VM
+        bool connected = true;
+        char chunk[4096];
+        for (ssize_t n; (n = ::read(output[0], chunk, sizeof(chunk))) > 0;)
+        {
+            connected = connected && connection.send("out " + std::to_string(n) + "\n") && connection.send(chunk, n);
+            if (!connected)
+                kill(pid, SIGKILL);
+        }
+        close(output[0]);
+
+        int status = 0;
+        waitpid(pid, &status, 0);
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - runStarted).count();
+        runs++;
+        runNs += ns;
+
+        int code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+        const char* message = WIFEXITED(status) ? exitMessage(code) : nullptr;
+        std::string signalMessage = WIFSIGNALED(status) ? "Killed by signal " + std::to_string(WTERMSIG(status)) : "Unknown exit code";
+        failedRuns += code != 0;
+
+        char line[64];
+        snprintf(line, sizeof(line), "exit %d %.3f ", code, ns / 1e6);
+        return connected && connection.send(line + std::string(message ? message : signalMessage.c_str()) + "\n");
+    }
+
+    bool stats(Connection& connection) {
+        size_t programs;
+        uint64_t compileNs;
+        {
+            std::lock_guard<std::mutex> guard(cacheMutex);
+            programs = cache.size();
+            compileNs = cache.totalCompileNs();
+        }
+        double uptime = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        char line[512];
+        snprintf(line, sizeof(line),
+                 "stats programs %zu compile_ms %.3f loads %" PRIu64 " runs %" PRIu64 " failed_runs %" PRIu64
+                 " run_ms %.3f connections %" PRIu64 " uptime_s %.1f\n",
+                 programs, compileNs / 1e6, loads.load(), runs.load(), failedRuns.load(), runNs.load() / 1e6,
+                 connections.load(), uptime);
+        return connection.send(line);
+    }
+
+    void serve(int fd) {
+        Connection connection(fd);
+        for (std::string line; connection.readLine(line);)
+        {
+            std::istringstream request(line);
+            std::string command;
+            request >> command;
+
+            bool alive;
+            if (command == "load")
+            {
+                std::string path;
+                std::getline(request >> std::ws, path);
+                alive = load(connection, path);
+            }
+            else if (command == "run")
+            {
+                std::string handle, payload;
+                size_t inputSize = 0;
+                if (request >> handle >> payload >> inputSize)
+                    alive = run(connection, handle, payload, inputSize);
+                else
+                    alive = connection.send("error usage: run <handle> <payload> <stdin bytes>\n");
+            }
+            else if (command == "stats")
+                alive = stats(connection);
+            else if (command == "quit")
+                alive = false;
+            else
+                alive = connection.send("error unknown request " + command + "\n");
+            if (!alive)
+                break;
+        }
+    }
+
+public:
+    VMServer(ProgramCache& programs, Start startVM, ExitMessage message)
+        : cache(programs), start(startVM), exitMessage(message) {}
+
+    /**
+     * Create the socket, an existing one at the path is replaced
+     */
+    bool listen(const std::string& path) {
+        sockaddr_un address = {};
+        if (path.size() >= sizeof(address.sun_path))
+            return false;
+        address.sun_family = AF_UNIX;
+        memcpy(address.sun_path, path.c_str(), path.size());
+
+        unlink(path.c_str());
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener < 0)
+            return false;
+        if (bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || ::listen(listener, 64) != 0)
+        {
+            close(listener);
+            listener = -1;
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Accept connections until the process is killed
+     */
+    void acceptLoop() {
+        signal(SIGPIPE, SIG_IGN);
+        for (;;)
+        {
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd < 0)
+                continue;
+            connections++;
+            std::thread([this, fd]() { serve(fd); }).detach();
+        }
+    }
+};